@@ -3,33 +3,189 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
 #include "disk_emu.h"
 
 
 FILE* fp = NULL;
 double L, p;
 double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY, lru;
+int BLOCK_SIZE, MAX_RETRY, lru;
+int64_t MAX_BLOCK;
+disk_stats stats;
+int64_t head = -1;          /* block following the last request */
+FILE* trace_fp = NULL;      /* per-request log (start_disk_trace) */
+int64_t trace_start_ns;
+__thread const char* tag = "-";    /* operation issuing the requests (per thread) */
+pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;  /* a request is atomic: sfs writes back from a thread */
 
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
 /*----------------------------------------------------------*/
 int close_disk()
 {
+    pthread_mutex_lock(&disk_lock);
     if(NULL != fp)
     {
         fclose(fp);
+        fp = NULL;
     }
+    pthread_mutex_unlock(&disk_lock);
     return 0;
 }
 
+/*-----------------------------------------------------------------*/
+/*File descriptor of the disk file (to move data without a buffer),*/
+/*the buffered writes are flushed so that it reads them            */
+/*-----------------------------------------------------------------*/
+int disk_fd()
+{
+    if(NULL == fp)
+        return -1;
+    pthread_mutex_lock(&disk_lock);
+    fflush(fp);
+    stats.flushes++;
+    pthread_mutex_unlock(&disk_lock);
+    return fileno(fp);
+}
+
+/*-------------------------------------------------------------*/
+/*Copies the I/O counters of the disk (cumulative since reset) */
+/*-------------------------------------------------------------*/
+void get_disk_stats(disk_stats *out)
+{
+    pthread_mutex_lock(&disk_lock);
+    *out = stats;
+    pthread_mutex_unlock(&disk_lock);
+}
+
+/*------------------------------*/
+/*Resets the I/O counters to 0  */
+/*------------------------------*/
+void reset_disk_stats()
+{
+    pthread_mutex_lock(&disk_lock);
+    memset(&stats, 0, sizeof(disk_stats));
+    pthread_mutex_unlock(&disk_lock);
+}
+
+/*---------------------------*/
+/*Monotonic clock, in ns     */
+/*---------------------------*/
+static int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*--------------------------------------------------------------------*/
+/*Hands the buffered writes to the system: they survive a crash of the*/
+/*process, not of the machine (see sync_disk)                         */
+/*--------------------------------------------------------------------*/
+int flush_disk()
+{
+    if(NULL == fp)
+        return -1;
+    pthread_mutex_lock(&disk_lock);
+    stats.flushes++;
+    int res = fflush(fp) == 0 ? 0 : -1;
+    pthread_mutex_unlock(&disk_lock);
+    return res;
+}
+
+/*--------------------------------------------------------------------*/
+/*Makes the blocks written so far durable: flushes the buffered writes*/
+/*and waits for the device (the only durability point of the disk)   */
+/*--------------------------------------------------------------------*/
+int sync_disk()
+{
+    if(NULL == fp)
+        return -1;
+    pthread_mutex_lock(&disk_lock);
+    int64_t start_ns = now_ns();
+    int res = fflush(fp) == 0 && fdatasync(fileno(fp)) == 0 ? 0 : -1;
+    stats.flushes++;
+    stats.syncs++;
+    stats.sync_ns += now_ns() - start_ns;
+    pthread_mutex_unlock(&disk_lock);
+    return res;
+}
+
+/*--------------------------------------------------------------------*/
+/*Starts logging every request to a text file, one line per request: */
+/*time since the start (us), R or W, first block, blocks, duration    */
+/*(ns), tag                                                           */
+/*--------------------------------------------------------------------*/
+int start_disk_trace(char *filename)
+{
+    if(NULL != trace_fp)
+        return -1;
+    trace_fp = fopen(filename, "w");
+    if(NULL == trace_fp)
+        return -1;
+    setvbuf(trace_fp, NULL, _IOFBF, 1 << 20);
+    trace_start_ns = now_ns();
+    return 0;
+}
+
+/*------------------------------------*/
+/*Stops logging and closes the trace  */
+/*------------------------------------*/
+int stop_disk_trace()
+{
+    if(NULL == trace_fp)
+        return -1;
+    int res = fclose(trace_fp);
+    trace_fp = NULL;
+    return res;
+}
+
+/*--------------------------------------------------------------------*/
+/*Labels the next requests in the trace with the operation issuing    */
+/*them (a static string, NULL for none)                               */
+/*--------------------------------------------------------------------*/
+void set_disk_tag(const char *new_tag)
+{
+    tag = NULL == new_tag ? "-" : new_tag;
+}
+
+/*--------------------------------------------------------------------*/
+/*Accounts a request: seek, size histogram, time, and the trace line  */
+/*--------------------------------------------------------------------*/
+static void account_request(char kind, int64_t start_address, int nblocks, int64_t start_ns)
+{
+    int64_t ns = now_ns() - start_ns;
+    int bucket = 0;
+
+    if (head != -1 && head != start_address)
+    {
+        stats.seeks++;
+        stats.seek_distance += start_address > head ? start_address - head : head - start_address;
+    }
+    head = start_address + nblocks;
+
+    while (bucket < DISK_STATS_BUCKETS - 1 && (nblocks >> (bucket + 1)) != 0)
+        bucket++;
+    stats.request_blocks[bucket]++;
+
+    if (kind == 'R')
+        stats.read_ns += ns;
+    else
+        stats.write_ns += ns;
+
+    if (NULL != trace_fp)
+        fprintf(trace_fp, "%lld %c %lld %d %lld %s\n", (long long)((start_ns - trace_start_ns) / 1000), kind,
+                (long long)start_address, nblocks, (long long)ns, tag);
+}
+
 /*---------------------------------------*/
 /*Initializes a disk file filled with 0's*/
 /*---------------------------------------*/
-int init_fresh_disk(char *filename, int block_size, int num_blocks)
+int init_fresh_disk(char *filename, int block_size, int64_t num_blocks)
 {
-    int i, j;
-    
     /*Set up latency at 0.02 second*/
     L = 00000.f;
     /*Set up failure at 10%*/
@@ -39,6 +195,7 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
 
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
+    head = -1;
     
     /*Initializes the random number generator*/
     srand((unsigned int)(time( 0 )) );
@@ -51,20 +208,18 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
         return -1;
     }
     
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
+    /*Extends the file with 0's to its given size (without writing them)*/
+    if (ftruncate(fileno(fp), (off_t)MAX_BLOCK * BLOCK_SIZE) != 0)
     {
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            fputc(0, fp);
-        }
+        printf("Could not extend disk file %s\n\n", filename);
+        return -1;
     }
     return 0;
 }
 /*----------------------------*/
 /*Initializes an existing disk*/
 /*----------------------------*/
-int init_disk(char *filename, int block_size, int num_blocks)
+int init_disk(char *filename, int block_size, int64_t num_blocks)
 {
     /*Set up latency at 0.02 second*/
     L = 00000.f;
@@ -75,6 +230,7 @@ int init_disk(char *filename, int block_size, int num_blocks)
 
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
+    head = -1;
     
     /*Initializes the random number generator*/
     srand((unsigned int)(time( 0 )) );
@@ -93,9 +249,9 @@ int init_disk(char *filename, int block_size, int num_blocks)
 /*-------------------------------------------------------------------*/
 /*Reads a series of blocks from the disk into the buffer             */
 /*-------------------------------------------------------------------*/
-int read_blocks(int start_address, int nblocks, void *buffer)
+int read_blocks(int64_t start_address, int nblocks, void *buffer)
 {
-    int i, j, e, s;
+    int i, e, s;
     e = 0;
     s = 0;
 
@@ -105,29 +261,36 @@ int read_blocks(int start_address, int nblocks, void *buffer)
     /*Checks that the data requested is within the range of addresses of the disk*/
     if (start_address + nblocks > MAX_BLOCK)
     {
-        printf("out of bound error %d\n", start_address);
+        printf("out of bound error %lld\n", (long long)start_address);
+        free(blockRead);
         return -1;
     }
 
+    pthread_mutex_lock(&disk_lock);
+
     /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    int64_t start_ns = now_ns();
+    fseeko(fp, (off_t)start_address * BLOCK_SIZE, SEEK_SET);
+    stats.read_calls++;
+    stats.blocks_read += nblocks;
+    stats.bytes_read += (int64_t)nblocks * BLOCK_SIZE;
 
     /*For every block requested*/
     for (i = 0; i < nblocks; ++i)
     {
         /*Pause until the latency duration is elapsed*/
-        usleep(L);
+        if (L > 0)
+            usleep(L);
 
         s++;
         fread(blockRead, BLOCK_SIZE, 1, fp);
 
-       for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            memcpy(buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
-        }
+        memcpy(buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);
     }
 
     free(blockRead);
+    account_request('R', start_address, nblocks, start_ns);
+    pthread_mutex_unlock(&disk_lock);
 
 
     /*If no failure return the number of blocks read, else return the negative number of failures*/
@@ -140,7 +303,7 @@ int read_blocks(int start_address, int nblocks, void *buffer)
 /*------------------------------------------------------------------*/
 /*Writes a series of blocks to the disk from the buffer             */
 /*------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer)
+int write_blocks(int64_t start_address, int nblocks, void *buffer)
 {
     int i, e, s;
     e = 0;
@@ -152,25 +315,35 @@ int write_blocks(int start_address, int nblocks, void *buffer)
     if (start_address + nblocks > MAX_BLOCK)
     {
         printf("out of bound error\n");
+        free(blockWrite);
         return -1;
     }
 
+    pthread_mutex_lock(&disk_lock);
+
     /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    int64_t start_ns = now_ns();
+    fseeko(fp, (off_t)start_address * BLOCK_SIZE, SEEK_SET);
+    stats.write_calls++;
+    stats.blocks_written += nblocks;
+    stats.bytes_written += (int64_t)nblocks * BLOCK_SIZE;
 
     /*For every block requested*/        
     for (i = 0; i < nblocks; ++i)
     {
         /*Pause until the latency duration is elapsed*/
-        usleep(L);
+        if (L > 0)
+            usleep(L);
 
         memcpy(blockWrite, buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
 
+        /*Buffered: the write is flushed by the next request (or sync_disk)*/
         fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
         s++;
     }
     free(blockWrite);
+    account_request('W', start_address, nblocks, start_ns);
+    pthread_mutex_unlock(&disk_lock);
 
     /*If no failure return the number of blocks written, else return the negative number of failures*/
     if (e == 0)
@@ -1,6 +1,41 @@
-int init_fresh_disk(char *filename, int block_size, int num_blocks);
-int init_disk(char *filename, int block_size, int num_blocks);
-int read_blocks(int start_address, int nblocks, void *buffer);
-int write_blocks(int start_address, int nblocks, void *buffer);
+#include <stdint.h>
+
+int init_fresh_disk(char *filename, int block_size, int64_t num_blocks);
+int init_disk(char *filename, int block_size, int64_t num_blocks);
+int read_blocks(int64_t start_address, int nblocks, void *buffer);
+int write_blocks(int64_t start_address, int nblocks, void *buffer);
 int close_disk();
- 
\ No newline at end of file
+int disk_fd();
+int flush_disk();
+int sync_disk();
+
+/* request size histogram: bucket i counts the requests of 2^i to 2^(i+1)-1
+   blocks, the last bucket all the larger ones */
+#define DISK_STATS_BUCKETS 16
+
+typedef struct {
+    int64_t read_calls;     /* number of read_blocks calls */
+    int64_t write_calls;    /* number of write_blocks calls */
+    int64_t blocks_read;
+    int64_t blocks_written;
+    int64_t bytes_read;
+    int64_t bytes_written;
+    int64_t seeks;          /* requests not starting where the previous one ended */
+    int64_t seek_distance;  /* blocks between the end of a request and the start of the next, summed */
+    int64_t flushes;        /* explicit flushes of the stdio buffer (flush_disk, sync_disk, disk_fd) */
+    int64_t syncs;          /* sync_disk calls */
+    int64_t read_ns;        /* time spent in read_blocks */
+    int64_t write_ns;       /* time spent in write_blocks */
+    int64_t sync_ns;        /* time spent in sync_disk */
+    int64_t request_blocks[DISK_STATS_BUCKETS];
+} disk_stats;
+
+/* cumulative I/O counters of the disk, since the last reset */
+void get_disk_stats(disk_stats *stats);
+void reset_disk_stats();
+
+/* optional log of every request (one text line each), labeled with the
+   operation issuing it (see set_disk_tag) */
+int start_disk_trace(char *filename);
+int stop_disk_trace();
+void set_disk_tag(const char *tag);
@@ -0,0 +1,355 @@
+/* fuse_bench.c
+ *
+ * POSIX workloads on a mounted file system, meant to be pointed at a
+ * directory of a sfs FUSE mount (and at any other file system for
+ * comparison, see fuse_bench.sh):
+ *
+ *   stream  each thread writes a file with large write() calls, flushes it,
+ *           then reads it back and checks the data (default)
+ *   create  each thread creates small files in its own directory
+ *   stat    each thread stats its files, and as many missing names
+ *   list    each thread lists its directory with the attributes (ls -l)
+ *   remove  each thread removes its files
+ *
+ * The metadata workloads run in that order on the same files. Every phase
+ * prints one line: ops/s, MB/s and the p50/p99 latency of its operations.
+ *
+ * Usage: fuse_bench [-w workload,...] [-n files per thread] <directory>
+ *                   [file size in MB] [I/O size in KB] [threads]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define BENCH_DEFAULT_SIZE  256     /* MB per thread */
+#define BENCH_DEFAULT_IO    1024    /* KB per write()/read() call */
+#define BENCH_DEFAULT_FILES 1000    /* files per thread of the metadata workloads */
+#define BENCH_SMALL_FILE    4096    /* size of the files of the create workload */
+#define BENCH_LIST_PASSES   10      /* listings of its directory by each thread */
+
+struct bench_thread {
+  char path[4096];
+  long file_size;
+  int io_size;
+  int nfiles;
+  int id;
+  int errors;
+  double *lat;          /* latency of each operation (us) */
+  long nlat;
+  long lat_cap;
+  long bytes;
+};
+
+/* the phase run by the threads */
+enum { PHASE_WRITE, PHASE_READ, PHASE_CREATE, PHASE_STAT, PHASE_LIST, PHASE_REMOVE };
+static const char *phase_names[] = { "write", "read", "create", "stat", "list", "remove" };
+static int phase;
+
+/* now() - returns a monotonic timestamp in seconds
+ */
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* record() - accounts one operation started at start (a now() timestamp)
+ */
+static void record(struct bench_thread *bt, double start, long bytes)
+{
+  if (bt->nlat == bt->lat_cap) {
+    bt->lat_cap = bt->lat_cap ? bt->lat_cap * 2 : 1024;
+    bt->lat = realloc(bt->lat, bt->lat_cap * sizeof(double));
+  }
+  bt->lat[bt->nlat++] = (now() - start) * 1e6;
+  bt->bytes += bytes;
+}
+
+/* run_stream() - writes (or reads back and checks) one file
+ */
+static void run_stream(struct bench_thread *bt)
+{
+  char *buffer = malloc(bt->io_size);
+  char *check = malloc(bt->io_size);
+  char path[4200];
+  int do_read = phase == PHASE_READ;
+
+  snprintf(path, sizeof(path), "%s/bench%d", bt->path, bt->id);
+  int fd = open(path, do_read ? O_RDONLY : (O_WRONLY | O_CREAT | O_TRUNC), 0644);
+  if (fd == -1) {
+    fprintf(stderr, "ERROR: cannot open %s\n", path);
+    bt->errors++;
+    free(buffer);
+    free(check);
+    return;
+  }
+
+  for (long done = 0; done < bt->file_size; done += bt->io_size) {
+    int len = bt->file_size - done > bt->io_size ? bt->io_size : bt->file_size - done;
+    memset(check, 'A' + (bt->id + done / bt->io_size) % 26, len);
+
+    double start = now();
+    if (do_read) {
+      if (read(fd, buffer, len) != len || memcmp(buffer, check, len) != 0) {
+        fprintf(stderr, "ERROR: read error in %s at %ld\n", path, done);
+        bt->errors++;
+        break;
+      }
+    }
+    else if (write(fd, check, len) != len) {
+      fprintf(stderr, "ERROR: short write in %s at %ld\n", path, done);
+      bt->errors++;
+      break;
+    }
+    record(bt, start, len);
+  }
+
+  if (!do_read) {
+    fsync(fd);
+  }
+  close(fd);
+  free(buffer);
+  free(check);
+}
+
+/* run_meta() - one metadata phase on the files of the thread directory
+ */
+static void run_meta(struct bench_thread *bt)
+{
+  char path[4200];
+  char data[BENCH_SMALL_FILE];
+  struct stat st;
+
+  memset(data, 'a' + bt->id % 26, sizeof(data));
+  if (phase == PHASE_CREATE) {
+    snprintf(path, sizeof(path), "%s/t%d", bt->path, bt->id);
+    mkdir(path, 0755);
+  }
+
+  if (phase == PHASE_LIST) {
+    snprintf(path, sizeof(path), "%s/t%d", bt->path, bt->id);
+    for (int pass = 0; pass < BENCH_LIST_PASSES; pass++) {
+      double start = now();
+      DIR *dir = opendir(path);
+      struct dirent *entry;
+      int count = 0;
+      if (dir == NULL) {
+        fprintf(stderr, "ERROR: cannot list %s\n", path);
+        bt->errors++;
+        return;
+      }
+      while ((entry = readdir(dir)) != NULL) {
+        fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW);
+        count++;
+      }
+      closedir(dir);
+      record(bt, start, 0);
+      if (count != bt->nfiles + 2) {
+        fprintf(stderr, "ERROR: listed %d entries in %s\n", count, path);
+        bt->errors++;
+      }
+    }
+    return;
+  }
+
+  for (int i = 0; i < bt->nfiles; i++) {
+    snprintf(path, sizeof(path), "%s/t%d/f%d", bt->path, bt->id, i);
+    double start = now();
+    if (phase == PHASE_CREATE) {
+      int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd == -1 || write(fd, data, sizeof(data)) != sizeof(data)) {
+        fprintf(stderr, "ERROR: cannot create %s\n", path);
+        bt->errors++;
+        break;
+      }
+      close(fd);
+      record(bt, start, sizeof(data));
+    } else if (phase == PHASE_STAT) {
+      if (stat(path, &st) != 0) {
+        fprintf(stderr, "ERROR: cannot stat %s\n", path);
+        bt->errors++;
+        break;
+      }
+      record(bt, start, 0);
+      /* a missing name, as build tools probe for */
+      snprintf(path, sizeof(path), "%s/t%d/m%d", bt->path, bt->id, i);
+      start = now();
+      if (stat(path, &st) == 0) {
+        bt->errors++;
+      }
+      record(bt, start, 0);
+    } else {
+      if (unlink(path) != 0) {
+        fprintf(stderr, "ERROR: cannot remove %s\n", path);
+        bt->errors++;
+        break;
+      }
+      record(bt, start, 0);
+    }
+  }
+
+  if (phase == PHASE_REMOVE) {
+    snprintf(path, sizeof(path), "%s/t%d", bt->path, bt->id);
+    rmdir(path);
+  }
+}
+
+static void *run_thread(void *arg)
+{
+  struct bench_thread *bt = arg;
+
+  if (phase == PHASE_WRITE || phase == PHASE_READ) {
+    run_stream(bt);
+  } else {
+    run_meta(bt);
+  }
+  return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* run_phase() - runs a phase on all the threads and prints its throughput
+ * and latency
+ */
+static void run_phase(struct bench_thread *bts, int nthreads, int run)
+{
+  pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+  long nlat = 0, bytes = 0;
+  double *lat;
+  double start, elapsed;
+
+  phase = run;
+  for (int i = 0; i < nthreads; i++) {
+    bts[i].nlat = 0;
+    bts[i].bytes = 0;
+  }
+
+  start = now();
+  for (int i = 0; i < nthreads; i++) {
+    pthread_create(&threads[i], NULL, run_thread, &bts[i]);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  elapsed = now() - start;
+
+  /* merge the latencies of the threads */
+  for (int i = 0; i < nthreads; i++) {
+    nlat += bts[i].nlat;
+    bytes += bts[i].bytes;
+  }
+  lat = malloc((nlat + 1) * sizeof(double));
+  nlat = 0;
+  for (int i = 0; i < nthreads; i++) {
+    memcpy(lat + nlat, bts[i].lat, bts[i].nlat * sizeof(double));
+    nlat += bts[i].nlat;
+  }
+  qsort(lat, nlat, sizeof(double), compare_double);
+
+  printf("%-8s %8d %10ld %12.1f %12.2f %10.1f %10.1f\n", phase_names[run], nthreads, nlat,
+         nlat / elapsed, bytes / elapsed / (1024 * 1024),
+         nlat ? lat[nlat / 2] : 0.0, nlat ? lat[(long)(nlat * 0.99)] : 0.0);
+  fflush(stdout);
+
+  free(lat);
+  free(threads);
+}
+
+/* is_selected() - tells if a workload is in a comma separated list
+ */
+static int is_selected(const char *list, const char *name)
+{
+  size_t len = strlen(name);
+
+  for (const char *p = list; (p = strstr(p, name)) != NULL; p += len) {
+    if ((p == list || p[-1] == ',') && (p[len] == '\0' || p[len] == ',')) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  long file_size = BENCH_DEFAULT_SIZE * 1024L * 1024;
+  int io_size = BENCH_DEFAULT_IO * 1024;
+  int nfiles = BENCH_DEFAULT_FILES;
+  const char *workloads = "stream";
+  int nthreads = 1;
+  int error_count = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "w:n:")) != -1) {
+    if (opt == 'w') {
+      workloads = optarg;
+    } else if (opt == 'n') {
+      nfiles = atoi(optarg);
+    } else {
+      argc = 0;
+    }
+  }
+  /* the positional arguments, as if there were no option */
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: fuse_bench [-w stream,create,stat,list,remove] [-n files per thread] "
+            "<directory> [file size in MB] [I/O size in KB] [threads]\n");
+    return 2;
+  }
+  if (argc > 2) {
+    file_size = atol(argv[2]) * 1024 * 1024;
+  }
+  if (argc > 3) {
+    io_size = atoi(argv[3]) * 1024;
+  }
+  if (argc > 4) {
+    nthreads = atoi(argv[4]);
+  }
+
+  struct bench_thread *bts = calloc(nthreads, sizeof(struct bench_thread));
+  for (int i = 0; i < nthreads; i++) {
+    snprintf(bts[i].path, sizeof(bts[i].path), "%s", argv[1]);
+    bts[i].file_size = file_size;
+    bts[i].io_size = io_size;
+    bts[i].nfiles = nfiles;
+    bts[i].id = i;
+  }
+
+  printf("%-8s %8s %10s %12s %12s %10s %10s\n", "phase", "threads", "ops", "ops/s", "MB/s", "p50_us", "p99_us");
+  if (is_selected(workloads, "stream")) {
+    run_phase(bts, nthreads, PHASE_WRITE);
+    run_phase(bts, nthreads, PHASE_READ);
+    for (int i = 0; i < nthreads; i++) {
+      char path[4200];
+      snprintf(path, sizeof(path), "%s/bench%d", argv[1], i);
+      unlink(path);
+    }
+  }
+  for (int run = PHASE_CREATE; run <= PHASE_REMOVE; run++) {
+    if (is_selected(workloads, phase_names[run])) {
+      run_phase(bts, nthreads, run);
+    }
+  }
+
+  for (int i = 0; i < nthreads; i++) {
+    error_count += bts[i].errors;
+    free(bts[i].lat);
+  }
+
+  fprintf(stderr, "Benchmark exiting with %d errors\n", error_count);
+  free(bts);
+  return error_count != 0;
+}
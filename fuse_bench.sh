@@ -0,0 +1,138 @@
+#!/bin/sh
+# fuse_bench.sh
+#
+# End-to-end benchmark of the sfs FUSE mount, as its users see it: formats
+# and mounts a fresh image in a temporary directory, runs the fuse_bench
+# workloads (streaming, create, stat, ls -l and remove storms) and a tar
+# extraction on it, unmounts it, then runs the same on tmpfs as a baseline.
+#
+# Usage: fuse_bench.sh [-f fuse binary] [-b fuse_bench binary] [-t threads]
+#                      [-s stream MB per thread] [-i I/O KB] [-n files per thread]
+#                      [-a tarball to extract]
+#
+# The fuse binary is the Makefile executable built with fuse_wrappers.c (or
+# fuse_ll_wrappers.c) as SOURCES, it formats its image in its working
+# directory. Without -a, a tarball of small files is generated.
+
+FUSE_BIN=./Jeremie_Poisson_sfs
+BENCH_BIN=./fuse_bench
+THREADS=4
+STREAM_MB=64
+IO_KB=1024
+FILES=500
+TARBALL=
+
+while getopts "f:b:t:s:i:n:a:" opt; do
+    case $opt in
+        f) FUSE_BIN=$OPTARG ;;
+        b) BENCH_BIN=$OPTARG ;;
+        t) THREADS=$OPTARG ;;
+        s) STREAM_MB=$OPTARG ;;
+        i) IO_KB=$OPTARG ;;
+        n) FILES=$OPTARG ;;
+        a) TARBALL=$OPTARG ;;
+        *) echo "usage: $0 [-f fuse binary] [-b fuse_bench binary] [-t threads] [-s stream MB]" \
+               "[-i I/O KB] [-n files] [-a tarball]" >&2; exit 2 ;;
+    esac
+done
+
+for bin in "$FUSE_BIN" "$BENCH_BIN"; do
+    if [ ! -x "$bin" ]; then
+        echo "ERROR: $bin not found (see the Makefile)" >&2
+        exit 2
+    fi
+done
+FUSE_BIN=$(cd "$(dirname "$FUSE_BIN")" && pwd)/$(basename "$FUSE_BIN")
+BENCH_BIN=$(cd "$(dirname "$BENCH_BIN")" && pwd)/$(basename "$BENCH_BIN")
+
+TMP=$(mktemp -d)
+TMPFS_DIR=
+errors=0
+
+cleanup() {
+    if grep -q " $TMP/sfs " /proc/mounts 2>/dev/null; then
+        fusermount -u "$TMP/sfs" 2>/dev/null || umount "$TMP/sfs"
+    fi
+    if grep -q " $TMP/tmpfs " /proc/mounts 2>/dev/null; then
+        umount "$TMP/tmpfs"
+    fi
+    [ -n "$TMPFS_DIR" ] && rm -rf "$TMPFS_DIR"
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+now() {
+    date +%s.%N
+}
+
+# make_tarball - small files (1K to 32K, 100 per directory) with short
+# names, the sfs names are limited to 13 characters
+make_tarball() {
+    mkdir -p "$TMP/src"
+    i=0
+    while [ $i -lt $((FILES * THREADS)) ]; do
+        dir="$TMP/src/d$((i / 100))"
+        [ -d "$dir" ] || mkdir "$dir"
+        head -c $((1024 << (i % 6))) /dev/urandom > "$dir/f$i"
+        i=$((i + 1))
+    done
+    tar -cf "$TMP/src.tar" -C "$TMP/src" .
+    rm -rf "$TMP/src"
+    TARBALL=$TMP/src.tar
+}
+
+# run_target <name> <directory> - runs the workloads on a mounted directory
+run_target() {
+    name=$1
+    dir=$2
+
+    "$BENCH_BIN" -w stream,create,stat,list,remove -n "$FILES" "$dir" "$STREAM_MB" "$IO_KB" "$THREADS" \
+        2>"$TMP/bench.err" | tail -n +2 | sed "s/^/$(printf '%-6s ' "$name")/"
+    grep -q "exiting with 0 errors" "$TMP/bench.err" || { cat "$TMP/bench.err" >&2; errors=$((errors + 1)); }
+
+    files=$(tar -tf "$TARBALL" | grep -vc '/$')
+    bytes=$(wc -c < "$TARBALL")
+    mkdir "$dir/tar"
+    start=$(now)
+    # sfs keeps no owner, permissions or times: do not ask tar to restore them
+    tar -m --no-same-owner --no-same-permissions -xf "$TARBALL" -C "$dir/tar" || errors=$((errors + 1))
+    sync
+    end=$(now)
+    awk -v n="$name" -v f="$files" -v b="$bytes" -v s="$start" -v e="$end" \
+        'BEGIN { t = e - s; printf "%-6s %-8s %8d %10d %12.1f %12.2f %10s %10s\n", n, "tar", 1, f, f / t, b / t / 1048576, "-", "-" }'
+    rm -rf "$dir/tar"
+}
+
+[ -n "$TARBALL" ] || make_tarball
+
+printf "%-6s %-8s %8s %10s %12s %12s %10s %10s\n" "target" "phase" "threads" "ops" "ops/s" "MB/s" "p50_us" "p99_us"
+
+# sfs: the binary formats a fresh image in $TMP and mounts it
+mkdir "$TMP/sfs"
+(cd "$TMP" && "$FUSE_BIN" "$TMP/sfs")
+i=0
+while ! grep -q " $TMP/sfs " /proc/mounts; do
+    i=$((i + 1))
+    if [ $i -gt 50 ]; then
+        echo "ERROR: $FUSE_BIN did not mount $TMP/sfs" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+run_target sfs "$TMP/sfs"
+fusermount -u "$TMP/sfs" 2>/dev/null || umount "$TMP/sfs"
+
+# tmpfs baseline: a private mount as root, /dev/shm otherwise
+mkdir "$TMP/tmpfs"
+if mount -t tmpfs tmpfs "$TMP/tmpfs" 2>/dev/null; then
+    run_target tmpfs "$TMP/tmpfs"
+elif grep -q " /dev/shm tmpfs " /proc/mounts; then
+    TMPFS_DIR=$(mktemp -d /dev/shm/fuse_bench.XXXXXX)
+    run_target tmpfs "$TMPFS_DIR"
+else
+    echo "no tmpfs available, baseline skipped" >&2
+fi
+
+echo "Benchmark exiting with $errors errors" >&2
+[ $errors -eq 0 ]
@@ -0,0 +1,483 @@
+/* fuse_ll_wrappers.c
+ *
+ * Low-level FUSE front end: requests are addressed by inode number (no path
+ * walk) and file data is spliced from the disk image to the kernel without
+ * going through a user buffer.
+ *
+ * FUSE inode numbers are the sfs inode numbers with the root directory
+ * swapped with FUSE_ROOT_ID. Each entry replied counts as a reference of the
+ * kernel (sfs_ihold) until it forgets it: a file removed meanwhile is freed
+ * by the last forget, and the generation of a number changes with each file
+ * created with it, so the kernel never takes a new file for an old one.
+ *
+ * /.sfs_stats is a read-only virtual file: the counters of sfs_stats, as of
+ * its opening.
+ *
+ * Built against libfuse 2 (pkg-config fuse, see the Makefile): make sfs_fuse_ll
+ */
+#define FUSE_USE_VERSION 26
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include "disk_emu.h"
+#include "sfs_api.h"
+
+#define SFS_FUSE_MAX_IO     (1024 * 1024)   // max_write/max_read/readahead (bytes)
+#define SFS_FUSE_MAX_IO_STR "1048576"
+#define SFS_FUSE_TIMEOUT    30.0            // entry/attr cache timeout (seconds)
+#define SFS_FUSE_BLOCK_SIZE (64 * 1024)     // geometry of the mounted disk: 4GB (sparse image)
+#define SFS_FUSE_NUM_BLOCKS 65536
+#define SFS_FUSE_NUM_INODES 16384
+#define SFS_LL_MAX_EXTENTS  256             // pieces per spliced read
+#define SFS_LL_DIR_BATCH    64              // directory entries read per sfs call
+#define SFS_FUSE_STATS_NAME ".sfs_stats"    // virtual file of the root directory
+#define SFS_FUSE_STATS_SIZE (64 * 1024)     // max size of its text
+#define SFS_LL_STATS_INO    ((fuse_ino_t)SFS_FUSE_NUM_INODES + FUSE_ROOT_ID)    // past the sfs inodes
+
+static int root_inode;
+static char *zero_buff;     // source of the holes of spliced reads
+static uint64_t *generations;   // of each sfs inode number
+
+static fuse_ino_t to_fuse_ino(int inode_index)
+{
+    return (fuse_ino_t)(inode_index ^ root_inode) + FUSE_ROOT_ID;
+}
+
+static int to_sfs_ino(fuse_ino_t ino)
+{
+    return (int)(ino - FUSE_ROOT_ID) ^ root_inode;
+}
+
+static int is_stats_entry(fuse_ino_t parent, const char *name)
+{
+    return parent == FUSE_ROOT_ID && strcmp(name, SFS_FUSE_STATS_NAME) == 0;
+}
+
+/*
+ * The attributes of the stats file: its size is the length of the text at
+ * the time of the call (it is opened with direct_io, the reads do not stop
+ * at that size)
+ */
+static void stats_attr(struct stat *stbuf)
+{
+    int len = sfs_stats_format(NULL, 0);
+
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = SFS_LL_STATS_INO;
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = len < SFS_FUSE_STATS_SIZE ? len : SFS_FUSE_STATS_SIZE - 1;
+}
+
+static int fill_entry(int inode_index, struct fuse_entry_param *e)
+{
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    if (sfs_igetattr(inode_index, &e->attr) == -1)
+        return -1;
+
+    e->ino = to_fuse_ino(inode_index);
+    e->generation = generations[inode_index];
+    e->attr.st_ino = e->ino;
+    e->attr_timeout = SFS_FUSE_TIMEOUT;
+    e->entry_timeout = SFS_FUSE_TIMEOUT;
+    return 0;
+}
+
+/*
+ * Replies with the entry of an inode (opened if fi is given, for create),
+ * counted as a reference of the kernel until its forget
+ */
+static void reply_entry(fuse_req_t req, int inode_index, struct fuse_file_info *fi)
+{
+    struct fuse_entry_param e;
+    int res;
+
+    if (fill_entry(inode_index, &e) == -1 || sfs_ihold(inode_index) == -1) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+
+    res = fi != NULL ? fuse_reply_create(req, &e, fi) : fuse_reply_entry(req, &e);
+    if (res != 0)
+        sfs_iforget(inode_index, 1);    // the request was interrupted, the kernel did not get it
+}
+
+static void sfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fuse_entry_param e;
+    int inode_index;
+
+    if (is_stats_entry(parent, name)) {
+        memset(&e, 0, sizeof(struct fuse_entry_param));
+        e.ino = SFS_LL_STATS_INO;
+        stats_attr(&e.attr);
+        fuse_reply_entry(req, &e);
+        return;
+    }
+
+    inode_index = sfs_ilookup(to_sfs_ino(parent), name);
+    if (inode_index == -1)
+        fuse_reply_err(req, ENOENT);
+    else
+        reply_entry(req, inode_index, NULL);
+}
+
+static void sfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    if (ino != SFS_LL_STATS_INO)
+        sfs_iforget(to_sfs_ino(ino), nlookup);
+    fuse_reply_none(req);
+}
+
+static void sfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct stat stbuf;
+
+    if (ino == SFS_LL_STATS_INO) {
+        stats_attr(&stbuf);
+        fuse_reply_attr(req, &stbuf, 0);
+        return;
+    }
+
+    if (sfs_igetattr(to_sfs_ino(ino), &stbuf) == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+
+    stbuf.st_ino = ino;
+    fuse_reply_attr(req, &stbuf, SFS_FUSE_TIMEOUT);
+}
+
+static void sfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+        int to_set, struct fuse_file_info *fi)
+{
+    if (ino == SFS_LL_STATS_INO) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+
+    // only the size can change (truncate/ftruncate), the rest is fixed
+    if ((to_set & FUSE_SET_ATTR_SIZE) && sfs_itruncate(to_sfs_ino(ino), attr->st_size) == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+
+    sfs_ll_getattr(req, ino, fi);
+}
+
+/*
+ * Adds an entry to a readdir reply (the kernel only uses the inode number
+ * and the type of the attributes).
+ * Returns the size of the entry, larger than space if it did not fit.
+ */
+static size_t add_dir_entry(fuse_req_t req, char *buf, size_t space,
+        const sfs_dirent *entry, off_t next)
+{
+    struct stat st;
+
+    memset(&st, 0, sizeof(struct stat));
+    st.st_ino = to_fuse_ino(entry->inode_index);
+    st.st_mode = entry->mode;
+    return fuse_add_direntry(req, buf, space, entry->name, &st, next);
+}
+
+static void sfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+        off_t off, struct fuse_file_info *fi)
+{
+    sfs_dirent entries[SFS_LL_DIR_BATCH];
+    sfs_dir_cursor cursor;
+    int dir_inode = to_sfs_ino(ino);
+    size_t used = 0;
+    int full = 0;
+    int count;
+
+    if (sfs_iopendir(dir_inode, &cursor) == -1) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    char *buf = malloc(size);
+
+    // offsets: 1 is after ".", 2 after "..", n + 2 after the n-th entry
+    for (off_t pos = off; pos < 2 && !full; pos++) {
+        sfs_dirent dot = { "", dir_inode, 0, S_IFDIR | 0755, 0 };
+        strcpy(dot.name, pos == 0 ? "." : "..");
+
+        size_t entry_size = add_dir_entry(req, buf + used, size - used, &dot, pos + 1);
+        full = entry_size > size - used;
+        if (!full)
+            used += entry_size;
+    }
+
+    cursor.position = off > 2 ? off - 2 : 0;
+    while (!full && (count = sfs_readdir_batch(&cursor, entries, SFS_LL_DIR_BATCH)) > 0) {
+        for (int i = 0; i < count && !full; i++) {
+            size_t entry_size = add_dir_entry(req, buf + used, size - used, &entries[i],
+                    entries[i].next_position + 2);
+            full = entry_size > size - used;
+            if (!full)
+                used += entry_size;
+        }
+    }
+
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+static void sfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct stat stbuf;
+
+    if (ino == SFS_LL_STATS_INO) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+            fuse_reply_err(req, EACCES);
+            return;
+        }
+        // the text is formatted once, the reads see a consistent snapshot
+        char *text = malloc(SFS_FUSE_STATS_SIZE);
+        if (text == NULL) {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        }
+        sfs_stats_format(text, SFS_FUSE_STATS_SIZE);
+        fi->fh = (uintptr_t)text;
+        fi->direct_io = 1;
+        fuse_reply_open(req, fi);
+        return;
+    }
+
+    if (sfs_igetattr(to_sfs_ino(ino), &stbuf) == -1)
+        fuse_reply_err(req, ENOENT);
+    else if (S_ISDIR(stbuf.st_mode))
+        fuse_reply_err(req, EISDIR);
+    else {
+        // all changes go through this mount, the page cache stays valid
+        fi->keep_cache = 1;
+        fuse_reply_open(req, fi);
+    }
+}
+
+static void sfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+        mode_t mode, struct fuse_file_info *fi)
+{
+    int inode_index = is_stats_entry(parent, name) ? -1 : sfs_icreate(to_sfs_ino(parent), name, mode & ~S_IFMT);
+
+    if (inode_index == -1) {
+        fuse_reply_err(req, is_stats_entry(parent, name) ? EEXIST : errno);
+        return;
+    }
+
+    generations[inode_index]++;
+    fi->keep_cache = 1;
+    reply_entry(req, inode_index, fi);
+}
+
+static void sfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    int inode_index = is_stats_entry(parent, name) ? -1 : sfs_icreate(to_sfs_ino(parent), name, S_IFDIR | mode);
+
+    if (inode_index == -1) {
+        fuse_reply_err(req, is_stats_entry(parent, name) ? EEXIST : errno);
+        return;
+    }
+
+    generations[inode_index]++;
+    reply_entry(req, inode_index, NULL);
+}
+
+static void sfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    fuse_reply_err(req, sfs_iunlink(to_sfs_ino(parent), name) == -1 ? errno : 0);
+}
+
+static void sfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    fuse_reply_err(req, sfs_iunlink(to_sfs_ino(parent), name) == -1 ? errno : 0);
+}
+
+static void sfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+        fuse_ino_t newparent, const char *newname)
+{
+    int res = sfs_irename(to_sfs_ino(parent), name, to_sfs_ino(newparent), newname);
+
+    fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+/*
+ * Reads are served by mapping the range to the disk image and letting the
+ * kernel splice it from the image file, holes come from a buffer of zeros.
+ * Inline files (and ranges too fragmented to map) are read in a buffer.
+ */
+static void sfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+        off_t off, struct fuse_file_info *fi)
+{
+    sfs_extent extents[SFS_LL_MAX_EXTENTS];
+    int count;
+
+    if (ino == SFS_LL_STATS_INO) {
+        const char *text = (const char *)(uintptr_t)fi->fh;
+        size_t len = strlen(text);
+        if (off >= len)
+            fuse_reply_buf(req, NULL, 0);
+        else
+            fuse_reply_buf(req, text + off, len - off < size ? len - off : size);
+        return;
+    }
+
+    if (size > SFS_FUSE_MAX_IO)
+        size = SFS_FUSE_MAX_IO;
+
+    count = sfs_imap(to_sfs_ino(ino), off, size, extents, SFS_LL_MAX_EXTENTS);
+    if (count == -1) {
+        char *buf = malloc(size);
+        int res = sfs_iread(to_sfs_ino(ino), buf, size, off);
+        if (res == -1)
+            fuse_reply_err(req, errno);
+        else
+            fuse_reply_buf(req, buf, res);
+        free(buf);
+        return;
+    }
+
+    struct fuse_bufvec *bufv = calloc(1, sizeof(struct fuse_bufvec) + count * sizeof(struct fuse_buf));
+    bufv->count = count;
+    for (int i = 0; i < count; i++) {
+        bufv->buf[i].size = extents[i].len;
+        if (extents[i].disk_offset == -1) {
+            bufv->buf[i].mem = zero_buff;
+        } else {
+            bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+            bufv->buf[i].fd = disk_fd();
+            bufv->buf[i].pos = extents[i].disk_offset;
+        }
+    }
+
+    fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+    free(bufv);
+}
+
+static void sfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+        size_t size, off_t off, struct fuse_file_info *fi)
+{
+    int res = sfs_iwrite(to_sfs_ino(ino), (char *)buf, size, off);
+
+    if (res == -1)
+        fuse_reply_err(req, errno);
+    else
+        fuse_reply_write(req, res);
+}
+
+static void sfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    if (ino == SFS_LL_STATS_INO)
+        free((char *)(uintptr_t)fi->fh);
+    else
+        sfs_iclose(to_sfs_ino(ino));
+    fuse_reply_err(req, 0);
+}
+
+// close() is not a durability point: only fsync and sync commit, so the
+// writers that close many files still share the journal commits
+static void sfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    if (ino == SFS_LL_STATS_INO)
+        fuse_reply_err(req, 0);
+    else
+        fuse_reply_err(req, sfs_isync(to_sfs_ino(ino), datasync) == -1 ? EIO : 0);
+}
+
+static void sfs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, sfs_sync() == -1 ? EIO : 0);
+}
+
+static void sfs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct statvfs stbuf;
+
+    sfs_statfs(&stbuf);
+    fuse_reply_statfs(req, &stbuf);
+}
+
+static void sfs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    conn->max_write = SFS_FUSE_MAX_IO;
+    conn->max_readahead = SFS_FUSE_MAX_IO;
+    conn->want |= FUSE_CAP_BIG_WRITES | FUSE_CAP_ASYNC_READ;
+    conn->want |= FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+    // SFS_TRACE=<absolute path> records the sfs calls of the mount (see sfs_replay.c)
+    if (getenv("SFS_TRACE") != NULL)
+        sfs_trace_start(getenv("SFS_TRACE"));
+    // SFS_DISK_TRACE=<absolute path> logs its disk requests (see start_disk_trace)
+    if (getenv("SFS_DISK_TRACE") != NULL)
+        start_disk_trace(getenv("SFS_DISK_TRACE"));
+}
+
+static struct fuse_lowlevel_ops sfs_ll_oper = {
+    .init = sfs_ll_init,
+    .lookup = sfs_ll_lookup,
+    .forget = sfs_ll_forget,
+    .getattr = sfs_ll_getattr,
+    .setattr = sfs_ll_setattr,
+    .readdir = sfs_ll_readdir,
+    .open = sfs_ll_open,
+    .create = sfs_ll_create,
+    .mkdir = sfs_ll_mkdir,
+    .unlink = sfs_ll_unlink,
+    .rmdir = sfs_ll_rmdir,
+    .rename = sfs_ll_rename,
+    .read = sfs_ll_read,
+    .write = sfs_ll_write,
+    .release = sfs_ll_release,
+    .fsync = sfs_ll_fsync,
+    .fsyncdir = sfs_ll_fsyncdir,
+    .statfs = sfs_ll_statfs,
+};
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_chan *ch;
+    char *mountpoint;
+    int err = -1;
+
+    if (sfs_mkfs(SFS_API_FILENAME, SFS_FUSE_BLOCK_SIZE, SFS_FUSE_NUM_BLOCKS, SFS_FUSE_NUM_INODES) == -1) {
+        fprintf(stderr, "cannot format %s\n", SFS_API_FILENAME);
+        return 1;
+    }
+    root_inode = sfs_root_inode();
+    zero_buff = calloc(1, SFS_FUSE_MAX_IO);
+    generations = calloc(SFS_FUSE_NUM_INODES, sizeof(uint64_t));
+
+    fuse_opt_add_arg(&args, "-obig_writes,max_write=" SFS_FUSE_MAX_IO_STR ",max_read=" SFS_FUSE_MAX_IO_STR);
+
+    // single threaded loop: the data path is spliced by the kernel, and the
+    // extents of a read stay valid until it is replied
+    if (fuse_parse_cmdline(&args, &mountpoint, NULL, NULL) != -1 &&
+            (ch = fuse_mount(mountpoint, &args)) != NULL) {
+        struct fuse_session *se = fuse_lowlevel_new(&args, &sfs_ll_oper, sizeof(sfs_ll_oper), NULL);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                err = fuse_session_loop(se);
+                sfs_trace_stop();
+                stop_disk_trace();
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    fuse_opt_free_args(&args);
+    free(zero_buff);
+    free(generations);
+
+    return err ? 1 : 0;
+}
@@ -9,43 +9,74 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/time.h>
 #include "disk_emu.h"
 #include "sfs_api.h"
+
+#define SFS_FUSE_MAX_IO     (1024 * 1024)   // max_write/max_read/readahead (bytes)
+#define SFS_FUSE_MAX_IO_STR "1048576"
+#define SFS_FUSE_TIMEOUT    "30"            // entry/attr cache timeout (seconds)
+#define SFS_FUSE_BLOCK_SIZE (64 * 1024)     // geometry of the mounted disk: 4GB (sparse image)
+#define SFS_FUSE_NUM_BLOCKS 65536
+#define SFS_FUSE_NUM_INODES 16384
+#define SFS_FUSE_DIR_BATCH  64              // directory entries read per sfs call
+#define SFS_FUSE_STATS_PATH "/.sfs_stats"   // read-only virtual file: the counters of sfs_stats
+#define SFS_FUSE_STATS_SIZE (64 * 1024)     // max size of its text
  
+static int is_stats_path(const char *path)
+{
+    return strcmp(path, SFS_FUSE_STATS_PATH) == 0;
+}
+
 static int fuse_getattr(const char *path, struct stat *stbuf)
 {
-    int res = 0;
-    int size;
-    
-    memset(stbuf, 0, sizeof(struct stat));
-    
-    if (strcmp(path, "/") == 0) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-    } else if((size = sfs_getfilesize(path)) != -1) {
-        stbuf->st_mode = S_IFREG | 0666;
+    if (is_stats_path(path)) {
+        // the length of the text now, it is opened with direct_io: the reads
+        // do not stop at this size
+        int len = sfs_stats_format(NULL, 0);
+        memset(stbuf, 0, sizeof(struct stat));
+        stbuf->st_mode = S_IFREG | 0444;
         stbuf->st_nlink = 1;
-        stbuf->st_size = size;
-    } else
-        res = -ENOENT;
+        stbuf->st_size = len < SFS_FUSE_STATS_SIZE ? len : SFS_FUSE_STATS_SIZE - 1;
+        return 0;
+    }
     
-    return res;
+    if (sfs_stat(path, stbuf) == -1)
+        return -errno;
+    
+    return 0;
 }
 
 static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         off_t offset, struct fuse_file_info *fi)
 {
-    char file_name[SFS_MAX_FILENAME];
+    sfs_dirent entries[SFS_FUSE_DIR_BATCH];
+    sfs_dir_cursor cursor;
+    struct stat st;
+    int count;
     
-    if (strcmp(path, "/") != 0)
-        return -ENOENT;
+    if (sfs_opendir(path, &cursor) == -1)
+        return -errno;
     
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+    // offsets: 1 is after ".", 2 after "..", n + 2 after the n-th entry, so
+    // a listing too large for the buffer is resumed where it stopped
+    memset(&st, 0, sizeof(struct stat));
+    st.st_mode = S_IFDIR | 0755;
+    if (offset < 1 && filler(buf, ".", &st, 1))
+        return 0;
+    if (offset < 2 && filler(buf, "..", &st, 2))
+        return 0;
     
-    while(sfs_getnextfilename(file_name)) {
-        filler(buf, &file_name[0], NULL, 0);
+    cursor.position = offset > 2 ? offset - 2 : 0;
+    while ((count = sfs_readdir_batch(&cursor, entries, SFS_FUSE_DIR_BATCH)) > 0) {
+        for (int i = 0; i < count; i++) {
+            st.st_ino = entries[i].inode_index;
+            st.st_mode = entries[i].mode;
+            st.st_size = entries[i].size;
+            if (filler(buf, entries[i].name, &st, entries[i].next_position + 2))
+                return 0;
+        }
     }
     
     return 0;
@@ -54,9 +85,9 @@ static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int fuse_unlink(const char *path)
 {
     int res;
-    char filename[SFS_MAX_FILENAME];
+    char filename[PATH_MAX];
     
-    strcpy(filename, path + 1);
+    strcpy(filename, path);
     res = sfs_remove(filename);
     if (res == -1)
         return -errno;
@@ -64,84 +95,161 @@ static int fuse_unlink(const char *path)
     return 0;
 }
 
+static int fuse_rename(const char *from, const char *to)
+{
+    if (sfs_rename(from, to) == -1)
+        return -errno;
+    
+    return 0;
+}
+
 static int fuse_open(const char *path, struct fuse_file_info *fi)
 {
     int res;
-    char filename[SFS_MAX_FILENAME];
+    char filename[PATH_MAX];
+    
+    if (is_stats_path(path)) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EACCES;
+        // the text is formatted once, the reads see a consistent snapshot
+        char *text = malloc(SFS_FUSE_STATS_SIZE);
+        if (text == NULL)
+            return -ENOMEM;
+        sfs_stats_format(text, SFS_FUSE_STATS_SIZE);
+        fi->fh = (uintptr_t)text;
+        fi->direct_io = 1;
+        return 0;
+    }
     
     strcpy(filename, path);
     
-    res = sfs_fopen(filename);
+    res = sfs_fopen_shared(filename);
     if (res == -1)
         return -errno;
     
-    sfs_fclose(res);
+    // keep the file opened until release, read/write use the descriptor
+    fi->fh = res;
     return 0;
 }
 
 static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi)
 {
-    int fd;
     int res;
     
-    char filename[SFS_MAX_FILENAME];
-    
-    strcpy(filename, path);
+    if (is_stats_path(path)) {
+        const char *text = (const char *)(uintptr_t)fi->fh;
+        size_t len = strlen(text);
+        if (offset >= len)
+            return 0;
+        if (size > len - offset)
+            size = len - offset;
+        memcpy(buf, text + offset, size);
+        return size;
+    }
     
-    fd = sfs_fopen(filename);
-    if (fd == -1)
+    res = sfs_pread(fi->fh, buf, size, offset);
+    if (res == -1)
         return -errno;
     
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
+    return res;
+}
+
+static int fuse_write(const char *path, const char *buf, size_t size,
+        off_t offset, struct fuse_file_info *fi)
+{
+    int res;
     
-    res = sfs_fread(fd, buf, size);
+    res = sfs_pwrite(fi->fh, (char *)buf, size, offset);
     if (res == -1)
         return -errno;
     
-    sfs_fclose(fd);
     return res;
 }
 
-static int fuse_write(const char *path, const char *buf, size_t size,
-        off_t offset, struct fuse_file_info *fi)
+static int fuse_release(const char *path, struct fuse_file_info *fi)
 {
+    if (is_stats_path(path))
+        free((char *)(uintptr_t)fi->fh);
+    else
+        sfs_fclose(fi->fh);
+    return 0;
+}
+
+// close() is not a durability point: only fsync and sync commit, so the
+// writers that close many files still share the journal commits
+static int fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    if (is_stats_path(path))
+        return 0;
+    
+    if ((datasync ? sfs_fdatasync(fi->fh) : sfs_fsync(fi->fh)) == -1)
+        return -EIO;
+    
+    return 0;
+}
+
+static int fuse_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    if (sfs_sync() == -1)
+        return -EIO;
+    
+    return 0;
+}
+
+static int fuse_truncate(const char *path, off_t size)
+{
+    char filename[PATH_MAX];
     int fd;
     int res;
     
-    char filename[SFS_MAX_FILENAME];
+    if (is_stats_path(path))
+        return -EACCES;
     
     strcpy(filename, path);
     
-    fd = sfs_fopen(filename);
-    if (fd == -1) 
+    fd = sfs_fopen_shared(filename);
+    if (fd == -1)
         return -errno;
     
-    if(sfs_fseek(fd, offset) == -1)
+    // the close must not clobber the error of the truncate
+    res = sfs_ftruncate(fd, size) == -1 ? -errno : 0;
+    sfs_fclose(fd);
+    return res;
+}
+
+static int fuse_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    if (sfs_ftruncate(fi->fh, size) == -1)
         return -errno;
     
-    res = sfs_fwrite(fd, buf, size);
-    if (res == -1)
+    return 0;
+}
+
+static int fuse_statfs(const char *path, struct statvfs *stbuf)
+{
+    return sfs_statfs(stbuf);
+}
+
+static int fuse_mkdir(const char *path, mode_t mode)
+{
+    char dirname[PATH_MAX];
+    
+    strcpy(dirname, path);
+    if (sfs_mkdir(dirname) == -1)
         return -errno;
     
-    sfs_fclose(fd);
-    return res;
+    return 0;
 }
 
-static int fuse_truncate(const char *path, off_t size)
+static int fuse_rmdir(const char *path)
 {
-    char filename[SFS_MAX_FILENAME];
-    int fd;
-    
-    strcpy(filename, path);
+    char dirname[PATH_MAX];
     
-    fd = sfs_remove(filename);
-    if (fd == -1)
+    strcpy(dirname, path);
+    if (sfs_rmdir(dirname) == -1)
         return -errno;
     
-    fd = sfs_fopen(filename);
-    sfs_fclose(fd);
     return 0;
 }
 
@@ -157,32 +265,85 @@ static int fuse_mknod(const char *path, mode_t mode, dev_t rdev)
 
 static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp)
 {
-    char filename[SFS_MAX_FILENAME];
+    char filename[PATH_MAX];
     int fd;
     
+    if (is_stats_path(path))
+        return -EEXIST;
+    
     strcpy(filename, path);
-    fd = sfs_fopen(filename);
+    fd = sfs_fopen_shared(filename);
+    if (fd == -1)
+        return -errno;
     
-    sfs_fclose(fd);
+    fp->fh = fd;
     return 0;
 }
 
+static void *fuse_init(struct fuse_conn_info *conn)
+{
+    // large requests and read-ahead, the kernel batches the page cache in 1MB
+    conn->max_write = SFS_FUSE_MAX_IO;
+    conn->max_readahead = SFS_FUSE_MAX_IO;
+    conn->want |= FUSE_CAP_BIG_WRITES | FUSE_CAP_ASYNC_READ;
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+    // let the kernel coalesce small writes (libfuse 3 only)
+    if (conn->capable & FUSE_CAP_WRITEBACK_CACHE)
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+#endif
+    // SFS_TRACE=<absolute path> records the sfs calls of the mount (see sfs_replay.c)
+    if (getenv("SFS_TRACE") != NULL)
+        sfs_trace_start(getenv("SFS_TRACE"));
+    // SFS_DISK_TRACE=<absolute path> logs its disk requests (see start_disk_trace)
+    if (getenv("SFS_DISK_TRACE") != NULL)
+        start_disk_trace(getenv("SFS_DISK_TRACE"));
+    return NULL;
+}
+
 static struct fuse_operations xmp_oper = {
     .getattr = fuse_getattr,
+    .statfs = fuse_statfs,
     .readdir = fuse_readdir,
     .mknod = fuse_mknod,
     .unlink = fuse_unlink,
+    .mkdir = fuse_mkdir,
+    .rmdir = fuse_rmdir,
+    .rename = fuse_rename,
     .truncate = fuse_truncate,
+    .ftruncate = fuse_ftruncate,
     .open = fuse_open, 
     .read = fuse_read, 
     .write = fuse_write, 
+    .release = fuse_release,
+    .fsync = fuse_fsync,
+    .fsyncdir = fuse_fsyncdir,
     .access = fuse_access,
     .create = fuse_create,
+    .init = fuse_init,
 };
 
 int main(int argc, char *argv[])
 {
-    mksfs(1);
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    
+    if (sfs_mkfs(SFS_API_FILENAME, SFS_FUSE_BLOCK_SIZE, SFS_FUSE_NUM_BLOCKS, SFS_FUSE_NUM_INODES) == -1) {
+        fprintf(stderr, "cannot format %s\n", SFS_API_FILENAME);
+        return 1;
+    }
     
-    return fuse_main(argc, argv, &xmp_oper, NULL);
+    // the sfs calls are thread safe, so the default multi-threaded loop is
+    // kept. All changes go through this mount, so the kernel page cache and
+    // dentry/attribute caches can be trusted for a while. A file removed or
+    // renamed over while opened is freed by its last release (hard_remove:
+    // the default renames it to .fuse_hidden*, a name too long for sfs).
+    fuse_opt_add_arg(&args, "-obig_writes,max_write=" SFS_FUSE_MAX_IO_STR ",max_read=" SFS_FUSE_MAX_IO_STR);
+    fuse_opt_add_arg(&args, "-ohard_remove");
+    fuse_opt_add_arg(&args, "-okernel_cache,entry_timeout=" SFS_FUSE_TIMEOUT ",attr_timeout=" SFS_FUSE_TIMEOUT
+            ",negative_timeout=" SFS_FUSE_TIMEOUT);
+    
+    int res = fuse_main(args.argc, args.argv, &xmp_oper, NULL);
+    sfs_trace_stop();
+    stop_disk_trace();
+    fuse_opt_free_args(&args);
+    return res;
 }
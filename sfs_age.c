@@ -0,0 +1,423 @@
+/* sfs_age.c
+ *
+ * Ages a disk image with file system churn, then reports how fragmented it
+ * got and how fast it still is:
+ *
+ *  - churn: files are created (sizes spread from 1K to 4M), appended to and
+ *    removed at random, keeping the disk around the target fullness, until
+ *    the data written reaches a multiple of the disk size
+ *  - fragmentation: extents per file (contiguous runs of blocks on disk) and
+ *    the histogram of the free extent sizes
+ *  - throughput: reading all the aged files, then writing and reading back
+ *    a new large file in the aged free space
+ *
+ * The aged image is kept, so allocator changes can be compared on the same
+ * image (-m mounts it again instead of formatting a new one).
+ *
+ * Usage: sfs_age [-o image] [-m] [-b block size] [-i image size in MB]
+ *                [-n inodes] [-u target fullness %] [-c churn] [-s seed]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+
+#define AGE_DIRS            16
+#define AGE_MIN_FILE        1024
+#define AGE_MAX_FILE        (4 * 1024 * 1024)
+#define AGE_MAX_APPEND      (256 * 1024)
+#define AGE_BUCKETS         24      /* free extent histogram: 1 block to 8M blocks */
+#define AGE_MAP_EXTENTS     4096    /* extents per sfs_imap call */
+#define AGE_IO_SIZE         (1024 * 1024)
+
+/* a file of the aged image */
+struct age_file {
+  int dir;
+  int id;
+  long size;
+};
+
+static struct age_file *files;
+static int nfiles;
+static int next_id;
+static char *data;      /* content written to the files */
+static unsigned long long rand_state = 88172645463325252ULL;
+static int error_count;
+
+/* now() - returns a monotonic timestamp in seconds
+ */
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* next_rand() - xorshift64, the same seed ages the image the same way
+ */
+static unsigned long long next_rand()
+{
+  rand_state ^= rand_state << 13;
+  rand_state ^= rand_state >> 7;
+  rand_state ^= rand_state << 17;
+  return rand_state;
+}
+
+/* file_size_sample() - log-uniform size between AGE_MIN_FILE and max:
+ * mostly small files, with a few large ones holding most of the data
+ */
+static long file_size_sample(long max)
+{
+  long size = AGE_MIN_FILE;
+  long bits = next_rand() % 13;     /* 1K .. 4M */
+
+  size <<= bits;
+  size += next_rand() % size;
+  return size > max ? max : size;
+}
+
+static void file_path(struct age_file *f, char *path)
+{
+  sprintf(path, "/d%d/f%d", f->dir, f->id);
+}
+
+/* fullness() - fraction of the disk blocks in use
+ */
+static double fullness()
+{
+  struct statvfs st;
+  sfs_statfs(&st);
+  return 1.0 - (double)st.f_bfree / st.f_blocks;
+}
+
+/* append() - writes len bytes at the end of a file, returns the bytes written
+ */
+static long append(struct age_file *f, long len)
+{
+  char path[32];
+  long done = 0;
+
+  file_path(f, path);
+  int fd = sfs_fopen(path);
+  if (fd == -1) {
+    return 0;
+  }
+  while (done < len) {
+    int chunk = len - done > AGE_IO_SIZE ? AGE_IO_SIZE : len - done;
+    int res = sfs_pwrite(fd, data, chunk, f->size + done);
+    if (res <= 0) {
+      break;
+    }
+    done += res;
+  }
+  sfs_fclose(fd);
+  f->size += done;
+  return done;
+}
+
+/* remove_file() - removes a file at random
+ */
+static void remove_file()
+{
+  char path[32];
+  int i = next_rand() % nfiles;
+
+  file_path(&files[i], path);
+  if (sfs_remove(path) == -1) {
+    fprintf(stderr, "ERROR: cannot remove %s\n", path);
+    error_count++;
+  }
+  files[i] = files[--nfiles];
+}
+
+/* age() - create/append/remove churn until churn * disk size bytes were
+ * written, staying around the target fullness
+ */
+static void age(double target, double churn, int max_files)
+{
+  struct statvfs st;
+  long written = 0, goal;
+  long creates = 0, appends = 0, removes = 0;
+  double start = now();
+
+  sfs_statfs(&st);
+  goal = (long)(churn * st.f_blocks * st.f_bsize);
+
+  while (written < goal) {
+    int op = next_rand() % 10;
+    if (fullness() > target && nfiles > 0) {
+      remove_file();
+      removes++;
+    } else if ((op < 6 || nfiles == 0) && nfiles < max_files) {
+      struct age_file *f = &files[nfiles];
+      char path[32];
+      f->dir = next_rand() % AGE_DIRS;
+      f->id = next_id++;
+      f->size = 0;
+      file_path(f, path);
+      int fd = sfs_fopen(path);
+      if (fd == -1) {
+        fprintf(stderr, "ERROR: cannot create %s\n", path);
+        error_count++;
+        break;
+      }
+      sfs_fclose(fd);
+      nfiles++;
+      long len = file_size_sample(AGE_MAX_FILE);
+      long done = append(f, len);
+      written += done;
+      creates++;
+      if (done < len) {
+        remove_file();      /* disk full: make room */
+        removes++;
+      }
+    } else if (op < 9 && nfiles > 0) {
+      long len = file_size_sample(AGE_MAX_APPEND);
+      long done = append(&files[next_rand() % nfiles], len);
+      written += done;
+      appends++;
+      if (done < len) {
+        remove_file();
+        removes++;
+      }
+    } else if (nfiles > 0) {
+      remove_file();
+      removes++;
+    }
+  }
+
+  printf("aging: %ld creates, %ld appends, %ld removes, %.1f MB written in %.1f s, %d files, %.1f%% full\n",
+         creates, appends, removes, written / 1048576.0, now() - start, nfiles, fullness() * 100);
+}
+
+/* count_extents() - number of contiguous runs of disk blocks of a file
+ * (holes excluded, 0 for an inline file)
+ */
+static long count_extents(int inode_index, long size, int block_size)
+{
+  sfs_extent extents[AGE_MAP_EXTENTS];
+  long count = 0;
+  int64_t last_end = -1;
+  long chunk = (long)block_size * AGE_MAP_EXTENTS;
+
+  if (chunk > (1L << 30)) {
+    chunk = 1L << 30;
+  }
+  for (long loc = 0; loc < size; loc += chunk) {
+    int n = sfs_imap(inode_index, loc, size - loc > chunk ? chunk : size - loc, extents, AGE_MAP_EXTENTS);
+    if (n == -1) {
+      return 0;     /* inline */
+    }
+    for (int i = 0; i < n; i++) {
+      if (extents[i].disk_offset == -1) {
+        continue;
+      }
+      if (extents[i].disk_offset != last_end) {
+        count++;
+      }
+      last_end = extents[i].disk_offset + extents[i].len;
+    }
+  }
+  return count;
+}
+
+static int compare_long(const void *a, const void *b)
+{
+  long x = *(const long *)a, y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+/* report_fragmentation() - extents per file and free extent sizes
+ */
+static void report_fragmentation()
+{
+  struct statvfs st;
+  int64_t histogram[AGE_BUCKETS];
+  long *extents = malloc((nfiles + 1) * sizeof(long));
+  long total = 0, blocks = 0, fragmented = 0, mapped = 0;
+  int root = sfs_root_inode();
+  char name[16];
+
+  sfs_statfs(&st);
+  for (int i = 0; i < nfiles; i++) {
+    sprintf(name, "d%d", files[i].dir);
+    int dir = sfs_ilookup(root, name);
+    sprintf(name, "f%d", files[i].id);
+    int inode_index = sfs_ilookup(dir, name);
+
+    extents[i] = count_extents(inode_index, files[i].size, st.f_bsize);
+    if (extents[i] == 0) {
+      continue;
+    }
+    mapped++;
+    total += extents[i];
+    blocks += (files[i].size + st.f_bsize - 1) / st.f_bsize;
+    fragmented += extents[i] > 1;
+  }
+  qsort(extents, nfiles, sizeof(long), compare_long);
+
+  printf("files: %d (%ld with blocks), extents per file: mean %.2f p50 %ld p99 %ld max %ld, %.1f%% fragmented\n",
+         nfiles, mapped, mapped ? (double)total / mapped : 0.0, nfiles ? extents[nfiles / 2] : 0,
+         nfiles ? extents[(long)(nfiles * 0.99)] : 0, nfiles ? extents[nfiles - 1] : 0,
+         mapped ? 100.0 * fragmented / mapped : 0.0);
+  /* 0 when every file is contiguous, 1 when no block follows the previous one */
+  printf("fragmentation score: %.4f (extent breaks per data block)\n",
+         blocks > mapped ? (double)(total - mapped) / (blocks - mapped) : 0.0);
+
+  long free_extents = sfs_free_extents(histogram, AGE_BUCKETS);
+  printf("free extents: %ld, %lu free blocks\n", free_extents, (unsigned long)st.f_bfree);
+  for (int i = 0; i < AGE_BUCKETS; i++) {
+    if (histogram[i] != 0) {
+      printf("  %8ld - %8ld blocks: %ld\n", 1L << i, (2L << i) - 1, (long)histogram[i]);
+    }
+  }
+  free(extents);
+}
+
+/* measure() - reads the aged files, then writes and reads back a new file
+ * of half the free space (at most 256M)
+ */
+static void measure()
+{
+  struct statvfs st;
+  char *buffer = malloc(AGE_IO_SIZE);
+  char path[32];
+  long bytes = 0;
+  double start = now();
+
+  for (int i = 0; i < nfiles; i++) {
+    file_path(&files[i], path);
+    int fd = sfs_fopen(path);
+    for (long done = 0; done < files[i].size; done += AGE_IO_SIZE) {
+      int res = sfs_pread(fd, buffer, AGE_IO_SIZE, done);
+      if (res > 0) {
+        bytes += res;
+      }
+    }
+    sfs_fclose(fd);
+  }
+  if (nfiles > 0) {
+    printf("read aged files: %.2f MB/s\n", bytes / (now() - start) / 1048576);
+  }
+
+  sfs_statfs(&st);
+  long size = (long)st.f_bfree * st.f_bsize / 2;
+  if (size > 256L * 1024 * 1024) {
+    size = 256L * 1024 * 1024;
+  }
+  struct age_file big = { 0, next_id++, 0 };
+  file_path(&big, path);
+  sfs_fclose(sfs_fopen(path));
+
+  start = now();
+  long written = append(&big, size);
+  double write_mbs = written / (now() - start) / 1048576;
+
+  bytes = 0;
+  start = now();
+  int fd = sfs_fopen(path);
+  for (long done = 0; done < written; done += AGE_IO_SIZE) {
+    int res = sfs_pread(fd, buffer, AGE_IO_SIZE, done);
+    if (res > 0) {
+      bytes += res;
+    }
+  }
+  sfs_fclose(fd);
+  double read_mbs = bytes / (now() - start) / 1048576;
+
+  int inode_index = sfs_ilookup(sfs_ilookup(sfs_root_inode(), "d0"), path + 4);
+  printf("new %ld MB file: write %.2f MB/s, read %.2f MB/s, %ld extents\n", written / 1048576,
+         write_mbs, read_mbs, count_extents(inode_index, written, st.f_bsize));
+  if (written < size) {
+    fprintf(stderr, "ERROR: only %ld of %ld bytes written in the aged free space\n", written, size);
+    error_count++;
+  }
+
+  sfs_remove(path);
+  free(buffer);
+}
+
+int
+main(int argc, char **argv)
+{
+  char *image = "aged.sfs";
+  int mount_existing = 0;
+  int block_size = 4096;
+  long image_size = 256L * 1024 * 1024;
+  int num_inodes = 8192;
+  double target = 0.8;
+  double churn = 3;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "o:mb:i:n:u:c:s:")) != -1) {
+    switch (opt) {
+    case 'o':
+      image = optarg;
+      break;
+    case 'm':
+      mount_existing = 1;
+      break;
+    case 'b':
+      block_size = atoi(optarg);
+      break;
+    case 'i':
+      image_size = atol(optarg) * 1024 * 1024;
+      break;
+    case 'n':
+      num_inodes = atoi(optarg);
+      break;
+    case 'u':
+      target = atof(optarg) / 100;
+      break;
+    case 'c':
+      churn = atof(optarg);
+      break;
+    case 's':
+      rand_state = strtoull(optarg, NULL, 0) | 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-o image] [-m] [-b block size] [-i image MB] [-n inodes] "
+              "[-u target fullness %%] [-c churn] [-s seed]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  if (mount_existing) {
+    /* the aged files are not known, only the free space can be measured */
+    if (sfs_mount(image) == -1) {
+      fprintf(stderr, "ERROR: cannot mount %s\n", image);
+      return 1;
+    }
+    nfiles = 0;
+  } else {
+    char path[16];
+    if (sfs_mkfs(image, block_size, image_size / block_size, num_inodes) == -1) {
+      fprintf(stderr, "ERROR: cannot format %s\n", image);
+      return 1;
+    }
+    for (int i = 0; i < AGE_DIRS; i++) {
+      sprintf(path, "/d%d", i);
+      sfs_mkdir(path);
+    }
+  }
+
+  data = malloc(AGE_IO_SIZE);
+  for (int i = 0; i < AGE_IO_SIZE; i++) {
+    data[i] = 'a' + i % 26;
+  }
+  files = calloc(num_inodes, sizeof(struct age_file));
+
+  if (!mount_existing) {
+    age(target, churn, num_inodes - AGE_DIRS - 2);
+  }
+  report_fragmentation();
+  measure();
+
+  free(files);
+  free(data);
+  fprintf(stderr, "Aging exiting with %d errors\n", error_count);
+  return error_count != 0;
+}
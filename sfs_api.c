@@ -1,896 +1,4676 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
 #include "sfs_api.h"
 #include "disk_emu.h"
 
+// serializes the sfs_* calls (the FUSE front end calls them from several threads)
+pthread_mutex_t sfs_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+// the depth of the lock held by the calling thread, and the pause owed by
+// its writes, taken once it releases the lock (see wb_balance)
+__thread int sfs_lock_depth;
+__thread int64_t wb_pause_ns;
+
 // the number of disk block required to store the free block list
-const int free_block_list_req_blocks = (int)ceil((float)SFS_API_NUM_BLOCKS / (float)SFS_API_BLOCK_SIZE);
+int64_t free_block_list_req_blocks;
 
 // the maximum number of inodes 
-const int max_inodes = (int)floor((float)(SFS_INODE_TABLE_SIZE * SFS_API_BLOCK_SIZE) / (float)sizeof(inode));
+int max_inodes;
 
 // the number of indirection datablock pointer per data black
-const int indirection_datablock_count = (int)floor((float)(SFS_API_BLOCK_SIZE - sizeof(int)) / (float)sizeof(int));
+int indirection_datablock_count;
+
+// the block size of the mounted file system (cached from the superblock)
+int block_size;
+
+// the number of logical blocks a file can map (direct + indirect + double indirect)
+int64_t max_file_blocks;
+
+// cache of the last indirection block accessed per level (see load_ind_block)
+int64_t ind_cache_block[2];
+int64_t* ind_cache_ptrs[2];
+char ind_cache_dirty[2];
 
 superblock* sblock;
 inode_table* itbl;
-directory* root_dir;
+dcache_entry* dcache;
+dcache_entry* ncache;   // negative dentry cache (inode_index unused)
 file_descriptor_table* fdtbl;
 char* free_block_list;
 
-/*
- * Initializes the inode table data structure (in mem)
+// the fragment blocks holding packed file tails (rebuilt from the inodes at mount)
+fragment_block* frag_tbl;
+int frag_count;
+int frag_cap;
+
+// the size of a fragment block slot (block size / SFS_FRAG_SLOTS)
+int frag_slot_size;
+
+// position of sfs_getnextfilename in the root directory
+int next_pos;
+
+/**
+ * Takes the file system lock (see SFS_API_LOCK)
  */
-void initialize_inode_table() {
-    itbl = malloc(sizeof(inode_table));
-    
-    itbl->free_inodes = (char*)calloc(max_inodes, sizeof(char));
-    itbl->inodes = (inode*)calloc(max_inodes, sizeof(inode));
-    itbl->allocated_cnt = 0;
-    itbl->size = max_inodes;
-    
-    for(int i = 0; i < max_inodes; i++) {
-        itbl->free_inodes[i] = 0;
-    }
+pthread_mutex_t* sfs_lock_acquire() {
+    pthread_mutex_lock(&sfs_lock);
+    sfs_lock_depth++;
+    return &sfs_lock;
 }
 
 /**
- * Initializes the file descriptor table data structure (in mem)
+ * Releases the file system lock when the guard of SFS_API_LOCK goes out of
+ * scope, then pauses a writer throttled by wb_balance (without the lock)
  */
-void initialize_file_descriptor_table() {
-    fdtbl = malloc(sizeof(file_descriptor_table));
-    
-    fdtbl->size = SFS_MAX_FDENTRIES;
-    for(int i = 0; i < fdtbl->size; i++) {
-        (fdtbl->entries[i]).in_use = 0;
+void sfs_lock_release(pthread_mutex_t** lock) {
+    sfs_lock_depth--;
+    pthread_mutex_unlock(*lock);
+    if(sfs_lock_depth == 0 && wb_pause_ns > 0) {
+        struct timespec ts = { wb_pause_ns / 1000000000LL, wb_pause_ns % 1000000000LL };
+        wb_pause_ns = 0;
+        nanosleep(&ts, 0);
     }
 }
 
+// takes the file system lock until the calling function returns
+#define SFS_API_LOCK() \
+    pthread_mutex_t* sfs_lock_guard __attribute__((cleanup(sfs_lock_release))) = sfs_lock_acquire()
+
+// the trace file of sfs_trace_start, 0 when not tracing
+FILE* trace_file;
+
+// start of the trace (ns), and the call being recorded
+int64_t trace_epoch;
+sfs_trace_record trace_call;
+
+// the counters of sfs_stats
+sfs_statistics api_stats;
+
+// the number of sfs_* calls running: a call made by another one is
+// neither timed nor recorded
+int op_depth;
+
+int64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 /**
- * Persists the free block list data structure on the disk
- * 
- * Basic algorithm:
- *   Free block list is stored as a (char) array of length = number of blocks
+ * Starts recording a call (see SFS_TRACE)
+ * @return 1
  */
-void write_free_block_list() {
-    char* free_block_buff = strdup(free_block_list);
-    //memcpy(free_block_buff, free_block_list, SFS_API_BLOCK_SIZE);
-    write_blocks(1 + SFS_INODE_TABLE_SIZE, free_block_list_req_blocks, &(free_block_list[0]));
-    free(free_block_buff);
+int trace_begin(int op, int arg, int arg2, int64_t loc) {
+    memset(&trace_call, 0, sizeof(sfs_trace_record));   // the padding is written too
+    trace_call.op = op;
+    trace_call.arg = arg;
+    trace_call.arg2 = arg2;
+    trace_call.loc = loc;
+    trace_call.time = clock_ns();
+    return 1;
 }
 
 /**
- * Reads the free block list data structure from the disk to main memory
- * 
- * Basic algorithm:
- *   Free block list is stored as a (char) array of length = number of blocks
- *   Read as a whole block (no iteration)
+ * Writes the call started by trace_begin to the trace file, followed by its
+ * names (null separated), if it was traced. The errno of the call is kept.
+ * @return result
  */
-void read_free_block_list() {
-    char* free_block_buff = malloc(free_block_list_req_blocks * SFS_API_BLOCK_SIZE);
-    read_blocks(1 + SFS_INODE_TABLE_SIZE, free_block_list_req_blocks, free_block_buff);
-    memcpy(free_block_list, free_block_buff, SFS_API_BLOCK_SIZE);
+int64_t trace_end(int traced, int64_t result, const char* name, const char* name2) {
+    if(!traced) { return result; }
     
-    free(free_block_buff);
+    int call_errno = errno;
+    int64_t duration = clock_ns() - trace_call.time;
+    size_t len = name != 0 ? strlen(name) : 0;
+    size_t len2 = name2 != 0 ? strlen(name2) : 0;
+    
+    trace_call.time -= trace_epoch;
+    trace_call.duration = duration > UINT32_MAX ? UINT32_MAX : duration;
+    trace_call.result = result;
+    trace_call.name_len = name2 != 0 ? len + 1 + len2 : len;
+    fwrite(&trace_call, sizeof(sfs_trace_record), 1, trace_file);
+    if(len > 0) { fwrite(name, 1, len, trace_file); }
+    if(name2 != 0) {
+        fputc('\0', trace_file);
+        fwrite(name2, 1, len2, trace_file);
+    }
+    errno = call_errno;
+    return result;
 }
 
 /**
- * Persists the inode table data structure on the disk
- * 
- * Basic algorithm: 
- *   The inode table is stored on the disk with its inodes entries 
- *      Iterate over the free_inode table, for each used inode store it on disk
- *      at its corresponding position
+ * Starts timing a call, if it is the outermost sfs_* call running. Its disk
+ * requests are labeled with its name in the device trace (see set_disk_tag).
  */
-void write_inode_table() {
-    char* inode_table_buff = malloc(SFS_INODE_TABLE_SIZE * SFS_API_BLOCK_SIZE);
-    
-    memcpy(inode_table_buff, (int*)&(itbl->size), sizeof(int));
-    memcpy(inode_table_buff + sizeof(int), (int*)&(itbl->allocated_cnt), sizeof(int));
-    memcpy(inode_table_buff + 2*sizeof(int), (char*)(itbl->free_inodes), max_inodes * sizeof(char));
-    
-    /*for(int i = 0; i < itbl->allocated_cnt; i++) {
-        memcpy(inode_table_buff + sizeof(int) * 2 + max_inodes * sizeof(char) + i * sizeof(inode), (inode*)&(itbl->inodes[i]), sizeof(inode));
-    }*/
-    for(int i = 0; i < itbl->size; i++) {
-        if(itbl->free_inodes[i] == 1) { // inode at index i is used, persist on disk
-            memcpy(inode_table_buff + sizeof(int) * 2 + max_inodes * sizeof(char) + i * sizeof(inode), (inode*)&(itbl->inodes[i]), sizeof(inode));
-        }
+op_timer op_timer_begin(int op) {
+    op_timer timer = { -1, 0, 0, 0 };
+    if(op_depth++ == 0) {
+        disk_stats io;
+        get_disk_stats(&io);
+        set_disk_tag(sfs_op_name(op));
+        timer.op = op;
+        timer.disk_reads = io.read_calls;
+        timer.disk_writes = io.write_calls;
+        timer.start = clock_ns();
     }
-    
-    write_blocks(1, SFS_INODE_TABLE_SIZE, inode_table_buff);
-    free(inode_table_buff);
+    return timer;
 }
 
+void journal_op_end();
+
 /**
- * Reads the inode table from the disk to main memory
+ * Accounts a call timed by op_timer_begin (when its guard goes out of scope),
+ * the metadata changes of the calls are committed from there when the log
+ * buffer is large (the flusher commits them otherwise). The errno of the
+ * call is kept.
  */
-void read_inode_table() {
-    if(itbl != 0) { free(itbl->inodes); free(itbl->free_inodes); free(itbl); }
-    
-    char* inode_table_buff = malloc(SFS_INODE_TABLE_SIZE * SFS_API_BLOCK_SIZE);
-    read_blocks(1, SFS_INODE_TABLE_SIZE, inode_table_buff);
-    
-    itbl = malloc(sizeof(inode_table));
-    itbl->size = *((int*)inode_table_buff);
-    itbl->allocated_cnt = *((int*)(inode_table_buff + sizeof(int)));
-    
-    itbl->free_inodes = (char*)calloc(itbl->size, sizeof(char));
-    itbl->inodes = (inode*)calloc(itbl->size, sizeof(inode));
-    
-    memcpy(itbl->free_inodes, (void*)(inode_table_buff + 2*sizeof(int)), max_inodes * sizeof(char));
-    memcpy(itbl->inodes, (void*)(inode_table_buff + 2*sizeof(int) + max_inodes * sizeof(char)), itbl->size * sizeof(inode));
+void op_timer_end(op_timer* timer) {
+    op_depth--;
+    if(timer->op == -1) { return; }
     
-    free(inode_table_buff);
+    int call_errno = errno;
+    journal_op_end();
+    uint64_t ns = clock_ns() - timer->start;
+    sfs_op_stats* op_stats = &api_stats.ops[timer->op];
+    int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+    disk_stats io;
+    get_disk_stats(&io);
+    set_disk_tag(0);
+    op_stats->disk_reads += io.read_calls - timer->disk_reads;
+    op_stats->disk_writes += io.write_calls - timer->disk_writes;
+    op_stats->calls++;
+    op_stats->total_ns += ns;
+    if(ns > op_stats->max_ns) { op_stats->max_ns = ns; }
+    op_stats->latency[bucket < SFS_STATS_BUCKETS ? bucket : SFS_STATS_BUCKETS - 1]++;
+    errno = call_errno;
 }
 
 /**
- * Main method to allocate block of data on the disk. This method makes sure to
- * flag block used by the allocation as used in the free block list as well as
- * persisting data from buffer in main memory.
- * @param start_block the disk block to start from
- * @param nblocks the number of block to write 
- * @param buff the actual buffer containing data
+ * Accounts a search of an allocator
  */
-void allocate_block(int start_block, int nblocks, char* buff) {
-    write_blocks(start_block, nblocks, buff);
-    
-    for(int i = start_block; i < (start_block + nblocks); i++) {
-        free_block_list[i] = 1;
-    }
-    
-    write_free_block_list();
+void count_scan(sfs_scan_stats* scan_stats, uint64_t scanned) {
+    scan_stats->searches++;
+    scan_stats->scanned += scanned;
+    if(scanned > scan_stats->max_scanned) { scan_stats->max_scanned = scanned; }
 }
 
+// times the calling sfs_* call until it returns (see sfs_stats)
+#define SFS_OP_TIMER(op) \
+    op_timer sfs_op_timer __attribute__((cleanup(op_timer_end))) = op_timer_begin(op)
+
+// times the calling sfs_* call and, when tracing, starts its record with its
+// arguments (only evaluated when tracing); the call runs its body (the
+// *_locked function) once and returns through SFS_TRACE_RETURN
+#define SFS_TRACE(op, arg, arg2, loc) \
+    SFS_OP_TIMER(op); \
+    int sfs_traced = trace_file != 0 && op_depth == 1 && trace_begin(op, arg, arg2, loc)
+
+// returns the result of the call started by SFS_TRACE, and records it with
+// the names of the call (and its duration) when traced
+#define SFS_TRACE_RETURN(result, name, name2) \
+    return trace_end(sfs_traced, (result), name, name2)
+
+/*
+ * Metadata journal
+ *
+ * The metadata (superblock, inode table, free block list, directory and
+ * indirection blocks) is not written in place by the calls: its changes are
+ * logged as records (a byte range and its new bytes) in a log buffer, and
+ * the buffer is committed to the journal region in one sequential write: a
+ * transaction. The records of several calls are grouped in a transaction
+ * (group commit), it is written when the oldest change is SFS_JOURNAL_COMMIT_MS
+ * old (by the flusher, between two calls) or the buffer holds a quarter of
+ * the journal (at the end of a call), so a transaction always holds whole
+ * calls. The data blocks of the files are written in place before the
+ * transaction mapping them (see wb_write_back), and the device is synced in
+ * between (see wb_barrier): a crash of the machine never leaves a committed
+ * file pointing to blocks whose data did not reach the disk.
+ *
+ * The metadata is written back to its home location (a checkpoint) only
+ * when the journal is half full, when its copies of the changed blocks take
+ * too much memory and when the file system is released. At mount, the
+ * committed transactions not written back are replayed.
+ *
+ * The blocks released by a transaction are reused once it is committed, so
+ * that a crash never leaves a block used by two files, and once written
+ * back if the journal holds changes of the block (a freed directory or
+ * indirection block).
+ */
+
+// the copies of the logged metadata, compared with the current one to find the changes
+superblock journal_shadow_sblock;
+int journal_shadow_hdr[2];  // inode table size and allocated_cnt
+char* journal_shadow_free_inodes;
+inode* journal_shadow_inodes;
+char* journal_shadow_free_list;
+
+// the log buffer: the transaction being built, its records after the header
+char* journal_buff;
+int64_t journal_buff_len;
+int64_t journal_buff_cap;
+int64_t journal_nrecords;
+
+// the next transaction, and where it goes (blocks after the journal header)
+int64_t journal_seq;
+int64_t journal_head;
+
+// start of the oldest change not committed (ns), 0 if none
+int64_t journal_dirty_since;
+
+// the blocks released since the last commit (flagged 2 in the free block list)
+int64_t* journal_freed;
+int64_t journal_freed_count;
+int64_t journal_freed_cap;
+int journal_frag_freed;
+
+// the first of them, released before the transaction the flusher is writing
+int64_t journal_txn_frees;
+
+// a block with changes in the journal was released: write back before reusing it
+int journal_revoked;
+
+// the changed directory and indirection blocks (hashed by block)
+journal_pin* journal_pins[SFS_JOURNAL_PIN_BUCKETS];
+int64_t journal_pin_count;
+
+int journal_exit_registered;
+
+void flush_ind_cache();
+void release_fs();
+void aio_release();
+void fork_prepare();
+void fork_parent();
+void fork_child();
+int64_t journal_replay();
+void read_disk_blocks(int64_t start_block, int nblocks, void* buff);
+int64_t wb_count;
+wb_block* wb_find(int64_t block);
+void wb_write(int64_t start_block, int64_t nblocks, const char* buff);
+void wb_remove(int64_t block);
+void wb_write_back();
+extern pthread_mutex_t wb_io_lock;
+void wb_barrier();
+
 /**
- * Deallocate disk block while maintaining the free_block_list updated.
- * @param start_block start block to be deallocated
- * @param nblock the number of block to be deallocated
+ * Checksum of a transaction (FNV-1a)
  */
-void deallocate_block(int start_block, int nblock) {
-    for(int i = start_block; i < (start_block + nblock); i++) {
-        free_block_list[i] = 0;
+uint32_t journal_checksum(const char* data, int64_t len) {
+    uint32_t hash = 2166136261u;
+    for(int64_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 16777619u;
     }
-    
-    write_free_block_list();
+    return hash;
 }
 
 /**
- * Save the inode at a given index, maintain the free_inodes char array list
- * up to date
- * @param inode the inode to be stored
- * @param index the index
+ * Notes that the metadata changed (see SFS_JOURNAL_COMMIT_MS). The superblock,
+ * inode table and free block list are only changed in memory: the next commit
+ * compares them with their logged copy and logs the changed ranges (see
+ * journal_write_txn), so a call changing several inodes costs a single record
+ * per change. The checkpoints write them at their home location (see
+ * journal_write_back).
  */
-void save_inode(inode* inode, int index) {
-    itbl->inodes[index] = *inode;
-    itbl->allocated_cnt++;
-    itbl->free_inodes[index] = 1;
-    
-    write_inode_table();
+void journal_touch() {
+    if(journal_dirty_since == 0) { journal_dirty_since = clock_ns(); }
 }
 
 /**
- * Finds contiguous blocks to be allocated for a desired length (in bytes).
- * 
- * Basic greedy algorithm: 
- *  - Starting from first block
- *    - check if there is n blocks available (from free block list)
- *    - if not: loop and start at start_index + len
- *    - return start_index with n as length
- * 
- * @param desired_len The desired buffer size to store (in bytes)
- * @param start_block Ptrs to the variable start_block return variable
- * @param len Ptrs to the variable len return variable
- * @return 1 if space found, -1 if no space found
+ * Appends a record to the log buffer
+ * @param addr The byte offset of the range on the disk
+ * @param data The new bytes of the range
+ * @param len The length of the range
  */
-int find_free_space(int desired_len, int* start_block, int* len) {
-    int num_blocks = (int)ceil((float)desired_len / (float)SFS_API_BLOCK_SIZE);
-    for(int i = 0; i < SFS_API_NUM_BLOCKS; i++) {
-        char i_isfree = free_block_list[i];
-        if(i_isfree == 0) {
-            char contiguous = 1;
-            int j = i;
-            while(contiguous && j < (i + num_blocks)) {
-                char j_isfree = free_block_list[j];
-                contiguous = j_isfree == 0 ? 1 : 0;
-                j++;
-            }
-            
-            if(contiguous) {
-                *start_block = i;
-                *len = num_blocks;
-                return 1;
-            }
-        }
+void journal_append(int64_t addr, const char* data, int len) {
+    if(journal_buff_len + (int64_t)sizeof(journal_record) + len > journal_buff_cap) {
+        journal_buff_cap = (journal_buff_len + sizeof(journal_record) + len) * 2;
+        journal_buff = realloc(journal_buff, journal_buff_cap);
     }
     
-    *start_block = -1;
-    *len = -1;
-    return -1;
+    journal_record rec = { addr, len, 0 };
+    memcpy(journal_buff + journal_buff_len, &rec, sizeof(journal_record));
+    memcpy(journal_buff + journal_buff_len + sizeof(journal_record), data, len);
+    journal_buff_len += sizeof(journal_record) + len;
+    journal_nrecords++;
 }
 
 /**
- * Finds the next available inode index
- * Returns the first free available inode index
- * @param inode_index Ptr to return variable
- * @return -1 if no space found , 1 if found
+ * Logs the changes of a range of metadata
+ *
+ * Basic algorithm:
+ *  - compare the current bytes with the logged copy, skipping the unchanged
+ *    bytes a chunk at a time
+ *  - a record covers the changed bytes and the unchanged gaps between them
+ *    that are shorter than a record header
+ *  - the logged copy is updated
+ * @param addr The byte offset of the range on the disk
+ * @param logged The logged copy of the range
+ * @param current The current bytes of the range
+ * @param len The length of the range
  */
-int find_next_available_inode_index(int* inode_index) {
-    for(int i = 0; i < max_inodes; i++) {
-        if(itbl->free_inodes[i] == 0) { *inode_index = i; return 1; }
+void journal_diff(int64_t addr, char* logged, const char* current, int64_t len) {
+    int64_t i = 0;
+    while(i < len) {
+        if(len - i >= 64 && memcmp(logged + i, current + i, 64) == 0) { i += 64; continue; }
+        if(logged[i] == current[i]) { i++; continue; }
+        
+        int64_t end = i + 1;
+        for(int64_t j = i + 1; j < len && j - end < (int64_t)sizeof(journal_record); j++) {
+            if(logged[j] != current[j]) { end = j + 1; }
+        }
+        journal_append(addr + i, current + i, end - i);
+        memcpy(logged + i, current + i, end - i);
+        i = end;
     }
-    
-    return -1;
 }
 
 /**
- * Finds the next available file descriptor index
- * Returns the first free available file descriptor index
- * @param fd_index Ptr to return variable
- * @return -1 if no fd entry avail, 1 if found
+ * Finds the journal copy of a block
+ * @return the copy, 0 (null ptr) if the block has no change in the journal
  */
-int find_next_avail_fd_entry(int* fd_index) {
-    for(int i = 0; i < fdtbl->size; i++) {
-        if((fdtbl->entries[i]).in_use == 0) { *fd_index = i; return 1; }
+journal_pin* journal_find_pin(int64_t block) {
+    for(journal_pin* pin = journal_pins[block % SFS_JOURNAL_PIN_BUCKETS]; pin != 0; pin = pin->next) {
+        if(pin->block == block) { return pin; }
     }
-    
-    return -11;
+    return 0;
 }
 
 /**
- * Reads the root directory entry from the disk to the main memory
- * - Finds the root inode
- * - Reads the datablock contents from 0 to allocated_ptr (root directory could
- *   span over multiple blocks)
- * - For each root entry, read name & extension
+ * Drops the journal copy of a block (when it is released)
  */
-void read_root_dir() {
-    if(root_dir != 0) { free(root_dir->entries); free(root_dir); }
-    read_inode_table();
-    inode* root_inode = &itbl->inodes[sblock->root_inode_no];
-    
-    // read the whole root directory block(s) in the buffer
-    char* root_dir_buff = malloc(root_inode->allocated_ptr * SFS_API_BLOCK_SIZE);
-    read_blocks(root_inode->ptrs[0], root_inode->allocated_ptr, (char*)root_dir_buff);
-    
-    root_dir = malloc(sizeof(directory));
-    root_dir->count = *((int*)root_dir_buff);
-    root_dir->entries = (directory_entry*)calloc(root_dir->count, sizeof(directory_entry));
-    if(root_dir->entries == 0) { 
-        return -1;
+void journal_unpin(int64_t block) {
+    journal_pin** link = &journal_pins[block % SFS_JOURNAL_PIN_BUCKETS];
+    for(; *link != 0; link = &(*link)->next) {
+        if((*link)->block != block) { continue; }
+        
+        journal_pin* pin = *link;
+        *link = pin->next;
+        free(pin->data);
+        free(pin);
+        journal_pin_count--;
+        journal_revoked = 1;
+        return;
     }
-    
-    // for each entry, retrieve the filename, inode index and extension
-    for(int i = 0; i < root_dir->count; i++) {
-        memcpy(&((root_dir->entries[i]).inode_index), root_dir_buff + sizeof(int) + (sizeof(int) + 16 + 3) * i, sizeof(int));
-        memcpy((root_dir->entries[i]).filename, root_dir_buff + sizeof(int) + (sizeof(int) + 16 + 3) * i + sizeof(int), 16);
-        memcpy((root_dir->entries[i]).extension, root_dir_buff + sizeof(int) + (sizeof(int) + 16 + 3) * i + sizeof(int) + 16, 3);
+}
+
+/**
+ * Logs the new content of a directory or indirection block, that is written
+ * back at the next checkpoint
+ * @param block The disk block
+ * @param buff The new content (a block)
+ */
+void journal_write_block(int64_t block, const char* buff) {
+    journal_pin* pin = journal_find_pin(block);
+    if(pin == 0) {
+        pin = malloc(sizeof(journal_pin));
+        pin->block = block;
+        pin->data = malloc(block_size);
+        read_disk_blocks(block, 1, pin->data);
+        pin->next = journal_pins[block % SFS_JOURNAL_PIN_BUCKETS];
+        journal_pins[block % SFS_JOURNAL_PIN_BUCKETS] = pin;
+        journal_pin_count++;
     }
     
-    // free buffer
-    free(root_dir_buff);
+    journal_diff(block * block_size, pin->data, buff, block_size);
+    journal_touch();
 }
 
 /**
- * Insert a directory_entry in the root directory, that is, update the root_directory
- * data structure and persists changes on the disk.
- * 
- * Basic Algorithm:
- *  - if directory is NOT big enough:
- *     - find free space with sufficent size
- *     - move the whole root dir to those blocks
- *     - update root inode
- *     - persists inode table
- *  - reallocate the entries array to contain one more element
- *  - append entry at the end of the entries
- *  - update entries count
- * 
- * @param entry the entry to insert in the root directory 
- */
-void insert_root_dir(directory_entry entry) {
-    int total_dir_size = sizeof(directory) - 1 + root_dir->count * sizeof(directory_entry);
-    int total_dir_cap = (&itbl->inodes[sblock->root_inode_no])->allocated_ptr * SFS_API_BLOCK_SIZE;
-    // check if the directory is big enough to insert the item
-    if((total_dir_size + sizeof(directory_entry)) > total_dir_cap) {
-        // reallocate a new set of block for the root directory and update inode
-        int start_index, block_len;
-        find_free_space(total_dir_size + sizeof(directory_entry), &start_index, &block_len);
-        
-        allocate_block(start_index, block_len, root_dir);
-        (itbl->inodes[sblock->root_inode_no]).allocated_ptr = block_len;
-        for(int i = 0; i < block_len; i++) {
-            (itbl->inodes[sblock->root_inode_no]).ptrs[i] = start_index + i;
-        }
-        deallocate_block((itbl->inodes[sblock->root_inode_no]).ptrs[0], (itbl->inodes[sblock->root_inode_no]).allocated_ptr);
-        write_inode_table();
+ * Reads blocks from the disk, taking the blocks changed in the journal from
+ * their journal copy (the disk holds them as of the last checkpoint), and
+ * the blocks not written back yet from memory (see wb_write). A journal
+ * copy is newer than the block written back: a new block is written back
+ * before the transactions logging its changes.
+ * @param start_block The first disk block
+ * @param nblocks The number of blocks
+ * @param buff Return variable: the blocks
+ */
+void read_disk_blocks(int64_t start_block, int nblocks, void* buff) {
+    if(nblocks == 1 && journal_pin_count > 0) {
+        journal_pin* pin = journal_find_pin(start_block);
+        if(pin != 0) { memcpy(buff, pin->data, block_size); return; }
     }
     
-    read_root_dir(); // make sure we are up to date
-    
-    directory* new_root = malloc(sizeof(directory));
-    new_root->count = root_dir->count + 1;
-    // reallocate entries array
-    new_root->entries = (directory_entry*)calloc(new_root->count, sizeof(directory_entry));
-    for(int i = 0; i < root_dir->count; i++) { // copy old stuff
-        memset((new_root->entries[i]).filename, '\0', sizeof((new_root->entries[i]).filename));
-        memset((new_root->entries[i]).extension, '\0', sizeof((new_root->entries[i]).extension));
-        
-        strcpy((new_root->entries[i]).filename, (root_dir->entries[i]).filename);
-        strcpy((new_root->entries[i]).extension, (root_dir->entries[i]).extension);
-        (new_root->entries[i]).inode_index = (root_dir->entries[i]).inode_index;
+    if(nblocks == 1 && wb_count > 0) {
+        wb_block* entry = wb_find(start_block);
+        if(entry != 0) { memcpy(buff, entry->data, block_size); return; }
     }
     
-    // insert new entry at the end
-    strcpy((new_root->entries[root_dir->count]).filename, entry.filename);
-    strcpy((new_root->entries[root_dir->count]).extension, entry.extension);
-    (new_root->entries[root_dir->count]).inode_index = entry.inode_index;
-    
-    root_dir = new_root;
-    write_root_dir();
-    
-    read_root_dir();
-}
-
-void write_root_dir() {
-    char* rootdir_buff = malloc((&itbl->inodes[sblock->root_inode_no])->allocated_ptr * SFS_API_BLOCK_SIZE);
-    memcpy(rootdir_buff, root_dir, sizeof(int));
-    for(int i = 0; i < root_dir->count; i++) {
-        memcpy(rootdir_buff + sizeof(int) + (sizeof(int) + 16 + 3) * i, &((root_dir->entries[i]).inode_index), sizeof(int));
-        memcpy(rootdir_buff + sizeof(int) + (sizeof(int) + 16 + 3) * i + sizeof(int), (root_dir->entries[i]).filename, 16);
-        memcpy(rootdir_buff + sizeof(int) + (sizeof(int) + 16 + 3) * i + sizeof(int) + 16, (root_dir->entries[i]).extension, 3);
-    
+    read_blocks(start_block, nblocks, buff);
+    for(int i = 0; i < nblocks && wb_count > 0; i++) {
+        wb_block* entry = wb_find(start_block + i);
+        if(entry != 0) { memcpy((char*)buff + (int64_t)i * block_size, entry->data, block_size); }
+    }
+    for(int i = 0; i < nblocks && journal_pin_count > 0; i++) {
+        journal_pin* pin = journal_find_pin(start_block + i);
+        if(pin != 0) { memcpy((char*)buff + (int64_t)i * block_size, pin->data, block_size); }
     }
-    // persist root directory
-    //memcpy(rootdir_buff, new_root, sizeof(int) + new_root->count * sizeof(directory_entry));
-    write_blocks((itbl->inodes[sblock->root_inode_no]).ptrs[0], (itbl->inodes[sblock->root_inode_no]).allocated_ptr, rootdir_buff);
-    free(rootdir_buff);
 }
 
 /**
- * Initialize the file system
- * Initializes the basic in-memory data structures as well as on-disk data structures.
- * - initialize inode_table
- * - initialize & load superblock
- * - initialize free block list
- * - initialize/read root directory
- * - initialize file descriptor table
- * @param fresh Should we start from scratch or not?
+ * Makes the blocks and fragment slots released since the last commit free
+ * (in memory, they are logged with the free block list)
  */
-void mksfs(int fresh) {
-    free_block_list = calloc(SFS_API_BLOCK_SIZE, sizeof(char));
-    if(fresh) {
-        init_fresh_disk(SFS_API_FILENAME, SFS_API_BLOCK_SIZE, SFS_API_NUM_BLOCKS);
-        
-        initialize_inode_table();
-        
-        int root_inode_index;
-        find_next_available_inode_index(&root_inode_index);
-        
-        // create the super block
-        char* superblock_buff = malloc(SFS_API_BLOCK_SIZE);
-        sblock = malloc(sizeof(superblock));
-        sblock->magic = SFS_MAGIC_NUMBER;
-        sblock->block_size = SFS_API_BLOCK_SIZE;
-        sblock->fs_size = SFS_API_NUM_BLOCKS;
-        sblock->inode_table_len = SFS_INODE_TABLE_SIZE;
-        sblock->root_inode_no = root_inode_index;
-        
-        memcpy(superblock_buff, (void*)sblock, sizeof(superblock));    // magic
-        write_blocks(0, 1, superblock_buff);
-        free(superblock_buff);
-        
-        int offset = 0;
-        free_block_list[offset] = (char)1; // space for superblock
-        offset++;
-        
-        // allocate block for inode table
-        for(int i = 0; i < SFS_INODE_TABLE_SIZE; i++) {
-            free_block_list[offset + i] = (char)1;
-        }
-        offset += SFS_INODE_TABLE_SIZE;
-        
-        // allocate n block to free space management (bitvector)
-        int free_block_list_req_blocks = (int)ceil((float)SFS_API_NUM_BLOCKS / (float)SFS_API_BLOCK_SIZE);
-        for(int i = 0; i < free_block_list_req_blocks; i++) {
-            free_block_list[(offset) + i] = (char)1;
-        }
-        offset += free_block_list_req_blocks;
-        
-        write_free_block_list();
-        
-        int start_block, nblocks;
-        find_free_space(sizeof(directory), &start_block, &nblocks);
-        
-        directory* rootdir_buff = malloc(sizeof(nblocks * SFS_API_BLOCK_SIZE));
-        rootdir_buff->count = 0;
-        allocate_block(start_block, nblocks, (char*)rootdir_buff);
-        free(rootdir_buff);
-        
-        inode root_inode;
-        root_inode.mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO;
-        root_inode.size = 1;
-        root_inode.ptrs[0] = start_block;
-        root_inode.allocated_ptr = 1;
-        
-        save_inode(&root_inode, root_inode_index);
-        
-        read_root_dir();
-    } else {
-        init_disk(SFS_API_FILENAME, SFS_API_BLOCK_SIZE, SFS_API_NUM_BLOCKS);
-        
-        // read superblock
-        char* superblock_buff = malloc(SFS_API_BLOCK_SIZE);
-        read_blocks(0, 1, superblock_buff);
-        sblock = malloc(sizeof(superblock));
-        memcpy(sblock, superblock_buff, sizeof(superblock));
-        free(superblock_buff);
-        
-        initialize_inode_table();
-        read_free_block_list();
-        read_inode_table();
-        read_root_dir();
+void journal_apply_frees() {
+    for(int64_t i = 0; i < journal_freed_count; i++) {
+        if(free_block_list[journal_freed[i]] == 2) { free_block_list[journal_freed[i]] = 0; }
     }
+    journal_freed_count = 0;
+    journal_txn_frees = 0;
     
-    initialize_file_descriptor_table();
-    return;
+    for(int i = frag_count - 1; i >= 0 && journal_frag_freed; i--) {
+        frag_tbl[i].used &= ~frag_tbl[i].freed;
+        frag_tbl[i].freed = 0;
+        if(frag_tbl[i].used == 0) {
+            // last slot released: the fragment block itself is free
+            if(free_block_list[frag_tbl[i].block] == 1) { sblock->free_block_count++; }
+            free_block_list[frag_tbl[i].block] = 0;
+            if(wb_count > 0) { wb_remove(frag_tbl[i].block); }
+            frag_tbl[i] = frag_tbl[--frag_count];
+        }
+    }
+    journal_frag_freed = 0;
 }
 
 /**
- * Gets a pointer to a root directory entry for a given file name
- * @param filename The file name of the file
- * @return directory_entry* pointer to the file having this file name, 0 (null ptr) if not found
+ * Makes the blocks released before the transaction written by the flusher
+ * free (see wb_flush), the others stay reserved until the next commit
  */
-directory_entry* get_file(char* filename) {
-    read_root_dir();
-    
-    directory_entry* entry = 0;
-    int directory_index = 0;
-    while(entry == 0 && directory_index < root_dir->count) {
-        char* namebuff = strdup((root_dir->entries[directory_index]).filename);
-        int cmp = strcmp(filename, namebuff);
-        if(cmp == 0) {
-            entry = &root_dir->entries[directory_index];
-        }
-        
-        free(namebuff);
-        directory_index++;
+void journal_apply_txn_frees() {
+    if(journal_txn_frees == 0) { return; }
+    for(int64_t i = 0; i < journal_txn_frees; i++) {
+        if(free_block_list[journal_freed[i]] == 2) { free_block_list[journal_freed[i]] = 0; }
     }
-    
-    return entry;
+    journal_freed_count -= journal_txn_frees;
+    memmove(journal_freed, journal_freed + journal_txn_frees, journal_freed_count * sizeof(int64_t));
+    journal_txn_frees = 0;
 }
 
 /**
- * Extracts the file extension from a given file name
- * @param filename Filename with extension
- * @return Extension of the file name
+ * Builds a transaction of the log buffer: logs the changes of the superblock,
+ * inode table and free block list (compared with their logged copies), then
+ * the header of the transaction, padded to whole blocks
+ * @return its length in blocks, 0 if nothing changed
  */
-const int extract_filename_ext(char* filename, char* ext_filename, char* ext_ext) {
-    char *dot = strrchr(filename, '.');
-    if(!dot || dot == filename) return -1;
+int64_t journal_build_txn() {
+    flush_ind_cache();
     
-    strncpy(ext_filename, filename, dot - filename);
-    strncpy(ext_ext, dot + 1, 3);
+    int64_t table_addr = block_size;
+    int hdr[2] = { itbl->size, itbl->allocated_cnt };
+    journal_diff(0, (char*)&journal_shadow_sblock, (char*)sblock, sizeof(superblock));
+    journal_diff(table_addr, (char*)journal_shadow_hdr, (char*)hdr, sizeof(hdr));
+    journal_diff(table_addr + sizeof(hdr), journal_shadow_free_inodes, itbl->free_inodes, max_inodes);
+    journal_diff(table_addr + sizeof(hdr) + max_inodes, (char*)journal_shadow_inodes, (char*)itbl->inodes,
+            (int64_t)max_inodes * sizeof(inode));
+    journal_diff((1 + sblock->inode_table_len) * (int64_t)block_size, journal_shadow_free_list, free_block_list, sblock->fs_size);
+    journal_dirty_since = 0;
+    if(journal_nrecords == 0) { return 0; }
     
-    return 0;
+    int64_t nblocks = (journal_buff_len + block_size - 1) / block_size;
+    if(nblocks * block_size > journal_buff_cap) {
+        journal_buff_cap = nblocks * block_size;
+        journal_buff = realloc(journal_buff, journal_buff_cap);
+    }
+    memset(journal_buff + journal_buff_len, 0, nblocks * block_size - journal_buff_len);
+    journal_txn txn = { SFS_JOURNAL_MAGIC, 0, journal_seq, nblocks, journal_nrecords, journal_buff_len };
+    txn.checksum = journal_checksum(journal_buff + sizeof(journal_txn), journal_buff_len - sizeof(journal_txn));
+    memcpy(journal_buff, &txn, sizeof(journal_txn));
+    return nblocks;
 }
 
 /**
- * Create a file and insert it into the root directory
- * @param filename The file name to create
- * @return A pointer to the newly created file entry
+ * Accounts the transaction built from the log buffer, written (or being
+ * written) at journal_head, and empties the buffer
  */
-directory_entry* create_file(char* filename) {
-    inode file_inode;
-    file_inode.mode = S_IRWXU | S_IRWXG | S_IRWXO;
-    file_inode.size = 0;
-    file_inode.allocated_ptr = 0;
-    file_inode.ind_block_ptr = -1;
-    
-    int inode_index;
-    find_next_available_inode_index(&inode_index);
-    
-    save_inode(&file_inode, inode_index);
-    
-    directory_entry entry;
-    entry.inode_index = inode_index;
-    //extract_filename_ext(filename, entry.filename, entry.extension);
-    strcpy(entry.filename, filename);
-    //strcpy(entry.extension, ext);
-    
-    read_root_dir();
-    insert_root_dir(entry);
-    
-    return get_file(filename);
+void journal_end_txn(int64_t nblocks) {
+    api_stats.journal_commits++;
+    api_stats.journal_records += journal_nrecords;
+    api_stats.journal_bytes += journal_buff_len;
+    journal_head += nblocks;
+    journal_seq++;
+    journal_buff_len = sizeof(journal_txn);
+    journal_nrecords = 0;
 }
 
-int next_pos = 0;
 /**
- * Gets the name of the next file in the root directory
- * This maintains a global variable that is incremented on each function call
- * @param fname The return buffer variable
- * @return 1 if file found, 0 if no more file in the directory
+ * Empties the journal without writing the changes not committed yet back:
+ * the committed transactions are replayed to their home location from the
+ * journal, as at mount (the metadata in memory holds the transaction being
+ * built, its journal copies of the blocks are kept)
  */
-int sfs_getnextfilename(char* fname) { // get the name of the next file in directory
-    read_root_dir();
-    
-    if(next_pos >= root_dir->count) { 
-        return 0;
-    }
-    
-    char buff[1024];
-    sprintf(buff, "%s", (root_dir->entries[next_pos]).filename);
-    strcpy(fname, buff);
-    next_pos++;
-    return 1;
+void journal_drain() {
+    flush_disk();
+    journal_replay();
+    journal_head = 0;
 }
 
 /**
- * Gets the file size of a given file name
- * @param path The filename of the file
- * @return File size in Bytes, -1 if file not found
+ * Writes the log buffer to the journal as a transaction
+ *
+ * Basic algorithm:
+ *  - write the dirty data blocks back and free the blocks released
+ *  - build the transaction (see journal_build_txn)
+ *  - if there is no room left after the last transaction, empty the journal
+ *    (see journal_drain)
+ *  - make the data written back durable (see wb_barrier), then write it
+ *    after the last transaction, in one disk access
+ * @return 0 if written (or nothing to write), -1 if larger than the whole
+ *         journal (sfs_mkfs sizes it for the largest one, see journal_min_len)
  */
-int sfs_getfilesize(const char* path) { // get the size of a given file
-    read_root_dir();
+int journal_write_txn() {
+    wb_write_back();
+    journal_apply_frees();
+    int64_t nblocks = journal_build_txn();
+    if(nblocks == 0) { return 0; }
+    if(1 + journal_head + nblocks > sblock->journal_len && journal_head > 0) { journal_drain(); }
+    if(1 + journal_head + nblocks > sblock->journal_len) { return -1; }
     
-    directory_entry* entry = 0;
-    int directory_index = 0;
-    while(entry == 0 && directory_index < root_dir->count) {
-        char* namebuff = strdup((root_dir->entries[directory_index]).filename);
-        int cmp = strcmp(path, namebuff);
-        if(cmp == 0) {
-            entry = &root_dir->entries[directory_index];
-        }
+    pthread_mutex_lock(&wb_io_lock);
+    wb_barrier();
+    pthread_mutex_unlock(&wb_io_lock);
+    write_blocks(sblock->journal_start + 1 + journal_head, nblocks, journal_buff);
+    journal_end_txn(nblocks);
+    return 0;
+}
+
+/**
+ * Writes the journal header: the transactions from seq on are replayed at mount
+ */
+void journal_write_header() {
+    char* header_buff = calloc(1, block_size);
+    journal_txn header = { SFS_JOURNAL_MAGIC, 0, journal_seq, 0, 0, 0 };
+    memcpy(header_buff, &header, sizeof(journal_txn));
+    write_blocks(sblock->journal_start, 1, header_buff);
+    free(header_buff);
+}
+
+/**
+ * Writes the metadata back to its home location (a checkpoint), then
+ * empties the journal
+ *
+ * Basic algorithm:
+ *  - write the superblock and the inode table, the free block list, then
+ *    the journal copies of the changed blocks (adjacent blocks in one access)
+ *  - wait for the device, then write the journal header: a crash before
+ *    it replays the transactions again, which rewrites the same bytes (the
+ *    header must not reach the disk before the blocks it retires)
+ */
+void journal_write_back() {
+    char* superblock_buff = calloc(1 + sblock->inode_table_len, block_size);
+    char* inode_table_buff = superblock_buff + block_size;
+    memcpy(superblock_buff, sblock, sizeof(superblock));
+    memcpy(inode_table_buff, (int*)&(itbl->size), sizeof(int));
+    memcpy(inode_table_buff + sizeof(int), (int*)&(itbl->allocated_cnt), sizeof(int));
+    memcpy(inode_table_buff + 2*sizeof(int), (char*)(itbl->free_inodes), max_inodes * sizeof(char));
+    for(int i = 0; i < itbl->size; i++) {
+        if(itbl->free_inodes[i] == 1) { // inode at index i is used, persist on disk
+            memcpy(inode_table_buff + sizeof(int) * 2 + max_inodes * sizeof(char) + i * sizeof(inode), (inode*)&(itbl->inodes[i]), sizeof(inode));
+        }
+    }
+    write_blocks(0, 1 + sblock->inode_table_len, superblock_buff);
+    free(superblock_buff);
+    write_blocks(1 + sblock->inode_table_len, free_block_list_req_blocks, free_block_list);
+    
+    // the changed blocks, sorted
+    journal_pin** pins = malloc((journal_pin_count + 1) * sizeof(journal_pin*));
+    int64_t npins = 0;
+    for(int i = 0; i < SFS_JOURNAL_PIN_BUCKETS; i++) {
+        for(journal_pin* pin = journal_pins[i]; pin != 0; pin = pin->next) {
+            int64_t j = npins++;
+            while(j > 0 && pins[j - 1]->block > pin->block) { pins[j] = pins[j - 1]; j--; }
+            pins[j] = pin;
+        }
+        journal_pins[i] = 0;
+    }
+    char* run_buff = malloc(SFS_MAX_IO_RUN * block_size);
+    for(int64_t i = 0; i < npins; ) {
+        int64_t run_start = pins[i]->block;
+        int run_len = 0;
+        while(i + run_len < npins && run_len < SFS_MAX_IO_RUN && pins[i + run_len]->block == run_start + run_len) {
+            memcpy(run_buff + (int64_t)run_len * block_size, pins[i + run_len]->data, block_size);
+            free(pins[i + run_len]->data);
+            free(pins[i + run_len]);
+            run_len++;
+        }
+        write_blocks(run_start, run_len, run_buff);
+        i += run_len;
+    }
+    free(run_buff);
+    free(pins);
+    journal_pin_count = 0;
+    
+    sync_disk();
+    journal_write_header();
+    api_stats.journal_checkpoints++;
+    journal_head = 0;
+    journal_revoked = 0;
+    journal_buff_len = sizeof(journal_txn);
+    journal_nrecords = 0;
+}
+
+/**
+ * Commits the metadata changes: writes a transaction, then writes back if
+ * the journal is half full or holds too many block copies, or if a block
+ * with changes in the journal was released. A transaction larger than the
+ * journal (an image formatted with a smaller one) is only written back. The commit is handed to
+ * the system (it survives a crash of the process), the device is only
+ * synced by journal_sync.
+ */
+void journal_commit() {
+    if(journal_write_txn() == -1 || journal_head * 2 > sblock->journal_len
+            || journal_pin_count > sblock->journal_len || journal_revoked) {
+        journal_write_back();
+    }
+    flush_disk();
+}
+
+/**
+ * Commits the metadata changes and writes them back (the journal is empty)
+ */
+void journal_checkpoint() {
+    journal_write_txn();
+    journal_write_back();
+    flush_disk();
+}
+
+/**
+ * Group commit, at the end of an outermost sfs_* call (see op_timer_end),
+ * when the log buffer holds a quarter of the journal (the changes
+ * SFS_JOURNAL_COMMIT_MS old are committed by wb_flusher)
+ */
+void journal_op_end() {
+    if(journal_dirty_since == 0 || sblock == 0) { return; }
+    if(journal_buff_len * 4 >= sblock->journal_len * block_size) {
+        journal_commit();
+    }
+}
+
+/**
+ * Makes the changes so far durable (see sfs_fsync)
+ *
+ * Basic algorithm:
+ *  - commit the metadata changes, all of them in one transaction (the
+ *    journal orders nothing finer than a whole commit); for a data sync, no
+ *    commit if the file, its indirection blocks and the logged blocks are
+ *    unchanged since the last one: its data is in blocks already mapped
+ *  - write the dirty data blocks back, flush the buffered writes and wait
+ *    for the device (the commit waits for it once more, between the data
+ *    written in place and the transaction, see wb_barrier)
+ * @param inode_index The file, -1 for the whole file system
+ * @param datasync Only what is needed to read the data back (no commit if
+ *        the file is mapped as logged)
+ * @return 0 if durable, -1 if the device failed
+ */
+int journal_sync(int inode_index, int datasync) {
+    wb_write_back();
+    int mapped = inode_index >= 0 && journal_nrecords == 0 && !ind_cache_dirty[0] && !ind_cache_dirty[1]
+            && memcmp(&itbl->inodes[inode_index], &journal_shadow_inodes[inode_index], sizeof(inode)) == 0;
+    if(journal_dirty_since != 0 && !(datasync && mapped)) {
+        journal_commit();
+    }
+    return sync_disk();
+}
+
+/**
+ * Writes the metadata back when the process exits, as the file system is
+ * not explicitly unmounted
+ */
+void journal_exit() {
+    SFS_API_LOCK();
+    release_fs();
+}
+
+/**
+ * Starts journaling the mounted (or just formatted) file system: its
+ * current metadata is the logged one, the journal is empty
+ */
+void journal_init() {
+    journal_shadow_sblock = *sblock;
+    journal_shadow_hdr[0] = itbl->size;
+    journal_shadow_hdr[1] = itbl->allocated_cnt;
+    journal_shadow_free_inodes = malloc(max_inodes);
+    memcpy(journal_shadow_free_inodes, itbl->free_inodes, max_inodes);
+    journal_shadow_inodes = malloc(max_inodes * sizeof(inode));
+    memcpy(journal_shadow_inodes, itbl->inodes, max_inodes * sizeof(inode));
+    journal_shadow_free_list = malloc(sblock->fs_size);
+    memcpy(journal_shadow_free_list, free_block_list, sblock->fs_size);
+    
+    journal_buff_cap = block_size;
+    journal_buff = malloc(journal_buff_cap);
+    journal_buff_len = sizeof(journal_txn);
+    journal_nrecords = 0;
+    journal_head = 0;
+    journal_dirty_since = 0;
+    journal_revoked = 0;
+    
+    if(!journal_exit_registered) {
+        atexit(journal_exit);
+        pthread_atfork(fork_prepare, fork_parent, fork_child);
+        journal_exit_registered = 1;
+    }
+}
+
+/**
+ * Releases the journal of the file system being released (after a checkpoint)
+ */
+void journal_release() {
+    free(journal_shadow_free_inodes); journal_shadow_free_inodes = 0;
+    free(journal_shadow_inodes); journal_shadow_inodes = 0;
+    free(journal_shadow_free_list); journal_shadow_free_list = 0;
+    free(journal_buff); journal_buff = 0;
+    free(journal_freed); journal_freed = 0;
+    journal_freed_count = 0; journal_freed_cap = 0; journal_txn_frees = 0;
+    journal_frag_freed = 0;
+}
+
+/**
+ * Replays the committed transactions of the journal on the disk (at mount,
+ * before the metadata is read)
+ *
+ * Basic algorithm:
+ *  - the journal header gives the sequence number of the first transaction
+ *  - read the transactions in order while their sequence number follows and
+ *    their checksum matches (the last one may have been torn by a crash)
+ *  - write each record at its home location (read/modify/write the blocks)
+ *  - wait for the device, then update the journal header so that they are
+ *    not replayed again
+ * @return the number of transactions replayed
+ */
+int64_t journal_replay() {
+    char* block_buff = malloc(block_size);
+    journal_txn txn;
+    read_blocks(sblock->journal_start, 1, block_buff);
+    memcpy(&txn, block_buff, sizeof(journal_txn));
+    if(txn.magic != SFS_JOURNAL_MAGIC) {
+        free(block_buff);
+        journal_seq = 1;
+        return 0;
+    }
+    journal_seq = txn.seq;
+    
+    int64_t replayed = 0;
+    int64_t head = 0;
+    while(1 + head < sblock->journal_len) {
+        read_blocks(sblock->journal_start + 1 + head, 1, block_buff);
+        memcpy(&txn, block_buff, sizeof(journal_txn));
+        if(txn.magic != SFS_JOURNAL_MAGIC || txn.seq != journal_seq || txn.nblocks <= 0
+                || 1 + head + txn.nblocks > sblock->journal_len || txn.bytes < (int64_t)sizeof(journal_txn)
+                || txn.bytes > txn.nblocks * block_size) {
+            break;
+        }
+        
+        char* txn_buff = malloc(txn.nblocks * block_size);
+        read_blocks(sblock->journal_start + 1 + head, txn.nblocks, txn_buff);
+        if(journal_checksum(txn_buff + sizeof(journal_txn), txn.bytes - sizeof(journal_txn)) != txn.checksum) {
+            free(txn_buff);
+            break;
+        }
+        
+        int64_t pos = sizeof(journal_txn);
+        for(int64_t i = 0; i < txn.nrecords && pos + (int64_t)sizeof(journal_record) <= txn.bytes; i++) {
+            journal_record rec;
+            memcpy(&rec, txn_buff + pos, sizeof(journal_record));
+            pos += sizeof(journal_record);
+            
+            // the record may span several blocks
+            for(int64_t done = 0; done < rec.len; ) {
+                int64_t block = (rec.addr + done) / block_size;
+                int offset = (rec.addr + done) % block_size;
+                int len = rec.len - done > block_size - offset ? block_size - offset : rec.len - done;
+                read_blocks(block, 1, block_buff);
+                memcpy(block_buff + offset, txn_buff + pos + done, len);
+                write_blocks(block, 1, block_buff);
+                done += len;
+            }
+            pos += rec.len;
+        }
+        free(txn_buff);
+        
+        head += txn.nblocks;
+        journal_seq++;
+        replayed++;
+    }
+    free(block_buff);
+    
+    if(replayed > 0) {
+        sync_disk();
+        journal_write_header();
+    }
+    return replayed;
+}
+
+/*
+ * Write-back of the file data
+ *
+ * The data blocks written by the calls stay in memory (dirty) and are
+ * written to the disk by a background thread, the flusher: when the oldest
+ * is SFS_WB_EXPIRE_MS old, when they exceed the background threshold
+ * (SFS_WB_BACKGROUND_RATIO % of SFS_WB_DIRTY_LIMIT), or before a commit.
+ * It sorts them and writes the adjacent ones with one disk access, without
+ * holding the file system lock: the calls go on meanwhile. It also commits
+ * the metadata changes SFS_JOURNAL_COMMIT_MS old, the same way: their
+ * transaction is written after the data it maps.
+ *
+ * Over the background threshold, a writer is paused after its call in
+ * proportion to the dirty data over the threshold (SFS_WB_MAX_PAUSE_MS at
+ * the limit), so that it writes at the pace of the disk; at the limit it
+ * writes back itself.
+ *
+ * A commit writes the dirty blocks back first: a transaction never maps a
+ * block whose data is not on the disk. So do the syncs, and sfs_imap for
+ * the blocks of its extents (they are read from the disk).
+ */
+
+// the dirty data blocks (hashed by block), wb_count is declared with the journal
+wb_block* wb_blocks[SFS_WB_BUCKETS];
+int64_t wb_seq;
+
+// start of the oldest dirty block (ns), 0 if none
+int64_t wb_dirty_since;
+
+// serializes the write-backs: the flusher writes without the file system lock
+pthread_mutex_t wb_io_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// data blocks written since the last wb_barrier (under wb_io_lock)
+int wb_unsynced;
+
+// wakes the flusher up before its period
+pthread_mutex_t wb_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wb_wake = PTHREAD_COND_INITIALIZER;
+
+// the file system the flusher runs for (a new one at every mount)
+int wb_gen;
+
+/**
+ * Finds a dirty block
+ * @return its entry, 0 (null ptr) if not dirty
+ */
+wb_block* wb_find(int64_t block) {
+    for(wb_block* entry = wb_blocks[block % SFS_WB_BUCKETS]; entry != 0; entry = entry->next) {
+        if(entry->block == block) { return entry; }
+    }
+    return 0;
+}
+
+/**
+ * Drops a dirty block (written back, or released: its data is dead)
+ */
+void wb_remove(int64_t block) {
+    for(wb_block** link = &wb_blocks[block % SFS_WB_BUCKETS]; *link != 0; link = &(*link)->next) {
+        if((*link)->block != block) { continue; }
+        
+        wb_block* entry = *link;
+        *link = entry->next;
+        free(entry->data);
+        free(entry);
+        wb_count--;
+        return;
+    }
+}
+
+/**
+ * Writes blocks of file data, in memory: they are written back later
+ * @param start_block The first disk block
+ * @param nblocks The number of blocks
+ * @param buff The data (nblocks blocks)
+ */
+void wb_write(int64_t start_block, int64_t nblocks, const char* buff) {
+    if(wb_count == 0) { wb_dirty_since = clock_ns(); }
+    for(int64_t i = 0; i < nblocks; i++) {
+        wb_block* entry = wb_find(start_block + i);
+        if(entry == 0) {
+            entry = malloc(sizeof(wb_block));
+            entry->block = start_block + i;
+            entry->data = malloc(block_size);
+            entry->next = wb_blocks[entry->block % SFS_WB_BUCKETS];
+            wb_blocks[entry->block % SFS_WB_BUCKETS] = entry;
+            wb_count++;
+        }
+        memcpy(entry->data, buff + i * block_size, block_size);
+        entry->seq = ++wb_seq;
+    }
+}
+
+int compare_wb_blocks(const void* a, const void* b) {
+    int64_t block_a = (*(wb_block* const*)a)->block;
+    int64_t block_b = (*(wb_block* const*)b)->block;
+    return block_a < block_b ? -1 : block_a > block_b;
+}
+
+/**
+ * Copies the dirty blocks to write them back, sorted by block. They stay
+ * dirty (and readable) until the write-back is done (see wb_clean).
+ * @param batch Return variable: the copy
+ */
+void wb_collect(wb_batch* batch) {
+    wb_block** entries = malloc((wb_count + 1) * sizeof(wb_block*));
+    int64_t count = 0;
+    for(int i = 0; i < SFS_WB_BUCKETS; i++) {
+        for(wb_block* entry = wb_blocks[i]; entry != 0; entry = entry->next) {
+            entries[count++] = entry;
+        }
+    }
+    qsort(entries, count, sizeof(wb_block*), compare_wb_blocks);
+    
+    batch->count = count;
+    batch->blocks = malloc((count + 1) * sizeof(int64_t));
+    batch->seqs = malloc((count + 1) * sizeof(int64_t));
+    batch->data = malloc(count * block_size + 1);
+    batch->requests = 0;
+    for(int64_t i = 0; i < count; i++) {
+        batch->blocks[i] = entries[i]->block;
+        batch->seqs[i] = entries[i]->seq;
+        memcpy(batch->data + i * block_size, entries[i]->data, block_size);
+    }
+    free(entries);
+    wb_dirty_since = 0;
+}
+
+/**
+ * Writes a batch to the disk, the adjacent blocks with one access (up to
+ * SFS_WB_MAX_RUN_BYTES). The caller holds wb_io_lock.
+ */
+void wb_write_runs(wb_batch* batch) {
+    int max_run = SFS_WB_MAX_RUN_BYTES / block_size > 0 ? SFS_WB_MAX_RUN_BYTES / block_size : 1;
+    for(int64_t i = 0; i < batch->count; ) {
+        int run_len = 1;
+        while(i + run_len < batch->count && run_len < max_run && batch->blocks[i + run_len] == batch->blocks[i] + run_len) {
+            run_len++;
+        }
+        write_blocks(batch->blocks[i], run_len, batch->data + i * block_size);
+        batch->requests++;
+        i += run_len;
+    }
+    if(batch->count > 0) { wb_unsynced = 1; }
+}
+
+/**
+ * Makes the data blocks written back so far durable, before a transaction
+ * mapping them is written (the device is only synced if some were written
+ * since the last barrier). The caller holds wb_io_lock.
+ */
+void wb_barrier() {
+    if(wb_unsynced) {
+        sync_disk();
+        wb_unsynced = 0;
+    }
+}
+
+/**
+ * Frees a copy of the dirty blocks
+ */
+void wb_free_batch(wb_batch* batch) {
+    free(batch->blocks);
+    free(batch->seqs);
+    free(batch->data);
+}
+
+/**
+ * Ends a write-back: the blocks not written again meanwhile are clean, then
+ * frees the batch
+ */
+void wb_clean(wb_batch* batch) {
+    for(int64_t i = 0; i < batch->count; i++) {
+        wb_block* entry = wb_find(batch->blocks[i]);
+        if(entry != 0 && entry->seq == batch->seqs[i]) { wb_remove(batch->blocks[i]); }
+    }
+    if(batch->count > 0) {
+        api_stats.wb_flushes++;
+        api_stats.wb_blocks += batch->count;
+        api_stats.wb_requests += batch->requests;
+    }
+    wb_free_batch(batch);
+}
+
+/**
+ * Writes all the dirty blocks back, now. Waits for the write-back of the
+ * flusher in progress even if nothing is dirty: its transaction is not on
+ * the disk yet (see journal_sync)
+ */
+void wb_write_back() {
+    pthread_mutex_lock(&wb_io_lock);
+    if(wb_count == 0) {
+        pthread_mutex_unlock(&wb_io_lock);
+        return;
+    }
+    
+    wb_batch batch;
+    wb_collect(&batch);
+    wb_write_runs(&batch);
+    pthread_mutex_unlock(&wb_io_lock);
+    wb_clean(&batch);
+}
+
+/**
+ * Writes a dirty block back now, if it is dirty (its disk copy is read
+ * without the file system, see sfs_imap)
+ */
+void wb_write_back_block(int64_t block) {
+    wb_block* entry = wb_count > 0 ? wb_find(block) : 0;
+    if(entry == 0) { return; }
+    
+    pthread_mutex_lock(&wb_io_lock);
+    write_blocks(block, 1, entry->data);
+    wb_unsynced = 1;
+    pthread_mutex_unlock(&wb_io_lock);
+    wb_remove(block);
+}
+
+/**
+ * Throttles a writer, at the end of a write: wakes the flusher up over the
+ * background threshold and pauses the writer (see sfs_lock_release) in
+ * proportion to the dirty data over it, writes back at the limit
+ */
+void wb_balance() {
+    int64_t dirty = wb_count * block_size;
+    int64_t background = (int64_t)SFS_WB_DIRTY_LIMIT / 100 * SFS_WB_BACKGROUND_RATIO;
+    if(dirty < background) { return; }
+    
+    pthread_cond_signal(&wb_wake);
+    if(dirty >= SFS_WB_DIRTY_LIMIT) {
+        api_stats.wb_limit_flushes++;
+        wb_write_back();
+        return;
+    }
+    int64_t pause = SFS_WB_MAX_PAUSE_MS * 1000000LL * (dirty - background) / (SFS_WB_DIRTY_LIMIT - background);
+    if(pause > wb_pause_ns) {
+        api_stats.wb_throttles++;
+        api_stats.wb_pause_ns += pause - wb_pause_ns;
+        wb_pause_ns = pause;
+    }
+}
+
+/**
+ * Writes the dirty blocks back without the file system lock, followed by a
+ * transaction of the metadata changes (the commits of the flusher). The
+ * caller holds the lock, it is released meanwhile.
+ *
+ * Basic algorithm:
+ *  - with the lock: copy the dirty blocks, build the transaction (it maps
+ *    no block whose data is not in the copy or on the disk) and take its
+ *    place in the journal; the blocks released before it are logged as
+ *    reserved (free at mount), not reused until it is written
+ *  - without the lock: write the blocks, adjacent ones in one access, sync
+ *    the device (see wb_barrier), then the transaction
+ *  - with the lock: mark the blocks not written again meanwhile clean, free
+ *    the blocks released before the transaction
+ * A transaction needing a checkpoint, or releasing fragment slots, is
+ * committed with the lock (see journal_commit).
+ * @param gen The generation of the file system of the flusher
+ * @param commit Also commit the metadata changes
+ * @return 0, -1 if the file system was released meanwhile
+ */
+int wb_flush(int gen, int commit) {
+    wb_batch batch;
+    pthread_mutex_lock(&wb_io_lock);
+    wb_collect(&batch);
+    
+    char* txn_buff = 0;
+    int64_t txn_block = 0;
+    int64_t nblocks = commit ? journal_build_txn() : 0;
+    if(nblocks > 0 && (journal_frag_freed || journal_revoked || (1 + journal_head + nblocks) * 2 > sblock->journal_len
+            || journal_pin_count > sblock->journal_len)) {
+        pthread_mutex_unlock(&wb_io_lock);
+        wb_free_batch(&batch);
+        journal_commit();
+        return 0;
+    }
+    if(nblocks > 0) {
+        txn_block = sblock->journal_start + 1 + journal_head;
+        txn_buff = malloc(nblocks * block_size);
+        memcpy(txn_buff, journal_buff, nblocks * block_size);
+        journal_txn_frees = journal_freed_count;
+        journal_end_txn(nblocks);
+    }
+    
+    pthread_mutex_t* lock = &sfs_lock;
+    sfs_lock_release(&lock);
+    set_disk_tag("writeback");
+    wb_write_runs(&batch);
+    if(txn_buff != 0) {
+        wb_barrier();
+        write_blocks(txn_block, nblocks, txn_buff);
+        free(txn_buff);
+    }
+    flush_disk();
+    pthread_mutex_unlock(&wb_io_lock);
+    sfs_lock_acquire();
+    
+    if(gen != wb_gen) {
+        wb_free_batch(&batch);
+        return -1;
+    }
+    wb_clean(&batch);
+    journal_apply_txn_frees();
+    return 0;
+}
+
+/**
+ * The flusher: writes the dirty blocks back and commits the metadata
+ * changes in the background (see wb_flush), until the file system it runs
+ * for is released. Every SFS_WB_INTERVAL_MS (or when woken up), it writes
+ * the dirty blocks back if they are expired or over the background
+ * threshold, and commits the metadata changes SFS_JOURNAL_COMMIT_MS old.
+ * @param arg The generation of the file system (wb_gen)
+ */
+void* wb_flusher(void* arg) {
+    int gen = (int)(intptr_t)arg;
+    pthread_mutex_t* lock = &sfs_lock;
+    while(1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += SFS_WB_INTERVAL_MS * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L) { deadline.tv_sec++; deadline.tv_nsec -= 1000000000L; }
+        pthread_mutex_lock(&wb_wake_lock);
+        pthread_cond_timedwait(&wb_wake, &wb_wake_lock, &deadline);
+        pthread_mutex_unlock(&wb_wake_lock);
+        
+        lock = sfs_lock_acquire();
+        if(gen != wb_gen) { break; }
         
-        free(namebuff);
-        directory_index++;
+        int64_t now = clock_ns();
+        int commit = journal_dirty_since != 0 && now - journal_dirty_since >= SFS_JOURNAL_COMMIT_MS * 1000000LL;
+        int flush = wb_count > 0 && (now - wb_dirty_since >= SFS_WB_EXPIRE_MS * 1000000LL
+                || wb_count * block_size >= (int64_t)SFS_WB_DIRTY_LIMIT / 100 * SFS_WB_BACKGROUND_RATIO);
+        if((commit || flush) && wb_flush(gen, commit) == -1) { break; }
+        sfs_lock_release(&lock);
+    }
+    sfs_lock_release(&lock);
+    return 0;
+}
+
+/**
+ * Starts the flusher of the mounted (or just formatted) file system
+ */
+void wb_init() {
+    pthread_t thread;
+    if(pthread_create(&thread, 0, wb_flusher, (void*)(intptr_t)wb_gen) == 0) {
+        pthread_detach(thread);
+    }
+}
+
+/**
+ * Stops the flusher of the file system being released: it exits when it
+ * gets the lock. Waits for its write-back in progress, if any, as it writes
+ * without the file system lock: the disk must not be checkpointed, closed
+ * or replaced under it (it cannot start another one, the caller holds the
+ * file system lock)
+ */
+void wb_release() {
+    wb_gen++;
+    pthread_cond_signal(&wb_wake);
+    pthread_mutex_lock(&wb_io_lock);
+    pthread_mutex_unlock(&wb_io_lock);
+}
+
+/*
+ * Initializes the inode table data structure (in mem)
+ */
+void initialize_inode_table() {
+    itbl = malloc(sizeof(inode_table));
+    
+    itbl->free_inodes = (char*)calloc(max_inodes, sizeof(char));
+    itbl->inodes = (inode*)calloc(max_inodes, sizeof(inode));
+    itbl->refs = (int64_t*)calloc(max_inodes, sizeof(int64_t));
+    itbl->dir_hints = (int*)calloc(max_inodes, sizeof(int));
+    itbl->allocated_cnt = 0;
+    itbl->size = max_inodes;
+    
+    for(int i = 0; i < max_inodes; i++) {
+        itbl->free_inodes[i] = 0;
+    }
+}
+
+/**
+ * Initializes the file descriptor table data structure (in mem)
+ */
+void initialize_file_descriptor_table() {
+    fdtbl = malloc(sizeof(file_descriptor_table));
+    
+    fdtbl->size = SFS_MAX_FDENTRIES;
+    for(int i = 0; i < fdtbl->size; i++) {
+        (fdtbl->entries[i]).in_use = 0;
+    }
+}
+
+/**
+ * Reads the free block list data structure from the disk to main memory
+ * 
+ * Basic algorithm:
+ *   Free block list is stored as a (char) array of length = number of blocks
+ *   Read as a whole block (no iteration)
+ */
+void read_free_block_list() {
+    char* free_block_buff = malloc(free_block_list_req_blocks * block_size);
+    read_blocks(1 + sblock->inode_table_len, free_block_list_req_blocks, free_block_buff);
+    memcpy(free_block_list, free_block_buff, free_block_list_req_blocks * block_size);
+    
+    // the blocks released before a transaction of the flusher are logged as
+    // reserved (see wb_flush): the transaction releasing them is committed
+    for(int64_t i = 0; i < sblock->fs_size; i++) {
+        if(free_block_list[i] == 2) { free_block_list[i] = 0; }
     }
+    free(free_block_buff);
+}
+
+/**
+ * Reads the inode table from the disk to main memory
+ */
+void read_inode_table() {
+    if(itbl != 0) { free(itbl->inodes); free(itbl->free_inodes); free(itbl->refs); free(itbl->dir_hints); free(itbl); }
+    
+    char* inode_table_buff = malloc(sblock->inode_table_len * block_size);
+    read_blocks(1, sblock->inode_table_len, inode_table_buff);
+    
+    itbl = malloc(sizeof(inode_table));
+    itbl->size = *((int*)inode_table_buff);
+    itbl->allocated_cnt = *((int*)(inode_table_buff + sizeof(int)));
     
-    if(entry == 0) { return -1; }
+    itbl->free_inodes = (char*)calloc(itbl->size, sizeof(char));
+    itbl->inodes = (inode*)calloc(itbl->size, sizeof(inode));
+    itbl->refs = (int64_t*)calloc(itbl->size, sizeof(int64_t));
+    itbl->dir_hints = (int*)calloc(itbl->size, sizeof(int));
+    
+    memcpy(itbl->free_inodes, (void*)(inode_table_buff + 2*sizeof(int)), max_inodes * sizeof(char));
+    memcpy(itbl->inodes, (void*)(inode_table_buff + 2*sizeof(int) + max_inodes * sizeof(char)), itbl->size * sizeof(inode));
+    
+    free(inode_table_buff);
+}
+
+/**
+ * Main method to allocate block of data on the disk. This method makes sure to
+ * flag block used by the allocation as used in the free block list as well as
+ * persisting data from buffer in main memory (written back by the flusher,
+ * see wb_write).
+ * @param start_block the disk block to start from
+ * @param nblocks the number of block to write 
+ * @param buff the actual buffer containing data
+ */
+void allocate_block(int64_t start_block, int64_t nblocks, char* buff) {
+    wb_write(start_block, nblocks, buff);
     
-    return (itbl->inodes[entry->inode_index]).size;
+    for(int64_t i = start_block; i < (start_block + nblocks); i++) {
+        if(free_block_list[i] == 0) { sblock->free_block_count--; }
+        free_block_list[i] = 1;
+    }
+    
+    journal_touch();
+}
+
+/**
+ * Flags a block as free in the free block list (in memory only) and keeps
+ * the free block counter up to date. The block is only reusable after the
+ * next journal commit: until then it is flagged 2 (see journal_apply_frees).
+ * @param block the disk block to release
+ */
+void release_block(int64_t block) {
+    if(free_block_list[block] != 1) { return; }
+    sblock->free_block_count++;
+    free_block_list[block] = 2;
+    
+    if(journal_freed_count == journal_freed_cap) {
+        journal_freed_cap = journal_freed_cap == 0 ? 64 : journal_freed_cap * 2;
+        journal_freed = realloc(journal_freed, journal_freed_cap * sizeof(int64_t));
+    }
+    journal_freed[journal_freed_count++] = block;
+    journal_unpin(block);
+    if(wb_count > 0) { wb_remove(block); }
+}
+
+/**
+ * Deallocate disk block while maintaining the free_block_list updated.
+ * @param start_block start block to be deallocated
+ * @param nblock the number of block to be deallocated
+ */
+void deallocate_block(int64_t start_block, int64_t nblock) {
+    for(int64_t i = start_block; i < (start_block + nblock); i++) {
+        release_block(i);
+    }
+    
+    journal_touch();
+}
+
+/**
+ * Save the inode at a given index, maintain the free_inodes char array list
+ * up to date
+ * @param inode the inode to be stored
+ * @param index the index
+ */
+void save_inode(inode* inode, int index) {
+    itbl->inodes[index] = *inode;
+    if(itbl->free_inodes[index] == 0) { itbl->allocated_cnt++; sblock->free_inode_count--; }
+    itbl->free_inodes[index] = 1;
+    
+    journal_touch();
+}
+
+/**
+ * Finds contiguous blocks to be allocated for a desired length (in bytes).
+ * 
+ * Basic greedy algorithm: 
+ *  - Starting from first block
+ *    - check if there is n blocks available (from free block list)
+ *    - if not: loop and start at start_index + len
+ *    - return start_index with n as length
+ * 
+ * @param desired_len The desired buffer size to store (in bytes)
+ * @param start_block Ptrs to the variable start_block return variable
+ * @param len Ptrs to the variable len return variable
+ * @return 1 if space found, -1 if no space found
+ */
+int find_free_space(int64_t desired_len, int64_t* start_block, int64_t* len) {
+    int64_t num_blocks = (desired_len + block_size - 1) / block_size;
+    int64_t scanned = 0;
+    for(int64_t i = 0; i < sblock->fs_size; i++) {
+        char i_isfree = free_block_list[i];
+        scanned++;
+        if(i_isfree == 0) {
+            char contiguous = 1;
+            int64_t j = i;
+            while(contiguous && j < (i + num_blocks)) {
+                char j_isfree = free_block_list[j];
+                contiguous = j_isfree == 0 ? 1 : 0;
+                j++;
+            }
+            scanned += j - i - 1;
+            
+            if(contiguous) {
+                count_scan(&api_stats.block_alloc, scanned);
+                *start_block = i;
+                *len = num_blocks;
+                return 1;
+            }
+        }
+    }
+    
+    count_scan(&api_stats.block_alloc, scanned);
+    
+    // the blocks released since the last commit are free once it is written
+    if(journal_freed_count > 0 || journal_frag_freed) {
+        journal_commit();
+        return find_free_space(desired_len, start_block, len);
+    }
+    *start_block = -1;
+    *len = -1;
+    return -1;
+}
+
+/**
+ * Drops the cached copies of a given indirection block (when it is freed)
+ * @param block the disk block
+ */
+void invalidate_ind_cache(int64_t block) {
+    for(int i = 0; i < 2; i++) {
+        if(ind_cache_block[i] == block) { ind_cache_block[i] = 0; ind_cache_dirty[i] = 0; }
+    }
+}
+
+/**
+ * Persists the dirty indirection blocks held in the cache (through the journal)
+ */
+void flush_ind_cache() {
+    for(int i = 0; i < 2; i++) {
+        if(ind_cache_dirty[i]) {
+            journal_write_block(ind_cache_block[i], (char*)ind_cache_ptrs[i]);
+            ind_cache_dirty[i] = 0;
+        }
+    }
+}
+
+/**
+ * Loads an indirection block (an array of disk block pointers) through the
+ * indirection block cache. The cache holds one block per level so that
+ * walking a double indirection does not evict the block being walked.
+ * @param block the disk block of the indirection block
+ * @param level 0 for a block pointing to data blocks, 1 for a double indirection block
+ * @return the pointers of the indirection block
+ */
+int64_t* load_ind_block(int64_t block, int level) {
+    if(ind_cache_ptrs[level] == 0) { ind_cache_ptrs[level] = malloc(block_size); }
+    
+    if(ind_cache_block[level] == block) {
+        api_stats.ind_cache_hits++;
+    } else {
+        api_stats.ind_cache_misses++;
+        if(ind_cache_dirty[level]) {
+            journal_write_block(ind_cache_block[level], (char*)ind_cache_ptrs[level]);
+            ind_cache_dirty[level] = 0;
+        }
+        read_disk_blocks(block, 1, ind_cache_ptrs[level]);
+        ind_cache_block[level] = block;
+    }
+    return ind_cache_ptrs[level];
+}
+
+/**
+ * Updates one pointer of an indirection block (written back on flush_ind_cache)
+ */
+void set_ind_ptr(int64_t block, int level, int64_t index, int64_t value) {
+    int64_t* ptrs = load_ind_block(block, level);
+    ptrs[index] = value;
+    ind_cache_dirty[level] = 1;
+}
+
+/**
+ * Allocates a fresh (zeroed) indirection block
+ * @return the disk block, -1 if no space left
+ */
+int64_t allocate_ind_block() {
+    int64_t start, len;
+    if(find_free_space(block_size, &start, &len) == -1) { return -1; }
+    
+    char* block_buff = calloc(1, block_size);
+    allocate_block(start, 1, block_buff);
+    free(block_buff);
+    return start;
+}
+
+/**
+ * Maps a logical block of a file to its disk block.
+ * 
+ * Logical blocks are addressed through the direct pointers, then the
+ * indirection block, then the double indirection block.
+ * @param file_inode the inode of the file
+ * @param lblock the logical block index (offset / block size)
+ * @return the disk block, 0 if the logical block is not allocated
+ */
+int64_t get_data_block(inode* file_inode, int64_t lblock) {
+    if(lblock < SFS_NUM_DIRECT_PTR) {
+        return file_inode->ptrs[lblock];
+    }
+    lblock -= SFS_NUM_DIRECT_PTR;
+    
+    if(lblock < indirection_datablock_count) {
+        if(file_inode->ind_block_ptr == 0) { return 0; }
+        return load_ind_block(file_inode->ind_block_ptr, 0)[lblock];
+    }
+    lblock -= indirection_datablock_count;
+    
+    if(lblock < (int64_t)indirection_datablock_count * indirection_datablock_count) {
+        if(file_inode->dind_block_ptr == 0) { return 0; }
+        int64_t ind_block = load_ind_block(file_inode->dind_block_ptr, 1)[lblock / indirection_datablock_count];
+        if(ind_block == 0) { return 0; }
+        return load_ind_block(ind_block, 0)[lblock % indirection_datablock_count];
+    }
+    
+    return 0;
+}
+
+/**
+ * Maps a logical block of a file to a disk block, allocating the indirection
+ * blocks on the way if needed.
+ * @param file_inode the inode of the file
+ * @param lblock the logical block index
+ * @param pblock the disk block
+ * @return 1 if mapped, -1 if the file would be too large or no space left
+ */
+int set_data_block(inode* file_inode, int64_t lblock, int64_t pblock) {
+    if(lblock < SFS_NUM_DIRECT_PTR) {
+        file_inode->ptrs[lblock] = pblock;
+        if(lblock >= file_inode->allocated_ptr) { file_inode->allocated_ptr = lblock + 1; }
+        return 1;
+    }
+    lblock -= SFS_NUM_DIRECT_PTR;
+    
+    if(lblock < indirection_datablock_count) {
+        if(file_inode->ind_block_ptr == 0) {
+            int64_t ind_block = allocate_ind_block();
+            if(ind_block == -1) { return -1; }
+            file_inode->ind_block_ptr = ind_block;
+        }
+        set_ind_ptr(file_inode->ind_block_ptr, 0, lblock, pblock);
+        return 1;
+    }
+    lblock -= indirection_datablock_count;
+    
+    if(lblock < (int64_t)indirection_datablock_count * indirection_datablock_count) {
+        if(file_inode->dind_block_ptr == 0) {
+            int64_t dind_block = allocate_ind_block();
+            if(dind_block == -1) { return -1; }
+            file_inode->dind_block_ptr = dind_block;
+        }
+        int64_t ind_block = load_ind_block(file_inode->dind_block_ptr, 1)[lblock / indirection_datablock_count];
+        if(ind_block == 0) {
+            ind_block = allocate_ind_block();
+            if(ind_block == -1) { return -1; }
+            set_ind_ptr(file_inode->dind_block_ptr, 1, lblock / indirection_datablock_count, ind_block);
+        }
+        set_ind_ptr(ind_block, 0, lblock % indirection_datablock_count, pblock);
+        return 1;
+    }
+    
+    return -1;
+}
+
+/**
+ * Number of fragment slots needed by the tail of a file (the bytes of its
+ * last, partial, logical block)
+ * @param file_inode the inode of the file
+ * @return the number of slots, 0 if the file has no partial last block
+ */
+int tail_slots(inode* file_inode) {
+    int tail_len = file_inode->size % block_size;
+    return (tail_len + frag_slot_size - 1) / frag_slot_size;
+}
+
+/**
+ * Flags nslots slots starting at slot as used in a fragment block, adding the
+ * block to the fragment table if it is not there yet (used when mounting)
+ */
+void register_fragment(int64_t block, int slot, int nslots) {
+    uint64_t mask = (nslots == SFS_FRAG_SLOTS ? ~(uint64_t)0 : (((uint64_t)1 << nslots) - 1)) << slot;
+    
+    for(int i = 0; i < frag_count; i++) {
+        if(frag_tbl[i].block == block) { frag_tbl[i].used |= mask; return; }
+    }
+    
+    if(frag_count == frag_cap) {
+        frag_cap = frag_cap == 0 ? 64 : frag_cap * 2;
+        frag_tbl = realloc(frag_tbl, frag_cap * sizeof(fragment_block));
+    }
+    frag_tbl[frag_count].block = block;
+    frag_tbl[frag_count].used = mask;
+    frag_tbl[frag_count].freed = 0;
+    frag_count++;
+}
+
+/**
+ * Finds nslots contiguous free slots in the fragment blocks
+ * 
+ * Basic algorithm:
+ *  - first fit over the fragment blocks that are not full
+ *  - if none has enough room, allocate a new fragment block
+ * @param nslots The number of slots needed
+ * @param block Return variable: the fragment block
+ * @param slot Return variable: the first slot
+ * @return 1 if found, -1 if no space left
+ */
+int find_fragment(int nslots, int64_t* block, int* slot) {
+    uint64_t mask = ((uint64_t)1 << nslots) - 1;
+    
+    for(int i = 0; i < frag_count; i++) {
+        if(frag_tbl[i].used == ~(uint64_t)0) { continue; }
+        for(int s = 0; s + nslots <= SFS_FRAG_SLOTS; s++) {
+            if((frag_tbl[i].used & (mask << s)) == 0) {
+                count_scan(&api_stats.frag_alloc, i + 1);
+                frag_tbl[i].used |= mask << s;
+                *block = frag_tbl[i].block;
+                *slot = s;
+                return 1;
+            }
+        }
+    }
+    count_scan(&api_stats.frag_alloc, frag_count);
+    
+    int64_t start_block, len;
+    if(find_free_space(block_size, &start_block, &len) == -1) { return -1; }
+    char* frag_buff = calloc(1, block_size);
+    allocate_block(start_block, 1, frag_buff);
+    free(frag_buff);
+    
+    register_fragment(start_block, 0, nslots);
+    *block = start_block;
+    *slot = 0;
+    return 1;
+}
+
+/**
+ * Releases nslots slots of a fragment block, the block itself is released
+ * once its last slot is freed. Like the blocks, the slots are only reusable
+ * after the next journal commit (see journal_apply_frees).
+ */
+void release_fragment(int64_t block, int slot, int nslots) {
+    uint64_t mask = ((uint64_t)1 << nslots) - 1;
+    
+    for(int i = 0; i < frag_count; i++) {
+        if(frag_tbl[i].block != block) { continue; }
+        
+        frag_tbl[i].freed |= mask << slot;
+        journal_frag_freed = 1;
+        journal_touch();
+        return;
+    }
+}
+
+/**
+ * Moves the last partial block of a file to a fragment block (tail packing),
+ * so that small files do not waste most of a block.
+ * 
+ * Basic algorithm:
+ *  - only files with a partial last block, that is mapped, are packed
+ *  - find free slots for the tail and copy it there
+ *  - unmap and release the last block, remember the fragment in the inode
+ * @param file_inode the inode of the file
+ * @return 1 if packed (the caller persists the inode table), 0 otherwise
+ */
+int pack_tail(inode* file_inode) {
+    if(file_inode->flags & (SFS_INODE_INLINE | SFS_INODE_TAIL)) { return 0; }
+    if(S_ISDIR(file_inode->mode)) { return 0; }
+    
+    int nslots = tail_slots(file_inode);
+    if(nslots == 0 || nslots >= SFS_FRAG_SLOTS) { return 0; }
+    
+    int64_t lblock = file_inode->size / block_size;
+    int64_t pblock = get_data_block(file_inode, lblock);
+    if(pblock == 0) { return 0; }
+    
+    int64_t frag_block;
+    int slot;
+    if(find_fragment(nslots, &frag_block, &slot) == -1) { return 0; }
+    
+    char* tail_buff = malloc(block_size);
+    char* frag_buff = malloc(block_size);
+    read_disk_blocks(pblock, 1, tail_buff);
+    read_disk_blocks(frag_block, 1, frag_buff);
+    memcpy(frag_buff + slot * frag_slot_size, tail_buff, nslots * frag_slot_size);
+    wb_write(frag_block, 1, frag_buff);
+    free(tail_buff);
+    free(frag_buff);
+    
+    set_data_block(file_inode, lblock, 0);
+    deallocate_block(pblock, 1);
+    
+    file_inode->flags |= SFS_INODE_TAIL;
+    file_inode->tail_block = frag_block;
+    file_inode->tail_slot = slot;
+    flush_ind_cache();
+    return 1;
+}
+
+/**
+ * Moves a packed tail back to a block of its own (before the file is written)
+ * @param file_inode the inode of the file
+ * @return 1 if unpacked, -1 if no space left
+ */
+int unpack_tail(inode* file_inode) {
+    int nslots = tail_slots(file_inode);
+    int64_t lblock = file_inode->size / block_size;
+    
+    int64_t start_block, len;
+    if(find_free_space(block_size, &start_block, &len) == -1) { return -1; }
+    
+    char* frag_buff = malloc(block_size);
+    char* tail_buff = calloc(1, block_size);
+    read_disk_blocks(file_inode->tail_block, 1, frag_buff);
+    memcpy(tail_buff, frag_buff + file_inode->tail_slot * frag_slot_size, file_inode->size % block_size);
+    allocate_block(start_block, 1, tail_buff);
+    free(frag_buff);
+    free(tail_buff);
+    
+    if(set_data_block(file_inode, lblock, start_block) == -1) {
+        deallocate_block(start_block, 1);
+        return -1;
+    }
+    
+    release_fragment(file_inode->tail_block, file_inode->tail_slot, nslots);
+    file_inode->flags &= ~SFS_INODE_TAIL;
+    file_inode->tail_block = 0;
+    file_inode->tail_slot = 0;
+    return 1;
+}
+
+/**
+ * Flags the data blocks of a file from a logical block to the end of the
+ * file, and the indirection blocks left empty, as free in the free block list
+ * (the caller persists the free block list and flushes the indirection cache).
+ * With first_lblock = 0, every block of the file is released.
+ * @param file_inode the inode of the file
+ * @param first_lblock the first logical block to release
+ */
+void release_file_blocks(inode* file_inode, int64_t first_lblock) {
+    if(file_inode->flags & SFS_INODE_INLINE) {
+        memset(file_inode->ptrs, 0, SFS_INLINE_SIZE); // inline data, no block to release
+        return;
+    }
+    
+    if((file_inode->flags & SFS_INODE_TAIL) && file_inode->size / block_size >= first_lblock) {
+        release_fragment(file_inode->tail_block, file_inode->tail_slot, tail_slots(file_inode));
+        file_inode->flags &= ~SFS_INODE_TAIL;
+    }
+    
+    for(int i = first_lblock < SFS_NUM_DIRECT_PTR ? first_lblock : SFS_NUM_DIRECT_PTR; i < SFS_NUM_DIRECT_PTR; i++) {
+        if(file_inode->ptrs[i] != 0) { release_block(file_inode->ptrs[i]); }
+        file_inode->ptrs[i] = 0;
+    }
+    
+    // indirection block: logical blocks [base, base + P)
+    int64_t base = SFS_NUM_DIRECT_PTR;
+    if(file_inode->ind_block_ptr != 0 && first_lblock < base + indirection_datablock_count) {
+        int64_t* ptrs = load_ind_block(file_inode->ind_block_ptr, 0);
+        for(int64_t i = first_lblock > base ? first_lblock - base : 0; i < indirection_datablock_count; i++) {
+            if(ptrs[i] == 0) { continue; }
+            release_block(ptrs[i]);
+            if(first_lblock > base) { set_ind_ptr(file_inode->ind_block_ptr, 0, i, 0); }
+        }
+        if(first_lblock <= base) {
+            release_block(file_inode->ind_block_ptr);
+            invalidate_ind_cache(file_inode->ind_block_ptr);
+            file_inode->ind_block_ptr = 0;
+        }
+    }
+    
+    // double indirection block: logical blocks [base, base + P * P)
+    base += indirection_datablock_count;
+    if(file_inode->dind_block_ptr != 0 && first_lblock < base + (int64_t)indirection_datablock_count * indirection_datablock_count) {
+        for(int i = 0; i < indirection_datablock_count; i++) {
+            int64_t ind_base = base + (int64_t)i * indirection_datablock_count;
+            if(ind_base + indirection_datablock_count <= first_lblock) { continue; }
+            
+            int64_t ind_block = load_ind_block(file_inode->dind_block_ptr, 1)[i];
+            if(ind_block == 0) { continue; }
+            
+            int64_t* ptrs = load_ind_block(ind_block, 0);
+            for(int64_t j = first_lblock > ind_base ? first_lblock - ind_base : 0; j < indirection_datablock_count; j++) {
+                if(ptrs[j] == 0) { continue; }
+                release_block(ptrs[j]);
+                if(first_lblock > ind_base) { set_ind_ptr(ind_block, 0, j, 0); }
+            }
+            if(first_lblock <= ind_base) {
+                release_block(ind_block);
+                invalidate_ind_cache(ind_block);
+                if(first_lblock > base) { set_ind_ptr(file_inode->dind_block_ptr, 1, i, 0); }
+            }
+        }
+        if(first_lblock <= base) {
+            release_block(file_inode->dind_block_ptr);
+            invalidate_ind_cache(file_inode->dind_block_ptr);
+            file_inode->dind_block_ptr = 0;
+        }
+    }
+    
+    if(file_inode->allocated_ptr > first_lblock) { file_inode->allocated_ptr = first_lblock; }
+}
+
+/**
+ * Finds the next available inode index
+ * Returns the first free available inode index
+ * @param inode_index Ptr to return variable
+ * @return -1 if no space found , 1 if found
+ */
+int find_next_available_inode_index(int* inode_index) {
+    for(int i = 0; i < max_inodes; i++) {
+        if(itbl->free_inodes[i] == 0) {
+            count_scan(&api_stats.inode_alloc, i + 1);
+            *inode_index = i;
+            return 1;
+        }
+    }
+    
+    count_scan(&api_stats.inode_alloc, max_inodes);
+    return -1;
+}
+
+/**
+ * Finds the next available file descriptor index
+ * Returns the first free available file descriptor index
+ * @param fd_index Ptr to return variable
+ * @return -1 if no fd entry avail, 1 if found
+ */
+int find_next_avail_fd_entry(int* fd_index) {
+    for(int i = 0; i < fdtbl->size; i++) {
+        if((fdtbl->entries[i]).in_use == 0) { *fd_index = i; return 1; }
+    }
+    
+    return -11;
+}
+
+
+/**
+ * Tells if a block worth of data is all zeros (such blocks are not allocated
+ * when written over a hole)
+ * @param buf The data (block_size bytes)
+ * @return 1 if all zeros, 0 otherwise
+ */
+int is_zero_block(char* buf) {
+    for(int i = 0; i < block_size; i++) {
+        if(buf[i] != 0) { return 0; }
+    }
+    return 1;
+}
+
+int inode_write(int inode_index, int64_t offset, char* buf, int len);
+
+/**
+ * Overwrites an allocated block of a file. The blocks of a directory are
+ * metadata: their changes go through the journal, the others are written
+ * in place (by the flusher, see wb_write).
+ * @param file_inode The inode of the file
+ * @param pblock The disk block
+ * @param buf The data (block_size bytes)
+ */
+void write_file_block(inode* file_inode, int64_t pblock, char* buf) {
+    if(S_ISDIR(file_inode->mode)) {
+        journal_write_block(pblock, buf);
+    } else {
+        wb_write(pblock, 1, buf);
+    }
+}
+
+/**
+ * Moves the data of an inline file to a data block (the file outgrows the
+ * inode)
+ * @param inode_index The inode of the file
+ * @return 1 if moved, -1 if no space left (the file stays inline)
+ */
+int promote_inline(int inode_index) {
+    inode* file_inode = &(itbl->inodes[inode_index]);
+    char inline_buff[SFS_INLINE_SIZE];
+    int64_t inline_len = file_inode->size;
+    
+    memcpy(inline_buff, file_inode->ptrs, SFS_INLINE_SIZE);
+    memset(file_inode->ptrs, 0, SFS_INLINE_SIZE);
+    file_inode->flags &= ~SFS_INODE_INLINE;
+    file_inode->size = 0;
+    if(inline_len > 0 && inode_write(inode_index, 0, inline_buff, inline_len) != inline_len) {
+        memcpy(file_inode->ptrs, inline_buff, SFS_INLINE_SIZE);
+        file_inode->flags |= SFS_INODE_INLINE;
+        file_inode->size = inline_len;
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * Writes data to a file at a given offset (the inode level of sfs_fwrite)
+ *
+ * Basic algorithm:
+ * - if the file is inline (see SFS_INODE_INLINE):
+ *    - if the data still fits in the inode, copy it there and return
+ *    - otherwise move the inline data to a data block and continue
+ * - while there is still something to write:
+ *    - map the logical block at offset to its disk block
+ *    - if the block is not allocated and the data is a whole block of zeros,
+ *      skip it (the range stays a hole and reads back as zeros)
+ *    - if the block is not allocated yet, allocate a contiguous run of
+ *      blocks for the rest of the write (or the largest run available),
+ *      write the data to it in one go and map the run in the inode
+ *    - otherwise, overwrite the block (read/modify/write if partial)
+ *  - update the file size and the inode table
+ * @param inode_index The inode of the file
+ * @param offset The position (in bytes) to start writing at
+ * @param buf The data buffer
+ * @param len Length of data to write on disk
+ * @return number of bytes written to disk, -1 if nothing could be written
+ *         (errno ENOSPC, EFBIG past the largest file)
+ */
+int inode_write(int inode_index, int64_t offset, char* buf, int len) {
+    inode* file_inode = &(itbl->inodes[inode_index]);
+    int total_written = 0;
+    
+    if(file_inode->flags & SFS_INODE_INLINE) {
+        if(offset + len <= SFS_INLINE_SIZE) {
+            memcpy((char*)file_inode->ptrs + offset, buf, len);
+            if(offset + len > file_inode->size) { file_inode->size = offset + len; }
+            journal_touch();
+            return len > 0 ? len : -1;
+        }
+        
+        // the file outgrows the inode: move the inline data to a data block
+        if(promote_inline(inode_index) == -1) { errno = ENOSPC; return -1; }
+    }
+    
+    // the tail block is about to change: give it a block of its own again
+    if((file_inode->flags & SFS_INODE_TAIL) && unpack_tail(file_inode) == -1) {
+        errno = ENOSPC;
+        return -1;
+    }
+    
+    while(len > 0) {
+        int64_t lblock = offset / block_size;
+        int block_offset = offset % block_size;
+        int64_t pblock = get_data_block(file_inode, lblock);
+        int written;
+        
+        if(pblock == 0 && block_offset == 0 && len >= block_size && lblock < max_file_blocks && is_zero_block(buf)) {
+            // a whole block of zeros over a hole: leave the hole
+            written = block_size;
+        } else if(pblock == 0) {
+            // allocate a run for the unallocated blocks left to write (up
+            // to the next allocated block or the next block of zeros)
+            int64_t run_len = (block_offset + (int64_t)len + block_size - 1) / block_size;
+            for(int64_t i = 1; i < run_len; i++) {
+                if(get_data_block(file_inode, lblock + i) != 0) { run_len = i; break; }
+                if((i + 1) * block_size <= block_offset + (int64_t)len && is_zero_block(buf + i * block_size - block_offset)) {
+                    run_len = i;
+                    break;
+                }
+            }
+            
+            int64_t run_start, found_len;
+            while(find_free_space(run_len * block_size, &run_start, &found_len) == -1 && run_len > 1) {
+                run_len /= 2;
+            }
+            if(run_start == -1) {
+                errno = ENOSPC;
+                break;
+            }
+            
+            written = run_len * block_size - block_offset > len ? len : (int)(run_len * block_size - block_offset);
+            char* run_buff = calloc(run_len, block_size);
+            memcpy(run_buff + block_offset, buf, written);
+            allocate_block(run_start, run_len, run_buff);
+            free(run_buff);
+            
+            // map the run, give back what cannot be mapped (file too large or no space for indirection)
+            int64_t mapped = 0;
+            while(mapped < run_len && set_data_block(file_inode, lblock + mapped, run_start + mapped) == 1) {
+                mapped++;
+            }
+            if(mapped < run_len) {
+                errno = lblock + mapped >= max_file_blocks ? EFBIG : ENOSPC;
+                deallocate_block(run_start + mapped, run_len - mapped);
+                if(mapped * block_size - block_offset < written) {
+                    written = mapped * block_size - block_offset;
+                }
+                if(written <= 0) { break; }
+            }
+        } else {
+            written = block_size - block_offset > len ? len : block_size - block_offset;
+            
+            if(written == block_size) {
+                write_file_block(file_inode, pblock, buf);
+            } else {
+                char* block_buff = malloc(block_size);
+                read_disk_blocks(pblock, 1, block_buff);
+                memcpy(block_buff + block_offset, buf, written);
+                write_file_block(file_inode, pblock, block_buff);
+                free(block_buff);
+            }
+        }
+        
+        buf += written;
+        len -= written;
+        offset += written;
+        total_written += written;
+    }
+    
+    if(offset > file_inode->size) {
+        file_inode->size = offset; // update file total file size
+    }
+    
+    flush_ind_cache();
+    journal_touch(); // the inode changed
+    if(!S_ISDIR(file_inode->mode)) { wb_balance(); }
+    return total_written > 0 ? total_written : -1;
+}
+
+/**
+ * Copies data to the iovec segments, from the current segment/offset
+ * @param iov The segments
+ * @param iov_index In/out: the current segment
+ * @param iov_offset In/out: the position in the current segment
+ * @param src The data, 0 (null ptr) to fill with zeros
+ * @param len The length of data to copy
+ */
+void iov_fill(const struct iovec* iov, int* iov_index, size_t* iov_offset, const char* src, int len) {
+    while(len > 0) {
+        size_t room = iov[*iov_index].iov_len - *iov_offset;
+        int n = room > (size_t)len ? len : (int)room;
+        char* dst = (char*)iov[*iov_index].iov_base + *iov_offset;
+        
+        if(src == 0) {
+            memset(dst, 0, n);
+        } else {
+            memcpy(dst, src, n);
+            src += n;
+        }
+        
+        len -= n;
+        *iov_offset += n;
+        if(*iov_offset == iov[*iov_index].iov_len) {
+            (*iov_index)++;
+            *iov_offset = 0;
+        }
+    }
+}
+
+/**
+ * The total length of several buffers
+ */
+int iov_length(const struct iovec* iov, int iovcnt) {
+    int len = 0;
+    for(int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+/**
+ * Reads data from a file at a given offset into a set of buffers (the inode
+ * level of sfs_fread/sfs_pread/sfs_readv)
+ *
+ * Basic Algorithm :
+ * - clamp the total length to the end of the file
+ * - if the file is inline, copy the data from the inode
+ * - while there is still something to be read
+ *    - map the logical block at offset to its disk block
+ *    - extend the read over the next blocks as long as they are contiguous
+ *      on disk (up to SFS_MAX_IO_RUN blocks) and read them at once
+ *    - scatter the data in the buffers (zeros if not allocated)
+ * @param inode_index The inode of the file
+ * @param offset The position (in bytes) to start reading at
+ * @param iov The buffers to return the data, filled in order
+ * @param iovcnt The number of buffers
+ * @return the length of data readed
+ */
+int inode_readv(int inode_index, int64_t offset, const struct iovec* iov, int iovcnt) {
+    inode* file_inode = &(itbl->inodes[inode_index]);
+    
+    int64_t len = 0;
+    for(int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    
+    int read_len = len;
+    if(offset >= file_inode->size) {
+        read_len = 0;
+    } else if(file_inode->size - offset < len) {
+        read_len = file_inode->size - offset;
+    }
+    
+    int iov_index = 0;
+    size_t iov_offset = 0;
+    
+    if(file_inode->flags & SFS_INODE_INLINE) {
+        iov_fill(iov, &iov_index, &iov_offset, (char*)file_inode->ptrs + offset, read_len);
+        return read_len;
+    }
+    
+    int read = 0;
+    char* run_buff = malloc(SFS_MAX_IO_RUN * block_size);
+    while(read_len > 0) {
+        int64_t lblock = offset / block_size;
+        int64_t pblock = get_data_block(file_inode, lblock);
+        int start_index = offset % block_size;
+        int to_read_len = start_index + read_len > block_size ? block_size - start_index : read_len;
+        char* src;
+        
+        if((file_inode->flags & SFS_INODE_TAIL) && lblock == file_inode->size / block_size) {
+            // packed tail: the data is in a slot of a fragment block
+            read_disk_blocks(file_inode->tail_block, 1, run_buff);
+            src = run_buff + file_inode->tail_slot * frag_slot_size + start_index;
+        } else if(pblock == 0) {
+            src = 0;
+        } else {
+            int run_len = 1;
+            while(run_len < SFS_MAX_IO_RUN && to_read_len < read_len
+                    && get_data_block(file_inode, lblock + run_len) == pblock + run_len) {
+                to_read_len += read_len - to_read_len > block_size ? block_size : read_len - to_read_len;
+                run_len++;
+            }
+            read_disk_blocks(pblock, run_len, run_buff);
+            src = run_buff + start_index;
+        }
+        iov_fill(iov, &iov_index, &iov_offset, src, to_read_len);
+        
+        read += to_read_len;
+        offset += to_read_len;
+        read_len -= to_read_len;
+    }
+    free(run_buff);
+    
+    return read;
+}
+
+/**
+ * Reads data from a file at a given offset (see inode_readv)
+ * @return the length of data readed
+ */
+int inode_read(int inode_index, int64_t offset, char* buf, int len) {
+    struct iovec iov = { buf, len };
+    return inode_readv(inode_index, offset, &iov, 1);
+}
+
+/**
+ * Changes the size of a file in place
+ * 
+ * Basic algorithm:
+ *  - inline files that stay small enough are truncated in the inode
+ *  - shrink: release the blocks past the new end of file (and the
+ *    indirection blocks left empty), zero the end of the new last block so
+ *    that a later extension reads zeros
+ *  - grow: only the size changes, the new range is a hole
+ *  - a file truncated to 0 becomes inline again
+ * @param inode_index The inode of the file
+ * @param new_size The new size (in bytes)
+ * @return 0 if resized, -1 if no space left (errno ENOSPC)
+ */
+int inode_truncate(int inode_index, int64_t new_size) {
+    inode* file_inode = &(itbl->inodes[inode_index]);
+    if(new_size == file_inode->size) { return 0; }
+    
+    if(file_inode->flags & SFS_INODE_INLINE) {
+        if(new_size <= SFS_INLINE_SIZE) {
+            if(new_size < file_inode->size) {
+                memset((char*)file_inode->ptrs + new_size, 0, file_inode->size - new_size);
+            }
+            file_inode->size = new_size;
+            journal_touch();
+            return 0;
+        }
+        if(promote_inline(inode_index) == -1) { errno = ENOSPC; return -1; }
+    }
+    
+    if((file_inode->flags & SFS_INODE_TAIL) && unpack_tail(file_inode) == -1) {
+        errno = ENOSPC;
+        return -1;
+    }
+    
+    if(new_size < file_inode->size) {
+        release_file_blocks(file_inode, (new_size + block_size - 1) / block_size);
+        
+        int64_t pblock = new_size % block_size != 0 ? get_data_block(file_inode, new_size / block_size) : 0;
+        if(pblock != 0) {
+            char* block_buff = malloc(block_size);
+            read_disk_blocks(pblock, 1, block_buff);
+            memset(block_buff + new_size % block_size, 0, block_size - new_size % block_size);
+            write_file_block(file_inode, pblock, block_buff);
+            free(block_buff);
+        }
+        
+        if(new_size == 0) { file_inode->flags |= SFS_INODE_INLINE; }
+    }
+    
+    file_inode->size = new_size;
+    flush_ind_cache();
+    journal_touch();
+    return 0;
+}
+
+/**
+ * Allocates and persists a new (empty) inode
+ * @param mode The mode of the inode (S_IFDIR for directories)
+ * @return the inode index, -1 if the inode table is full
+ */
+int create_inode(mode_t mode) {
+    int inode_index;
+    if(find_next_available_inode_index(&inode_index) == -1) { return -1; }
+    
+    inode new_inode;
+    memset(&new_inode, 0, sizeof(inode));
+    new_inode.mode = mode;
+    new_inode.flags = SFS_INODE_INLINE; // new files start inline until they outgrow the inode
+    
+    save_inode(&new_inode, inode_index);
+    return inode_index;
+}
+
+/**
+ * Releases an inode and all of its blocks
+ * @param inode_index The inode to release
+ */
+void free_inode(int inode_index) {
+    release_file_blocks(&itbl->inodes[inode_index], 0);
+    
+    memset(&itbl->inodes[inode_index], 0, sizeof(inode));
+    itbl->free_inodes[inode_index] = 0;
+    itbl->allocated_cnt--;
+    sblock->free_inode_count++;
+    journal_touch();
+}
+
+/**
+ * Releases an inode removed from its directory: now if no file descriptor
+ * (or sfs_ihold) references it, else at the last sfs_fclose (see put_inode).
+ * Meanwhile it is marked orphan on the disk, so that a crash does not leak
+ * it (sfs_mount frees the orphans).
+ * @param inode_index The inode to release
+ */
+void release_inode(int inode_index) {
+    if(itbl->refs[inode_index] == 0) {
+        free_inode(inode_index);
+        return;
+    }
+    (itbl->inodes[inode_index]).flags |= SFS_INODE_ORPHAN;
+    journal_touch();
+}
+
+/**
+ * Drops references to an inode, frees it if they were the last ones of an
+ * orphan (see release_inode)
+ * @param inode_index The inode referenced
+ * @param count The number of references dropped
+ */
+void put_inode(int inode_index, int64_t count) {
+    itbl->refs[inode_index] -= count;
+    if(itbl->refs[inode_index] <= 0 && ((itbl->inodes[inode_index]).flags & SFS_INODE_ORPHAN)) {
+        free_inode(inode_index);
+    }
+}
+
+/**
+ * Hashes a (directory inode, name) key (FNV-1a), to be reduced to the size
+ * of the dentry cache (or of the negative dentry cache)
+ */
+unsigned int dcache_hash(int parent, const char* name) {
+    unsigned int hash = 2166136261u ^ (unsigned int)parent;
+    for(; *name; name++) {
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Looks up a name in the dentry cache
+ * @param parent The inode of the directory
+ * @param name The name of the entry
+ * @return the inode of the entry, -1 if not cached
+ */
+int dcache_lookup(int parent, const char* name) {
+    dcache_entry* slot = &dcache[dcache_hash(parent, name) % SFS_DCACHE_SIZE];
+    if(slot->parent == parent && strcmp(slot->name, name) == 0) {
+        return slot->inode_index;
+    }
+    return -1;
+}
+
+/**
+ * Caches a directory entry. The cache is direct mapped: a colliding entry
+ * simply replaces the previous one.
+ */
+void dcache_insert(int parent, const char* name, int inode_index) {
+    dcache_entry* slot = &dcache[dcache_hash(parent, name) % SFS_DCACHE_SIZE];
+    slot->parent = parent;
+    slot->inode_index = inode_index;
+    strcpy(slot->name, name);
+}
+
+/**
+ * Drops a directory entry from the dentry cache (when it is removed)
+ */
+void dcache_invalidate(int parent, const char* name) {
+    dcache_entry* slot = &dcache[dcache_hash(parent, name) % SFS_DCACHE_SIZE];
+    if(slot->parent == parent && strcmp(slot->name, name) == 0) {
+        slot->parent = -1;
+    }
+}
+
+/**
+ * Tells if a name is known not to exist in a directory. Looking up a missing
+ * name otherwise reads and scans the whole directory, which build tools and
+ * path searches do over and over for the same names.
+ * @param parent The inode of the directory
+ * @param name The name of the entry
+ * @return 1 if the name is cached as missing, 0 if unknown
+ */
+int ncache_lookup(int parent, const char* name) {
+    dcache_entry* slot = &ncache[dcache_hash(parent, name) % SFS_NCACHE_SIZE];
+    return slot->parent == parent && strcmp(slot->name, name) == 0;
+}
+
+/**
+ * Caches a name as missing from a directory (direct mapped, like the dentry cache)
+ */
+void ncache_insert(int parent, const char* name) {
+    dcache_entry* slot = &ncache[dcache_hash(parent, name) % SFS_NCACHE_SIZE];
+    slot->parent = parent;
+    strcpy(slot->name, name);
+}
+
+/**
+ * Drops a negative dentry (when the name is created)
+ */
+void ncache_invalidate(int parent, const char* name) {
+    dcache_entry* slot = &ncache[dcache_hash(parent, name) % SFS_NCACHE_SIZE];
+    if(slot->parent == parent && strcmp(slot->name, name) == 0) {
+        slot->parent = -1;
+    }
+}
+
+// on disk, an entry is stored as inode index + 16 bytes name + 3 bytes extension
+const int dir_entry_disk_size = sizeof(int) + 16 + 3;
+
+/**
+ * Decodes one directory entry from its on-disk representation
+ */
+void decode_dir_entry(const char* entry_buff, directory_entry* entry) {
+    memcpy(&(entry->inode_index), entry_buff, sizeof(int));
+    memcpy(entry->filename, entry_buff + sizeof(int), 16);
+    memcpy(entry->extension, entry_buff + sizeof(int) + 16, 3);
+}
+
+/**
+ * Reads a directory from the disk to main memory
+ * - A directory is stored as the data of its inode: the slot count followed
+ *   by the slots, a free slot (removed entry) has inode_index -1 and the last
+ *   slot is never free
+ * - For each entry, read inode index, name & extension
+ * @param dir_inode The inode of the directory
+ * @return the directory (to be released with free_dir)
+ */
+directory* read_dir(int dir_inode) {
+    int64_t dir_size = (itbl->inodes[dir_inode]).size;
+    char* dir_buff = malloc(dir_size);
+    inode_read(dir_inode, 0, dir_buff, dir_size);
+    
+    directory* dir = malloc(sizeof(directory));
+    dir->count = *((int*)dir_buff);
+    dir->entries = (directory_entry*)calloc(dir->count + 1, sizeof(directory_entry));
+    
+    // for each entry, retrieve the filename, inode index and extension
+    for(int i = 0; i < dir->count; i++) {
+        decode_dir_entry(dir_buff + sizeof(int) + dir_entry_disk_size * i, &dir->entries[i]);
+    }
+    
+    free(dir_buff);
+    return dir;
+}
+
+/**
+ * Releases a directory read by read_dir
+ */
+void free_dir(directory* dir) {
+    free(dir->entries);
+    free(dir);
+}
+
+/**
+ * Finds the slot of the entry at a given position of a directory (the free
+ * slots are not counted)
+ * @return the slot, -1 if the directory has fewer entries
+ */
+int dir_entry_slot(directory* dir, int position) {
+    for(int i = 0; i < dir->count; i++) {
+        if((dir->entries[i]).inode_index != -1 && position-- == 0) { return i; }
+    }
+    return -1;
+}
+
+/**
+ * Persists one directory entry at a given position of a directory
+ */
+void write_dir_entry(int dir_inode, int position, directory_entry* entry) {
+    char entry_buff[dir_entry_disk_size];
+    memcpy(entry_buff, &(entry->inode_index), sizeof(int));
+    memcpy(entry_buff + sizeof(int), entry->filename, 16);
+    memcpy(entry_buff + sizeof(int) + 16, entry->extension, 3);
+    inode_write(dir_inode, sizeof(int) + (int64_t)dir_entry_disk_size * position, entry_buff, dir_entry_disk_size);
+}
+
+/**
+ * Creates an empty directory inode
+ * @return the inode index, -1 if no inode/space left
+ */
+int create_dir_inode() {
+    int dir_inode = create_inode(S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO);
+    if(dir_inode == -1) { return -1; }
+    
+    int count = 0;
+    if(inode_write(dir_inode, 0, (char*)&count, sizeof(int)) == -1) {
+        free_inode(dir_inode);
+        return -1;
+    }
+    return dir_inode;
+}
+
+/**
+ * Finds an entry of a directory
+ *
+ * Basic algorithm:
+ * - look the (directory, name) pair up in the dentry cache, then in the
+ *   negative dentry cache
+ * - on a miss, read the directory and cache all of its entries so that the
+ *   next lookups in this directory are served from memory, and remember the
+ *   name as missing if it is not there
+ * @param dir_inode The inode of the directory
+ * @param name The name of the entry
+ * @return the inode of the entry, -1 if not found
+ */
+int dir_lookup(int dir_inode, const char* name) {
+    int cached = dcache_lookup(dir_inode, name);
+    if(cached != -1) { api_stats.dcache_hits++; return cached; }
+    if(ncache_lookup(dir_inode, name)) { api_stats.ncache_hits++; return -1; }
+    
+    api_stats.dir_scans++;
+    directory* dir = read_dir(dir_inode);
+    int found = -1;
+    for(int i = 0; i < dir->count; i++) {
+        if((dir->entries[i]).inode_index == -1) { continue; }
+        dcache_insert(dir_inode, (dir->entries[i]).filename, (dir->entries[i]).inode_index);
+        if(strcmp((dir->entries[i]).filename, name) == 0) {
+            found = (dir->entries[i]).inode_index;
+        }
+    }
+    free_dir(dir);
+    
+    if(found == -1) {
+        ncache_insert(dir_inode, name);
+    }
+    return found;
+}
+
+/**
+ * Inserts an entry in a directory: the entry takes the first free slot, or
+ * is appended after the last one and the slot count updated (the other
+ * entries are not rewritten). Only the slots from the hint of the directory
+ * are searched, none when it has no free slot.
+ * @param dir_inode The inode of the directory
+ * @param name The name of the entry
+ * @param inode_index The inode of the entry
+ * @return 1 if inserted, -1 if no space left (errno ENOSPC)
+ */
+int dir_insert(int dir_inode, const char* name, int inode_index) {
+    int count;
+    inode_read(dir_inode, 0, (char*)&count, sizeof(int));
+    
+    int position = count;
+    int first = itbl->dir_hints[dir_inode];
+    if(first < count) {
+        char* slots_buff = malloc(dir_entry_disk_size * (count - first));
+        inode_read(dir_inode, sizeof(int) + (int64_t)dir_entry_disk_size * first, slots_buff, dir_entry_disk_size * (count - first));
+        for(int i = first; i < count; i++) {
+            int slot_inode;
+            memcpy(&slot_inode, slots_buff + dir_entry_disk_size * (i - first), sizeof(int));
+            if(slot_inode == -1) { position = i; break; }
+        }
+        free(slots_buff);
+    }
+    
+    directory_entry entry;
+    memset(&entry, 0, sizeof(directory_entry));
+    entry.inode_index = inode_index;
+    strcpy(entry.filename, name);
+    
+    write_dir_entry(dir_inode, position, &entry);
+    if(position == count) {
+        if((itbl->inodes[dir_inode]).size < sizeof(int) + (int64_t)dir_entry_disk_size * (count + 1)) {
+            errno = ENOSPC;
+            return -1;
+        }
+        count++;
+        inode_write(dir_inode, 0, (char*)&count, sizeof(int));
+    }
+    itbl->dir_hints[dir_inode] = position + 1;
+    dcache_insert(dir_inode, name, inode_index);
+    ncache_invalidate(dir_inode, name);
+    return 1;
+}
+
+/**
+ * Removes an entry from a directory: its slot is freed in place, so the other
+ * entries keep their position (see dir_read_batch). Removing the last slot
+ * shrinks the directory up to the last entry left instead, so an empty
+ * directory has no slot.
+ * @param dir_inode The inode of the directory
+ * @param name The name of the entry
+ * @return 1 if removed, -1 if not found
+ */
+int dir_remove(int dir_inode, const char* name) {
+    directory* dir = read_dir(dir_inode);
+    int position = -1;
+    for(int i = 0; i < dir->count; i++) {
+        if((dir->entries[i]).inode_index != -1 && strcmp((dir->entries[i]).filename, name) == 0) { position = i; }
+    }
+    
+    if(position == -1) {
+        free_dir(dir);
+        return -1;
+    }
+    
+    if(position == dir->count - 1) {
+        int count = position;
+        while(count > 0 && (dir->entries[count - 1]).inode_index == -1) { count--; }
+        inode_write(dir_inode, 0, (char*)&count, sizeof(int));
+        (itbl->inodes[dir_inode]).size = sizeof(int) + (int64_t)dir_entry_disk_size * count;
+        journal_touch();
+    } else {
+        directory_entry free_slot;
+        memset(&free_slot, 0, sizeof(directory_entry));
+        free_slot.inode_index = -1;
+        write_dir_entry(dir_inode, position, &free_slot);
+        if(position < itbl->dir_hints[dir_inode]) { itbl->dir_hints[dir_inode] = position; }
+    }
+    
+    dcache_invalidate(dir_inode, name);
+    ncache_insert(dir_inode, name);
+    free_dir(dir);
+    return 1;
+}
+
+/**
+ * Rewrites an entry of a directory in place with a new name and inode. Only
+ * that entry is written, so it is always either the old or the new one.
+ * @param dir_inode The inode of the directory
+ * @param name The name of the entry to rewrite
+ * @param new_name The new name of the entry
+ * @param inode_index The new inode of the entry
+ * @return 1 if rewritten, -1 if not found
+ */
+int dir_replace(int dir_inode, const char* name, const char* new_name, int inode_index) {
+    directory* dir = read_dir(dir_inode);
+    int position = -1;
+    for(int i = 0; i < dir->count; i++) {
+        if((dir->entries[i]).inode_index != -1 && strcmp((dir->entries[i]).filename, name) == 0) { position = i; }
+    }
+    free_dir(dir);
+    if(position == -1) { return -1; }
+    
+    directory_entry entry;
+    memset(&entry, 0, sizeof(directory_entry));
+    entry.inode_index = inode_index;
+    strcpy(entry.filename, new_name);
+    write_dir_entry(dir_inode, position, &entry);
+    
+    dcache_invalidate(dir_inode, name);
+    ncache_insert(dir_inode, name);
+    dcache_insert(dir_inode, new_name, inode_index);
+    ncache_invalidate(dir_inode, new_name);
+    return 1;
+}
+
+/**
+ * Tells if a directory is a given directory or one of its subdirectories
+ * (a directory cannot be moved under itself)
+ * @param dir_inode The inode of the directory
+ * @param target The inode to look for
+ * @return 1 if found in the tree of dir_inode, 0 otherwise
+ */
+int dir_contains(int dir_inode, int target) {
+    if(dir_inode == target) { return 1; }
+    
+    directory* dir = read_dir(dir_inode);
+    int found = 0;
+    for(int i = 0; i < dir->count && !found; i++) {
+        int child = (dir->entries[i]).inode_index;
+        if(child != -1 && S_ISDIR((itbl->inodes[child]).mode)) {
+            found = dir_contains(child, target);
+        }
+    }
+    free_dir(dir);
+    return found;
+}
+
+/**
+ * Reads a batch of entries of a directory, starting at the cursor position
+ *
+ * Basic algorithm:
+ *  - read the slot count, then only the slots of the batch in one read
+ *    (the rest of the directory is not read), again if some were free
+ *  - complete each entry with the size and type of its inode
+ *  - move the cursor after the last slot read
+ * An entry keeps its slot until it is removed (see dir_remove), so an entry
+ * present during the whole iteration is returned exactly once even if others
+ * are added or removed meanwhile.
+ * @param cursor The directory and position to read from
+ * @param entries Return variable: the entries read
+ * @param n The size of entries
+ * @return the number of entries read, 0 if no more entry
+ */
+int dir_read_batch(sfs_dir_cursor* cursor, sfs_dirent* entries, int n) {
+    int count;
+    inode_read(cursor->dir_inode, 0, (char*)&count, sizeof(int));
+    if(cursor->position < 0 || cursor->position >= count || n <= 0) { return 0; }
+    
+    char* entries_buff = malloc(dir_entry_disk_size * n);
+    int found = 0;
+    while(found < n && cursor->position < count) {
+        int slots = n - found < count - cursor->position ? n - found : count - cursor->position;
+        inode_read(cursor->dir_inode, sizeof(int) + (int64_t)dir_entry_disk_size * cursor->position, entries_buff, dir_entry_disk_size * slots);
+        
+        for(int i = 0; i < slots; i++) {
+            directory_entry entry;
+            decode_dir_entry(entries_buff + dir_entry_disk_size * i, &entry);
+            cursor->position++;
+            if(entry.inode_index == -1) { continue; }
+            inode* entry_inode = &itbl->inodes[entry.inode_index];
+            
+            strcpy(entries[found].name, entry.filename);
+            entries[found].inode_index = entry.inode_index;
+            entries[found].size = entry_inode->size;
+            entries[found].mode = S_ISDIR(entry_inode->mode) ? (S_IFDIR | 0755) : (S_IFREG | 0666);
+            entries[found].next_position = cursor->position;
+            found++;
+        }
+    }
+    
+    free(entries_buff);
+    return found;
+}
+
+/**
+ * Resolves a path to its inode, walking the directories from the root.
+ * Paths are '/' separated, relative paths are resolved from the root as well.
+ *
+ * @param path The path to resolve
+ * @param parent Return variable: the inode of the directory holding the last
+ *               component, -1 if that directory does not exist
+ * @param leaf Return variable: the last component of the path (SFS_MAX_FILENAME + 1 bytes)
+ * @return the inode of the path, -1 if not found (errno ENOENT, ENOTDIR or
+ *         ENAMETOOLONG)
+ */
+int resolve_path(const char* path, int* parent, char* leaf) {
+    char* path_copy = strdup(path);
+    char* save_ptr;
+    int current = sblock->root_inode_no;
+    
+    *parent = current;
+    leaf[0] = '\0';
+    
+    char* component = strtok_r(path_copy, "/", &save_ptr);
+    while(component != 0) {
+        if(current == -1 || !S_ISDIR((itbl->inodes[current]).mode) || strlen(component) > SFS_MAX_FILENAME) {
+            errno = current == -1 ? ENOENT : !S_ISDIR((itbl->inodes[current]).mode) ? ENOTDIR : ENAMETOOLONG;
+            *parent = -1;
+            current = -1;
+            break;
+        }
+        
+        *parent = current;
+        strcpy(leaf, component);
+        current = dir_lookup(current, component);
+        component = strtok_r(0, "/", &save_ptr);
+        if(current == -1 && component == 0) { errno = ENOENT; }
+    }
+    
+    free(path_copy);
+    return current;
+}
+
+/**
+ * Derives the in-memory geometry constants from the superblock. Every size
+ * used by the rest of the file system is taken from here rather than from the
+ * compile time defaults so that any formatted geometry can be mounted.
+ */
+void compute_geometry() {
+    block_size = sblock->block_size;
+    max_inodes = sblock->inode_count;
+    free_block_list_req_blocks = (sblock->fs_size + block_size - 1) / block_size;
+    indirection_datablock_count = block_size / sizeof(int64_t);
+    max_file_blocks = SFS_NUM_DIRECT_PTR + indirection_datablock_count + (int64_t)indirection_datablock_count * indirection_datablock_count;
+    frag_slot_size = block_size / SFS_FRAG_SLOTS;
+}
+
+/**
+ * Initializes the (empty) dentry caches
+ */
+void initialize_dcache() {
+    dcache = malloc(SFS_DCACHE_SIZE * sizeof(dcache_entry));
+    for(int i = 0; i < SFS_DCACHE_SIZE; i++) {
+        dcache[i].parent = -1;
+    }
+    ncache = malloc(SFS_NCACHE_SIZE * sizeof(dcache_entry));
+    for(int i = 0; i < SFS_NCACHE_SIZE; i++) {
+        ncache[i].parent = -1;
+    }
+}
+
+/**
+ * Releases the in-memory data structures of the currently mounted file system
+ * (if any) and closes its disk, after writing its metadata back.
+ */
+void release_fs() {
+    if(sblock == 0) { return; }
+    
+    wb_release();
+    journal_checkpoint();
+    journal_release();
+    close_disk();
+    if(itbl != 0) { free(itbl->inodes); free(itbl->free_inodes); free(itbl->refs); free(itbl->dir_hints); free(itbl); itbl = 0; }
+    free(dcache); dcache = 0;
+    free(ncache); ncache = 0;
+    free(fdtbl); fdtbl = 0;
+    free(free_block_list); free_block_list = 0;
+    free(frag_tbl); frag_tbl = 0; frag_count = 0; frag_cap = 0;
+    free(sblock); sblock = 0;
+    next_pos = 0;
+    for(int i = 0; i < 2; i++) {
+        free(ind_cache_ptrs[i]); ind_cache_ptrs[i] = 0;
+        ind_cache_block[i] = 0; ind_cache_dirty[i] = 0;
+    }
+}
+
+/**
+ * The smallest journal holding the largest transaction (see journal_write_txn):
+ * the records of the previous calls (up to a quarter of the journal, see
+ * journal_op_end), then the changes of one call, at most twice as long with
+ * their record headers: the superblock, four inodes (a rename replacing a
+ * file), the whole free block list, the indirection blocks of a file as
+ * large as the disk and a few directory blocks
+ * @return Its length in blocks, header included
+ */
+int64_t journal_min_len() {
+    int64_t ptrs_per_block = block_size / sizeof(int64_t);
+    int64_t call_bytes = sizeof(superblock) + 2 * sizeof(int) + 4 * (sizeof(char) + sizeof(inode)) + sblock->fs_size
+            + (sblock->fs_size / ptrs_per_block + 2) * block_size + 8 * (int64_t)block_size;
+    int64_t call_blocks = (sizeof(journal_txn) + 2 * call_bytes + block_size - 1) / block_size;
+    return 1 + call_blocks * 4 / 3 + 1;
+}
+
+/**
+ * Formats a fresh file system with the given geometry.
+ *
+ * Disk layout:
+ *   [superblock][inode table][free block list][journal][data blocks ...]
+ * The inode table spans as many blocks as needed to store num_inodes inodes,
+ * the free block list as many blocks as needed for one byte per block, the
+ * metadata journal 1/32 of the disk (see SFS_JOURNAL_MIN_BLOCKS), or more
+ * to hold the largest transaction (see journal_min_len).
+ *
+ * @param path The disk image to create
+ * @param bsize The block size (in bytes)
+ * @param num_blocks The total number of blocks of the disk
+ * @param num_inodes The number of inodes of the inode table
+ * @return 0 if formatted, -1 if the geometry is invalid or the disk cannot be created
+ */
+int sfs_mkfs(char* path, int bsize, int64_t num_blocks, int num_inodes) {
+    aio_release();
+    SFS_API_LOCK();
+    if(bsize < SFS_MIN_BLOCK_SIZE || num_inodes <= 0) { return -1; }
+    
+    release_fs();
+    
+    // create the super block
+    sblock = calloc(1, sizeof(superblock));
+    sblock->magic = SFS_MAGIC_NUMBER;
+    sblock->block_size = bsize;
+    sblock->fs_size = num_blocks;
+    sblock->inode_count = num_inodes;
+    sblock->inode_table_len = (2 * sizeof(int) + num_inodes * (sizeof(char) + sizeof(inode)) + bsize - 1) / bsize;
+    compute_geometry();
+    sblock->journal_start = 1 + sblock->inode_table_len + free_block_list_req_blocks;
+    sblock->journal_len = num_blocks / 32;
+    if(sblock->journal_len > SFS_JOURNAL_MAX_BYTES / bsize) { sblock->journal_len = SFS_JOURNAL_MAX_BYTES / bsize; }
+    if(sblock->journal_len < SFS_JOURNAL_MIN_BLOCKS) { sblock->journal_len = SFS_JOURNAL_MIN_BLOCKS; }
+    if(sblock->journal_len < journal_min_len()) { sblock->journal_len = journal_min_len(); }
+    
+    // superblock + inode table + free block list + journal + root directory
+    if(sblock->journal_start + sblock->journal_len + 1 > num_blocks) {
+        free(sblock); sblock = 0;
+        return -1;
+    }
+    
+    if(init_fresh_disk(path, block_size, sblock->fs_size) == -1) {
+        free(sblock); sblock = 0;
+        return -1;
+    }
+    
+    free_block_list = calloc(free_block_list_req_blocks, block_size);
+    initialize_inode_table();
+    initialize_dcache();
+    
+    int64_t offset = 0;
+    free_block_list[offset] = (char)1; // space for superblock
+    offset++;
+    
+    // allocate block for inode table
+    for(int i = 0; i < sblock->inode_table_len; i++) {
+        free_block_list[offset + i] = (char)1;
+    }
+    offset += sblock->inode_table_len;
+    
+    // allocate n block to free space management (bitvector)
+    for(int64_t i = 0; i < free_block_list_req_blocks; i++) {
+        free_block_list[(offset) + i] = (char)1;
+    }
+    offset += free_block_list_req_blocks;
+    
+    // allocate the journal
+    for(int64_t i = 0; i < sblock->journal_len; i++) {
+        free_block_list[offset + i] = (char)1;
+    }
+    offset += sblock->journal_len;
+    
+    sblock->free_block_count = num_blocks - offset;
+    sblock->free_inode_count = num_inodes;
+    
+    sblock->root_inode_no = create_dir_inode();
+    
+    // write all the metadata at its home location, with an empty journal
+    journal_seq = 1;
+    journal_init();
+    wb_write_back();
+    journal_write_back();
+    wb_init();
+    
+    initialize_file_descriptor_table();
+    return 0;
+}
+
+/**
+ * Mounts an existing file system. The geometry is read back from the
+ * superblock, so any image formatted by sfs_mkfs can be mounted.
+ * @param path The disk image to open
+ * @return 0 if mounted, -1 if the disk cannot be opened or is not a sfs disk
+ */
+int sfs_mount(char* path) {
+    aio_release();
+    SFS_API_LOCK();
+    release_fs();
+    
+    // read superblock (first bytes of block 0, whatever the block size is)
+    if(init_disk(path, sizeof(superblock), 1) == -1) { return -1; }
+    sblock = malloc(sizeof(superblock));
+    read_blocks(0, 1, sblock);
+    close_disk();
+    
+    if(sblock->magic != SFS_MAGIC_NUMBER || sblock->block_size < SFS_MIN_BLOCK_SIZE) {
+        printf("%s is not a sfs disk\n", path);
+        free(sblock); sblock = 0;
+        return -1;
+    }
+    compute_geometry();
+    
+    init_disk(path, block_size, sblock->fs_size);
+    
+    // the metadata changes committed but not written back are replayed, the
+    // superblock may be one of them
+    if(journal_replay() > 0) {
+        char* superblock_buff = malloc(block_size);
+        read_blocks(0, 1, superblock_buff);
+        memcpy(sblock, superblock_buff, sizeof(superblock));
+        free(superblock_buff);
+    }
+    
+    free_block_list = calloc(free_block_list_req_blocks, block_size);
+    initialize_inode_table();
+    initialize_dcache();
+    read_free_block_list();
+    read_inode_table();
+    
+    // rebuild the fragment table from the packed tails
+    for(int i = 0; i < max_inodes; i++) {
+        inode* file_inode = &itbl->inodes[i];
+        if(itbl->free_inodes[i] == 1 && (file_inode->flags & SFS_INODE_TAIL)) {
+            register_fragment(file_inode->tail_block, file_inode->tail_slot, tail_slots(file_inode));
+        }
+    }
+    journal_init();
+    wb_init();
+    initialize_file_descriptor_table();
+    
+    // the files removed while opened when the file system was last used
+    for(int i = 0; i < max_inodes; i++) {
+        if(itbl->free_inodes[i] == 1 && ((itbl->inodes[i]).flags & SFS_INODE_ORPHAN)) {
+            free_inode(i);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Initialize the file system
+ * Formats (or mounts) the default disk image with the default geometry.
+ * @param fresh Should we start from scratch or not?
+ */
+void mksfs(int fresh) {
+    aio_release();
+    SFS_API_LOCK();
+    if(fresh) {
+        sfs_mkfs(SFS_API_FILENAME, SFS_API_BLOCK_SIZE, SFS_API_NUM_BLOCKS, SFS_API_NUM_INODES);
+    } else {
+        sfs_mount(SFS_API_FILENAME);
+    }
+}
+
+/**
+ * Extracts the file extension from a given file name
+ * @param filename Filename with extension
+ * @return Extension of the file name
+ */
+const int extract_filename_ext(char* filename, char* ext_filename, char* ext_ext) {
+    char *dot = strrchr(filename, '.');
+    if(!dot || dot == filename) return -1;
+    
+    strncpy(ext_filename, filename, dot - filename);
+    strncpy(ext_ext, dot + 1, 3);
+    
+    return 0;
+}
+
+/**
+ * Create a file and insert it into a directory
+ * @param dir_inode The directory to create the file in
+ * @param filename The file name to create
+ * @return The inode of the newly created file, -1 if no inode/space left
+ *         (errno ENOSPC)
+ */
+int create_file(int dir_inode, char* filename) {
+    int inode_index = create_inode(S_IRWXU | S_IRWXG | S_IRWXO);
+    if(inode_index == -1) { errno = ENOSPC; return -1; }
+    
+    if(dir_insert(dir_inode, filename, inode_index) == -1) {
+        free_inode(inode_index);
+        errno = ENOSPC;
+        return -1;
+    }
+    
+    return inode_index;
+}
+
+/**
+ * Fills the attributes of an inode. The inode table is kept in memory and
+ * updated in place by every write, so this never touches the disk.
+ */
+void fill_stat(int inode_index, struct stat* st) {
+    inode* file_inode = &itbl->inodes[inode_index];
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = inode_index;
+    st->st_size = file_inode->size;
+    st->st_blksize = block_size;
+    st->st_blocks = (file_inode->size + 511) / 512;
+    if(S_ISDIR(file_inode->mode)) {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+    } else {
+        st->st_mode = S_IFREG | 0666;
+        st->st_nlink = 1;
+    }
+}
+
+/**
+ * Tells if an inode number is an allocated inode
+ */
+int valid_inode(int inode_index) {
+    return inode_index >= 0 && inode_index < max_inodes && itbl->free_inodes[inode_index] == 1;
+}
+
+/**
+ * Tells if an inode number is an allocated directory, not removed (see
+ * sfs_ihold), sets errno (ENOENT or ENOTDIR) if not
+ */
+int valid_dir_inode(int inode_index) {
+    if(!valid_inode(inode_index) || ((itbl->inodes[inode_index]).flags & SFS_INODE_ORPHAN)) { errno = ENOENT; return 0; }
+    if(!S_ISDIR((itbl->inodes[inode_index]).mode)) { errno = ENOTDIR; return 0; }
+    return 1;
+}
+
+/**
+ * Tells if an inode number is an allocated file (a removed file stays valid
+ * until its last reference, see release_inode), sets errno (ENOENT or EISDIR)
+ * if not
+ */
+int valid_file_inode(int inode_index) {
+    if(!valid_inode(inode_index)) { errno = ENOENT; return 0; }
+    if(S_ISDIR((itbl->inodes[inode_index]).mode)) { errno = EISDIR; return 0; }
+    return 1;
+}
+
+/**
+ * Removes an entry from its directory and releases its inode (at its last
+ * close if it is opened, see release_inode). Directories must be empty and
+ * the root directory cannot be removed.
+ * @param parent The inode of the directory holding the entry
+ * @param name The name of the entry
+ * @param inode_index The inode of the entry
+ * @return 0 if removed, -1 otherwise (errno EBUSY for the root, ENOTEMPTY)
+ */
+int unlink_entry(int parent, const char* name, int inode_index) {
+    if(S_ISDIR((itbl->inodes[inode_index]).mode)) {
+        if(inode_index == sblock->root_inode_no) { errno = EBUSY; return -1; }
+        
+        int count;
+        inode_read(inode_index, 0, (char*)&count, sizeof(int));
+        if(count > 0) { errno = ENOTEMPTY; return -1; }
+    }
+    
+    dir_remove(parent, name);
+    release_inode(inode_index);
+    return 0;
+}
+
+/**
+ * Renames (or moves) a directory entry, replacing the target if it exists
+ *
+ * Basic algorithm:
+ * - a file can only replace a file, a directory an empty directory, and a
+ *   directory cannot be moved under itself
+ * - target exists: its entry is rewritten to point to the renamed inode,
+ *   then the old entry is removed and the replaced inode released (at its
+ *   last close if it is opened, see release_inode), so the target name
+ *   always names either the old or the new file
+ * - same directory: the entry is rewritten in place with the new name
+ * - otherwise: the entry is inserted in the new directory before being
+ *   removed from the old one
+ * No data is copied, only directory entries are written.
+ * @param parent The directory holding the entry
+ * @param name The name of the entry
+ * @param new_parent The directory to move the entry to
+ * @param new_name The new name of the entry
+ * @return 0 if renamed, -1 otherwise (errno ENOENT, EINVAL for a directory
+ *         moved under itself, EISDIR/ENOTDIR if the types differ, ENOTEMPTY,
+ *         ENOSPC)
+ */
+int rename_entry(int parent, const char* name, int new_parent, const char* new_name) {
+    int inode_index = dir_lookup(parent, name);
+    if(inode_index == -1) { errno = ENOENT; return -1; }
+    
+    int target = dir_lookup(new_parent, new_name);
+    if(target == inode_index) { return 0; }
+    
+    int is_dir = S_ISDIR((itbl->inodes[inode_index]).mode);
+    if(is_dir && parent != new_parent && dir_contains(inode_index, new_parent)) { errno = EINVAL; return -1; }
+    
+    if(target != -1) {
+        if(S_ISDIR((itbl->inodes[target]).mode) != is_dir) { errno = is_dir ? ENOTDIR : EISDIR; return -1; }
+        if(is_dir) {
+            int count;
+            inode_read(target, 0, (char*)&count, sizeof(int));
+            if(count > 0) { errno = ENOTEMPTY; return -1; }
+        }
+        
+        dir_replace(new_parent, new_name, new_name, inode_index);
+        dir_remove(parent, name);
+        release_inode(target);
+    } else if(parent == new_parent) {
+        dir_replace(parent, name, new_name, inode_index);
+    } else {
+        if(dir_insert(new_parent, new_name, inode_index) == -1) { return -1; }
+        dir_remove(parent, name);
+    }
+    return 0;
+}
+
+/**
+ * Gets the name of the next file in the root directory
+ * This maintains a global position that is incremented on each function call
+ * and starts over once the end of the directory is reached
+ * @param fname The return buffer variable
+ * @return 1 if file found, 0 if no more file in the directory
+ */
+int sfs_getnextfilename_locked(char* fname) {
+    sfs_dir_cursor cursor = { sblock->root_inode_no, next_pos };
+    sfs_dirent entry;
+    
+    if(dir_read_batch(&cursor, &entry, 1) == 0) {
+        next_pos = 0;
+        return 0;
+    }
+    
+    strcpy(fname, entry.name);
+    next_pos = cursor.position;
+    return 1;
+}
+
+int sfs_getnextfilename(char* fname) { // get the name of the next file in directory
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_GETNEXTFILENAME, 0, 0, 0);
+    SFS_TRACE_RETURN(sfs_getnextfilename_locked(fname), 0, 0);
+}
+
+/**
+ * Gets the name of the entry at a given position of a directory
+ * @param path The path of the directory
+ * @param position The position of the entry (0 for the first one)
+ * @param fname The return buffer variable
+ * @return 1 if an entry exists at this position, 0 if no more entry, -1 if
+ *         path is not a directory
+ */
+int sfs_getdirentry_locked(const char* path, int position, char* fname) {
+    int parent;
+    char leaf[SFS_MAX_FILENAME + 1];
+    int dir_inode = resolve_path(path, &parent, leaf);
+    if(dir_inode == -1 || !S_ISDIR((itbl->inodes[dir_inode]).mode)) { return -1; }
+    
+    directory* dir = read_dir(dir_inode);
+    int slot = dir_entry_slot(dir, position);
+    if(slot != -1) {
+        strcpy(fname, (dir->entries[slot]).filename);
+    }
+    free_dir(dir);
+    return slot != -1;
+}
+
+int sfs_getdirentry(const char* path, int position, char* fname) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_GETDIRENTRY, 0, position, 0);
+    SFS_TRACE_RETURN(sfs_getdirentry_locked(path, position, fname), path, 0);
+}
+
+/**
+ * Starts an iteration over a directory (see sfs_readdir_batch). The cursor
+ * holds no resource: it does not need to be closed and its position can be
+ * saved and set back to resume the iteration later.
+ * @param path The path of the directory
+ * @param cursor Return variable: a cursor on the first entry
+ * @return 0 if started, -1 if path is not a directory
+ */
+int sfs_opendir_locked(const char* path, sfs_dir_cursor* cursor) {
+    int parent;
+    char leaf[SFS_MAX_FILENAME + 1];
+    int dir_inode = resolve_path(path, &parent, leaf);
+    if(dir_inode == -1) { return -1; }
+    if(!S_ISDIR((itbl->inodes[dir_inode]).mode)) { errno = ENOTDIR; return -1; }
+    
+    cursor->dir_inode = dir_inode;
+    cursor->position = 0;
+    return 0;
+}
+
+int sfs_opendir(const char* path, sfs_dir_cursor* cursor) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_OPENDIR, 0, 0, 0);
+    SFS_TRACE_RETURN(sfs_opendir_locked(path, cursor), path, 0);
+}
+
+/**
+ * Reads the next entries of a directory with their inode, size and type, so
+ * a directory can be listed without a lookup per entry (see dir_read_batch)
+ * @param cursor The cursor returned by sfs_opendir (or sfs_iopendir)
+ * @param entries Return variable: the entries read
+ * @param n The size of entries
+ * @return the number of entries read, 0 if no more entry, -1 if the
+ *         directory does not exist anymore
+ */
+int sfs_readdir_batch_locked(sfs_dir_cursor* cursor, sfs_dirent* entries, int n) {
+    if(!valid_inode(cursor->dir_inode) || !S_ISDIR((itbl->inodes[cursor->dir_inode]).mode)) { return -1; }
+    
+    return dir_read_batch(cursor, entries, n);
+}
+
+int sfs_readdir_batch(sfs_dir_cursor* cursor, sfs_dirent* entries, int n) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_READDIR_BATCH, cursor->dir_inode, n, cursor->position);
+    SFS_TRACE_RETURN(sfs_readdir_batch_locked(cursor, entries, n), 0, 0);
+}
+
+/**
+ * Gets the file size of a given file name
+ * @param path The path of the file
+ * @return File size in Bytes, -1 if file not found
+ */
+int64_t sfs_getfilesize_locked(const char* path) {
+    int parent;
+    char leaf[SFS_MAX_FILENAME + 1];
+    int inode_index = resolve_path(path, &parent, leaf);
+    if(inode_index == -1) { return -1; }
+    
+    return (itbl->inodes[inode_index]).size;
+}
+
+int64_t sfs_getfilesize(const char* path) { // get the size of a given file
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_GETFILESIZE, 0, 0, 0);
+    SFS_TRACE_RETURN(sfs_getfilesize_locked(path), path, 0);
+}
+
+/**
+ * Tells if a path is a directory
+ * @param path The path
+ * @return 1 if directory, 0 if regular file, -1 if not found
+ */
+int sfs_isdir_locked(const char* path) {
+    int parent;
+    char leaf[SFS_MAX_FILENAME + 1];
+    int inode_index = resolve_path(path, &parent, leaf);
+    if(inode_index == -1) { return -1; }
+    
+    return S_ISDIR((itbl->inodes[inode_index]).mode) ? 1 : 0;
+}
+
+int sfs_isdir(const char* path) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_ISDIR, 0, 0, 0);
+    SFS_TRACE_RETURN(sfs_isdir_locked(path), path, 0);
+}
+
+/**
+ * Gets the attributes of a path with a single path walk: a path that does
+ * not exist is usually answered by the (negative) dentry cache alone
+ * @param path The path
+ * @param st Return variable (type, permissions, size and block usage)
+ * @return 0 if found, -1 if not found
+ */
+int sfs_stat_locked(const char* path, struct stat* st) {
+    int parent;
+    char leaf[SFS_MAX_FILENAME + 1];
+    int inode_index = resolve_path(path, &parent, leaf);
+    if(inode_index == -1) { return -1; }
+    
+    fill_stat(inode_index, st);
+    return 0;
+}
+
+int sfs_stat(const char* path, struct stat* st) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_STAT, 0, 0, 0);
+    SFS_TRACE_RETURN(sfs_stat_locked(path, st), path, 0);
+}
+
+/**
+ * Gets the size and free space of the file system, from the counters of the
+ * superblock (nothing is scanned)
+ * @param st Return variable: block size, total/free blocks and inodes
+ * @return 0
+ */
+int sfs_statfs_locked(struct statvfs* st) {
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = block_size;
+    st->f_frsize = block_size;
+    st->f_blocks = sblock->fs_size;
+    st->f_bfree = sblock->free_block_count;
+    st->f_bavail = sblock->free_block_count;
+    st->f_files = sblock->inode_count;
+    st->f_ffree = sblock->free_inode_count;
+    st->f_favail = sblock->free_inode_count;
+    st->f_namemax = SFS_MAX_FILENAME;
+    return 0;
+}
+
+int sfs_statfs(struct statvfs* st) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_STATFS, 0, 0, 0);
+    SFS_TRACE_RETURN(sfs_statfs_locked(st), 0, 0);
+}
+
+/**
+ * Gets the sizes of the free extents (runs of contiguous free blocks) of the
+ * disk. This scans the free block list: it is meant for tools measuring
+ * fragmentation, not for frequent calls (see sfs_statfs).
+ * @param histogram Return variable: histogram[i] is the number of free
+ *                  extents of 2^i to 2^(i + 1) - 1 blocks, the last bucket
+ *                  counts all the larger ones
+ * @param nbuckets The size of histogram
+ * @return the number of free extents
+ */
+int64_t sfs_free_extents(int64_t* histogram, int nbuckets) {
+    SFS_API_LOCK();
+    memset(histogram, 0, nbuckets * sizeof(int64_t));
+    
+    int64_t count = 0;
+    int64_t run = 0;
+    for(int64_t i = 0; i <= sblock->fs_size; i++) {
+        if(i < sblock->fs_size && free_block_list[i] == 0) {
+            run++;
+            continue;
+        }
+        if(run == 0) { continue; }
+        
+        int bucket = 0;
+        while(bucket < nbuckets - 1 && (run >> (bucket + 1)) != 0) { bucket++; }
+        histogram[bucket]++;
+        count++;
+        run = 0;
+    }
+    return count;
+}
+
+/**
+ * Creates a directory
+ *
+ * Basic Algorithm:
+ * - resolve the parent directory, fail if it does not exist or the path exists
+ * - create an empty directory inode
+ * - insert it in its parent directory
+ * @param path The path of the directory to create
+ * @return 0 if created, -1 otherwise (errno EEXIST, ENOSPC, or see resolve_path)
+ */
+int sfs_mkdir_locked(char* path) {
+    int parent;
+    char leaf[SFS_MAX_FILENAME + 1];
+    if(resolve_path(path, &parent, leaf) != -1 || leaf[0] == '\0') { errno = EEXIST; return -1; }
+    if(parent == -1) { return -1; }
+    
+    int dir_inode = create_dir_inode();
+    if(dir_inode == -1) { errno = ENOSPC; return -1; }
+    
+    if(dir_insert(parent, leaf, dir_inode) == -1) {
+        free_inode(dir_inode);
+        return -1;
+    }
+    return 0;
+}
+
+int sfs_mkdir(char* path) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_MKDIR, 0, 0, 0);
+    SFS_TRACE_RETURN(sfs_mkdir_locked(path), path, 0);
+}
+
+/**
+ * Removes an empty directory
+ * @param path The path of the directory to remove
+ * @return 0 if removed, -1 if not found, not a directory, not empty or root
+ *         (errno, see unlink_entry and resolve_path)
+ */
+int sfs_rmdir_locked(char* path) {
+    int parent;
+    char leaf[SFS_MAX_FILENAME + 1];
+    int dir_inode = resolve_path(path, &parent, leaf);
+    if(dir_inode == -1) { return -1; }
+    if(!S_ISDIR((itbl->inodes[dir_inode]).mode)) { errno = ENOTDIR; return -1; }
+    
+    return unlink_entry(parent, leaf, dir_inode);
+}
+
+int sfs_rmdir(char* path) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_RMDIR, 0, 0, 0);
+    SFS_TRACE_RETURN(sfs_rmdir_locked(path), path, 0);
+}
+
+/**
+ * Opens a file and a file descriptor entry.
+ * The file is created if it doesnot exists (its directory must exist).
+ * Will fail if the file is already opened (if a file descriptor entry exists)
+ *
+ * Basic Algorithm:
+ * - if file does NOT exist:
+ *    - create file
+ * - if file is already opened:
+ *    - return -1 (or share its descriptor)
+ * - find next avail. fd entry
+ * - set it in use and initialize rw_ptr at the end of the file
+ * - return fd entry
+ * @param name Path of the file to open/create
+ * @param shared If the file is already opened, share its descriptor instead
+ *               of failing (the descriptor is closed by its last sfs_fclose)
+ * @return A file descriptor entry index, -1 with errno set (ENOENT/ENOTDIR
+ *         from the path, ENOSPC, EISDIR, EBUSY if opened and not shared,
+ *         EMFILE if no descriptor is left)
+ */
+int open_file(char* name, int shared) {
+    int parent;
+    char leaf[SFS_MAX_FILENAME + 1];
+    int inode_index = resolve_path(name, &parent, leaf);
+    if(inode_index == -1) {
+        if(parent == -1 || leaf[0] == '\0') { return -1; }
+        inode_index = create_file(parent, leaf);
+    }
+    
+    if(inode_index == -1) { return -1; }
+    if(S_ISDIR((itbl->inodes[inode_index]).mode)) { errno = EISDIR; return -1; }
+    
+    // check if the file is already opened
+    for(int i = 0; i < fdtbl->size; i++) {
+        if((fdtbl->entries[i]).in_use == 1 && (fdtbl->entries[i]).inode_index == inode_index) {
+            if(!shared) { errno = EBUSY; return -1; }
+            (fdtbl->entries[i]).refs++;
+            return i;
+        }
+    }
+    
+    // create file descriptor entry
+    int fd_index;
+    if(find_next_avail_fd_entry(&fd_index) != 1) {
+        errno = EMFILE;
+        return -1;
+    }
+    
+    (fdtbl->entries[fd_index]).in_use = 1;
+    (fdtbl->entries[fd_index]).refs = 1;
+    (fdtbl->entries[fd_index]).inode_index = inode_index;
+    (fdtbl->entries[fd_index]).rw_ptr = (itbl->inodes[inode_index]).size;
+    itbl->refs[inode_index]++;
+    
+    return fd_index;
+}
+
+/**
+ * Opens a file, fails if the file is already opened (see open_file)
+ */
+int sfs_fopen(char* name) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_FOPEN, 0, 0, 0);
+    SFS_TRACE_RETURN(open_file(name, 0), name, 0);
+}
+
+/**
+ * Opens a file, sharing the descriptor if the file is already opened (see
+ * open_file). Used by front ends that keep files opened across requests.
+ */
+int sfs_fopen_shared(char* name) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_FOPEN_SHARED, 0, 0, 0);
+    SFS_TRACE_RETURN(open_file(name, 1), name, 0);
+}
+
+/**
+ * Given a file descriptor, closes the opened file.
+ *
+ * Basic Algorithm:
+ * - if fd does NOT exists:
+ *   return -1
+ * - if the descriptor is shared, drop one reference and return
+ * - pack the tail of the file in a fragment block
+ * - close it, the file is freed if it was removed meanwhile (see release_inode)
+ * @param fdId the file descriptor index to close
+ * @return 0 if closed, -1 if unable to close
+ */
+int sfs_fclose_locked(int fdId) {
+    if(fdId < 0 || fdId >= fdtbl->size) { errno = EBADF; return -1; }
+    if((fdtbl->entries[fdId]).in_use == 0) { errno = EBADF; return -1; }
+    
+    if(--(fdtbl->entries[fdId]).refs > 0) { return 0; }
+    
+    // the file is done growing (for now): pack its last partial block
+    if(pack_tail(&itbl->inodes[(fdtbl->entries[fdId]).inode_index])) {
+        journal_touch();
+    }
+    
+    (fdtbl->entries[fdId]).in_use = 0;
+    put_inode((fdtbl->entries[fdId]).inode_index, 1);
+    return 0;
+}
+
+int sfs_fclose(int fdId) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_FCLOSE, fdId, 0, 0);
+    SFS_TRACE_RETURN(sfs_fclose_locked(fdId), 0, 0);
+}
+
+/**
+ * Write data to an opened file through a file descriptor index, at its rw_ptr
+ *
+ * Basic algorithm:
+ * - If fd does not exists : return -1
+ * - If fd is not opened : return -1
+ * - write the data at rw_ptr (see inode_write)
+ * - increase the rw_ptr
+ * @param fdId File descriptor to write to
+ * @param buf The data buffer
+ * @param len Length of data to write on disk
+ * @return number of bytes written to disk, -1 if nothing could be written
+ */
+int sfs_fwrite_locked(int fdId, char* buf, int len) {
+    if(fdId < 0 || fdId >= fdtbl->size) { errno = EBADF; return -1; }
+    if((fdtbl->entries[fdId]).in_use == 0) { errno = EBADF; return -1; }
+    
+    file_descriptor_entry* entry = &(fdtbl->entries[fdId]);
+    int written = inode_write(entry->inode_index, entry->rw_ptr, buf, len);
+    if(written > 0) {
+        entry->rw_ptr += written;
+    }
+    return written;
+}
+
+int sfs_fwrite(int fdId, char* buf, int len) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_FWRITE, fdId, len, 0);
+    SFS_TRACE_RETURN(sfs_fwrite_locked(fdId, buf, len), 0, 0);
+}
+
+/**
+ * Given an opened file descriptor, update the rw_ptr to a given position
+ * 
+ * Seeking past the end of the file is allowed and does not touch the disk:
+ * a write there leaves a hole between the old end of file and the data,
+ * holes are not allocated and read back as zeros.
+ * @param fdId The opened file descriptor index
+ * @param loc The location to locate the rw_ptr
+ * @return -1 fd does not exist/not in use or negative location, 0 if ok
+ */
+int sfs_fseek_locked(int fdId, int64_t loc) {
+    if(fdId < 0 || fdId >= fdtbl->size) { errno = EBADF; return -1; }
+    if((fdtbl->entries[fdId]).in_use == 0) { errno = EBADF; return -1; }
+    if(loc < 0) { errno = EINVAL; return -1; }
+    
+    file_descriptor_entry* entry = &(fdtbl->entries[fdId]);
+    
+    entry->rw_ptr = loc;
+    return 0;
+}
+
+int sfs_fseek(int fdId, int64_t loc) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_FSEEK, fdId, 0, loc);
+    SFS_TRACE_RETURN(sfs_fseek_locked(fdId, loc), 0, 0);
+}
+
+/**
+ * Reads an opened file descriptor at its rw_ptr and copy the data in the
+ * buffer passed in as parameter
+ *
+ * Basic Algorithm :
+ * - read the data at rw_ptr (see inode_read)
+ * - increase the rw_ptr
+ *
+ * @param fdId The opened file descriptor to the file
+ * @param buf The buffer to return the data
+ * @param len The length of data to read from the file
+ * @return -1 if error, the length of data readed
+ */
+int sfs_fread_locked(int fdId, char* buf, int len) {
+    if(fdId < 0 || fdId >= fdtbl->size) { errno = EBADF; return -1; }
+    if((fdtbl->entries[fdId]).in_use == 0) { errno = EBADF; return -1; }
+    
+    file_descriptor_entry* entry = &(fdtbl->entries[fdId]);
+    int read = inode_read(entry->inode_index, entry->rw_ptr, buf, len);
+    entry->rw_ptr += read;
+    return read;
+}
+
+int sfs_fread(int fdId, char* buf, int len) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_FREAD, fdId, len, 0);
+    SFS_TRACE_RETURN(sfs_fread_locked(fdId, buf, len), 0, 0);
+}
+
+/**
+ * Changes the size of an opened file in place: shrinking releases the blocks
+ * past the new end of file, growing leaves a hole (see inode_truncate).
+ * The rw_ptr is not moved.
+ * @param fdId The opened file descriptor to the file
+ * @param size The new size of the file
+ * @return 0 if resized, -1 if fd does not exist/not in use or no space left
+ */
+int sfs_ftruncate_locked(int fdId, int64_t size) {
+    if(fdId < 0 || fdId >= fdtbl->size) { errno = EBADF; return -1; }
+    if((fdtbl->entries[fdId]).in_use == 0) { errno = EBADF; return -1; }
+    if(size < 0) { errno = EINVAL; return -1; }
+    
+    return inode_truncate((fdtbl->entries[fdId]).inode_index, size);
+}
+
+int sfs_ftruncate(int fdId, int64_t size) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_FTRUNCATE, fdId, 0, size);
+    SFS_TRACE_RETURN(sfs_ftruncate_locked(fdId, size), 0, 0);
+}
+
+/**
+ * Reads an opened file at a given position, without moving its rw_ptr
+ * @param fdId The opened file descriptor to the file
+ * @param buf The buffer to return the data
+ * @param len The length of data to read from the file
+ * @param loc The position to read at
+ * @return -1 if error, the length of data readed
+ */
+int sfs_pread_locked(int fdId, char* buf, int len, int64_t loc) {
+    if(fdId < 0 || fdId >= fdtbl->size) { errno = EBADF; return -1; }
+    if((fdtbl->entries[fdId]).in_use == 0) { errno = EBADF; return -1; }
+    if(loc < 0) { errno = EINVAL; return -1; }
+    
+    return inode_read((fdtbl->entries[fdId]).inode_index, loc, buf, len);
+}
+
+int sfs_pread(int fdId, char* buf, int len, int64_t loc) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_PREAD, fdId, len, loc);
+    SFS_TRACE_RETURN(sfs_pread_locked(fdId, buf, len, loc), 0, 0);
+}
+
+/**
+ * Writes to an opened file at a given position, without moving its rw_ptr
+ * @param fdId File descriptor to write to
+ * @param buf The data buffer
+ * @param len Length of data to write on disk
+ * @param loc The position to write at
+ * @return number of bytes written to disk, -1 if nothing could be written
+ */
+int sfs_pwrite_locked(int fdId, char* buf, int len, int64_t loc) {
+    if(fdId < 0 || fdId >= fdtbl->size) { errno = EBADF; return -1; }
+    if((fdtbl->entries[fdId]).in_use == 0) { errno = EBADF; return -1; }
+    if(loc < 0) { errno = EINVAL; return -1; }
+    
+    return inode_write((fdtbl->entries[fdId]).inode_index, loc, buf, len);
+}
+
+int sfs_pwrite(int fdId, char* buf, int len, int64_t loc) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_PWRITE, fdId, len, loc);
+    SFS_TRACE_RETURN(sfs_pwrite_locked(fdId, buf, len, loc), 0, 0);
+}
+
+/**
+ * Reads an opened file at a given position into several buffers (filled in
+ * order) with a single pass over the block map, without moving its rw_ptr
+ * @param fdId The opened file descriptor to the file
+ * @param iov The buffers
+ * @param iovcnt The number of buffers
+ * @param loc The position to read at
+ * @return -1 if error, the length of data readed
+ */
+int sfs_readv_locked(int fdId, const struct iovec* iov, int iovcnt, int64_t loc) {
+    if(fdId < 0 || fdId >= fdtbl->size) { errno = EBADF; return -1; }
+    if((fdtbl->entries[fdId]).in_use == 0) { errno = EBADF; return -1; }
+    if(loc < 0 || iovcnt < 0) { errno = EINVAL; return -1; }
+    
+    return inode_readv((fdtbl->entries[fdId]).inode_index, loc, iov, iovcnt);
+}
+
+int sfs_readv(int fdId, const struct iovec* iov, int iovcnt, int64_t loc) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_READV, fdId, iov_length(iov, iovcnt), loc);
+    SFS_TRACE_RETURN(sfs_readv_locked(fdId, iov, iovcnt, loc), 0, 0);
+}
+
+/**
+ * Writes several buffers (in order) to an opened file at a given position,
+ * without moving its rw_ptr.
+ * 
+ * The buffers are gathered so that the whole write goes through a single
+ * pass over the block map (and a single run allocation).
+ * @param fdId File descriptor to write to
+ * @param iov The buffers
+ * @param iovcnt The number of buffers
+ * @param loc The position to write at
+ * @return number of bytes written to disk, -1 if nothing could be written
+ */
+int sfs_writev_locked(int fdId, const struct iovec* iov, int iovcnt, int64_t loc) {
+    if(fdId < 0 || fdId >= fdtbl->size) { errno = EBADF; return -1; }
+    if((fdtbl->entries[fdId]).in_use == 0) { errno = EBADF; return -1; }
+    if(loc < 0 || iovcnt < 0) { errno = EINVAL; return -1; }
+    
+    if(iovcnt == 1) {
+        return inode_write((fdtbl->entries[fdId]).inode_index, loc, iov[0].iov_base, iov[0].iov_len);
+    }
+    
+    int len = iov_length(iov, iovcnt);
+    
+    char* gather_buff = malloc(len);
+    int gathered = 0;
+    for(int i = 0; i < iovcnt; i++) {
+        memcpy(gather_buff + gathered, iov[i].iov_base, iov[i].iov_len);
+        gathered += iov[i].iov_len;
+    }
+    
+    int written = inode_write((fdtbl->entries[fdId]).inode_index, loc, gather_buff, len);
+    free(gather_buff);
+    return written;
+}
+
+int sfs_writev(int fdId, const struct iovec* iov, int iovcnt, int64_t loc) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_WRITEV, fdId, iov_length(iov, iovcnt), loc);
+    SFS_TRACE_RETURN(sfs_writev_locked(fdId, iov, iovcnt, loc), 0, 0);
+}
+
+/**
+ * Removes a file from its directory
+ *
+ * - check if the file eixsts
+ * - return -1 if file does not exist or is a directory
+ * - remove its directory entry and release its inode
+ * @param name the path of the file to be removed
+ * @return 1 if file successfully removed, -1 if file not found (errno, see
+ *         resolve_path) or a directory (EISDIR)
+ */
+int sfs_remove_locked(char* name) {
+    int parent;
+    char leaf[SFS_MAX_FILENAME + 1];
+    int inode_index = resolve_path(name, &parent, leaf);
+    if(inode_index == -1) {
+        int lookup_errno = errno;
+        printf("File not found.");
+        errno = lookup_errno;
+        return -1;
+    }
+    if(S_ISDIR((itbl->inodes[inode_index]).mode)) { errno = EISDIR; return -1; }
+    
+    unlink_entry(parent, leaf, inode_index);
+    return 1;
+}
+
+int sfs_remove(char* name) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_REMOVE, 0, 0, 0);
+    SFS_TRACE_RETURN(sfs_remove_locked(name), name, 0);
+}
+
+/**
+ * Renames or moves a file or a directory (see rename_entry). An existing
+ * target is replaced atomically, so a file can be updated by writing a
+ * temporary file and renaming it over the target.
+ * @param from The path to rename
+ * @param to The new path
+ * @return 0 if renamed, -1 if not found or the target cannot be replaced
+ *         (errno EBUSY for the root, see rename_entry and resolve_path)
+ */
+int sfs_rename_locked(const char* from, const char* to) {
+    int parent, new_parent;
+    char leaf[SFS_MAX_FILENAME + 1], new_leaf[SFS_MAX_FILENAME + 1];
+    if(resolve_path(from, &parent, leaf) == -1) { return -1; }
+    if(leaf[0] == '\0') { errno = EBUSY; return -1; }
+    
+    resolve_path(to, &new_parent, new_leaf);
+    if(new_parent == -1) { return -1; }
+    if(new_leaf[0] == '\0') { errno = EBUSY; return -1; }
+    
+    return rename_entry(parent, leaf, new_parent, new_leaf);
+}
+
+int sfs_rename(const char* from, const char* to) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_RENAME, 0, 0, 0);
+    SFS_TRACE_RETURN(sfs_rename_locked(from, to), from, to);
+}
+
+/*
+ * Inode level API: the same operations, addressed by inode number rather
+ * than by path (used by the low-level FUSE front end).
+ */
+
+/**
+ * Gets the inode of the root directory
+ * @return the root inode
+ */
+int sfs_root_inode() {
+    SFS_API_LOCK();
+    return sblock->root_inode_no;
+}
+
+/**
+ * Finds an entry of a directory (through the dentry cache)
+ * @param dir_inode The inode of the directory
+ * @param name The name of the entry
+ * @return the inode of the entry, -1 if not found or not a directory
+ */
+int sfs_ilookup_locked(int dir_inode, const char* name) {
+    if(!valid_inode(dir_inode) || !S_ISDIR((itbl->inodes[dir_inode]).mode)) { return -1; }
+    if(strlen(name) > SFS_MAX_FILENAME) { return -1; }
+    
+    return dir_lookup(dir_inode, name);
+}
+
+int sfs_ilookup(int dir_inode, const char* name) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_ILOOKUP, dir_inode, 0, 0);
+    SFS_TRACE_RETURN(sfs_ilookup_locked(dir_inode, name), name, 0);
+}
+
+/**
+ * Gets the attributes of an inode
+ * @param inode_index The inode
+ * @param st Return variable (type, permissions, size and block usage)
+ * @return 0 if found, -1 if not an allocated inode
+ */
+int sfs_igetattr_locked(int inode_index, struct stat* st) {
+    if(!valid_inode(inode_index)) { errno = ENOENT; return -1; }
+    
+    fill_stat(inode_index, st);
+    return 0;
+}
+
+int sfs_igetattr(int inode_index, struct stat* st) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_IGETATTR, inode_index, 0, 0);
+    SFS_TRACE_RETURN(sfs_igetattr_locked(inode_index, st), 0, 0);
+}
+
+/**
+ * Creates a file or a directory in a directory
+ * @param dir_inode The inode of the directory
+ * @param name The name of the new entry
+ * @param mode S_IFDIR to create a directory, a regular file otherwise
+ * @return the inode of the new entry, -1 if it exists or no inode/space left
+ *         (errno EEXIST, ENOSPC, EINVAL or ENAMETOOLONG for the name)
+ */
+int sfs_icreate_locked(int dir_inode, const char* name, mode_t mode) {
+    if(!valid_dir_inode(dir_inode)) { return -1; }
+    if(name[0] == '\0') { errno = EINVAL; return -1; }
+    if(strlen(name) > SFS_MAX_FILENAME) { errno = ENAMETOOLONG; return -1; }
+    if(dir_lookup(dir_inode, name) != -1) { errno = EEXIST; return -1; }
+    
+    int inode_index = S_ISDIR(mode) ? create_dir_inode() : create_inode(S_IRWXU | S_IRWXG | S_IRWXO);
+    if(inode_index == -1) { errno = ENOSPC; return -1; }
+    
+    if(dir_insert(dir_inode, name, inode_index) == -1) {
+        free_inode(inode_index);
+        return -1;
+    }
+    return inode_index;
+}
+
+int sfs_icreate(int dir_inode, const char* name, mode_t mode) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_ICREATE, dir_inode, mode, 0);
+    SFS_TRACE_RETURN(sfs_icreate_locked(dir_inode, name, mode), name, 0);
+}
+
+/**
+ * Removes a file or an empty directory from a directory
+ * @param dir_inode The inode of the directory
+ * @param name The name of the entry
+ * @return 0 if removed, -1 if not found or a non empty directory (errno
+ *         ENOENT, ENAMETOOLONG, see unlink_entry)
+ */
+int sfs_iunlink_locked(int dir_inode, const char* name) {
+    if(!valid_dir_inode(dir_inode)) { return -1; }
+    if(strlen(name) > SFS_MAX_FILENAME) { errno = ENAMETOOLONG; return -1; }
+    
+    int inode_index = dir_lookup(dir_inode, name);
+    if(inode_index == -1) { errno = ENOENT; return -1; }
+    
+    return unlink_entry(dir_inode, name, inode_index);
+}
+
+int sfs_iunlink(int dir_inode, const char* name) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_IUNLINK, dir_inode, 0, 0);
+    SFS_TRACE_RETURN(sfs_iunlink_locked(dir_inode, name), name, 0);
+}
+
+/**
+ * Renames or moves an entry of a directory (see rename_entry)
+ * @param dir_inode The directory holding the entry
+ * @param name The name of the entry
+ * @param new_dir_inode The directory to move the entry to
+ * @param new_name The new name of the entry
+ * @return 0 if renamed, -1 if not found or the target cannot be replaced
+ *         (errno ENAMETOOLONG, EINVAL for an empty name, see rename_entry)
+ */
+int sfs_irename_locked(int dir_inode, const char* name, int new_dir_inode, const char* new_name) {
+    if(!valid_dir_inode(dir_inode) || !valid_dir_inode(new_dir_inode)) { return -1; }
+    if(new_name[0] == '\0') { errno = EINVAL; return -1; }
+    if(strlen(name) > SFS_MAX_FILENAME || strlen(new_name) > SFS_MAX_FILENAME) { errno = ENAMETOOLONG; return -1; }
+    
+    return rename_entry(dir_inode, name, new_dir_inode, new_name);
+}
+
+int sfs_irename(int dir_inode, const char* name, int new_dir_inode, const char* new_name) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_IRENAME, dir_inode, new_dir_inode, 0);
+    SFS_TRACE_RETURN(sfs_irename_locked(dir_inode, name, new_dir_inode, new_name), name, new_name);
+}
+
+/**
+ * Reads a file at a given position
+ * @return -1 if not a file, the length of data readed
+ */
+int sfs_iread_locked(int inode_index, char* buf, int len, int64_t loc) {
+    if(!valid_file_inode(inode_index)) { return -1; }
+    if(loc < 0) { errno = EINVAL; return -1; }
+    
+    return inode_read(inode_index, loc, buf, len);
+}
+
+int sfs_iread(int inode_index, char* buf, int len, int64_t loc) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_IREAD, inode_index, len, loc);
+    SFS_TRACE_RETURN(sfs_iread_locked(inode_index, buf, len, loc), 0, 0);
+}
+
+/**
+ * Writes to a file at a given position
+ * @return number of bytes written to disk, -1 if nothing could be written
+ */
+int sfs_iwrite_locked(int inode_index, char* buf, int len, int64_t loc) {
+    if(!valid_file_inode(inode_index)) { return -1; }
+    if(loc < 0) { errno = EINVAL; return -1; }
+    
+    return inode_write(inode_index, loc, buf, len);
+}
+
+int sfs_iwrite(int inode_index, char* buf, int len, int64_t loc) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_IWRITE, inode_index, len, loc);
+    SFS_TRACE_RETURN(sfs_iwrite_locked(inode_index, buf, len, loc), 0, 0);
+}
+
+/**
+ * Changes the size of a file in place (see inode_truncate)
+ * @return 0 if resized, -1 if not a file or no space left
+ */
+int sfs_itruncate_locked(int inode_index, int64_t size) {
+    if(!valid_file_inode(inode_index)) { return -1; }
+    if(size < 0) { errno = EINVAL; return -1; }
+    
+    return inode_truncate(inode_index, size);
+}
+
+int sfs_itruncate(int inode_index, int64_t size) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_ITRUNCATE, inode_index, 0, size);
+    SFS_TRACE_RETURN(sfs_itruncate_locked(inode_index, size), 0, 0);
+}
+
+/**
+ * Done writing a file for now (the equivalent of sfs_fclose): packs its tail
+ * @param inode_index The inode of the file
+ */
+void sfs_iclose_locked(int inode_index) {
+    if(!valid_inode(inode_index)) { return; }
+    
+    if(pack_tail(&itbl->inodes[inode_index])) {
+        journal_touch();
+    }
+}
+
+void sfs_iclose(int inode_index) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_ICLOSE, inode_index, 0, 0);
+    sfs_iclose_locked(inode_index);
+    trace_end(sfs_traced, 0, 0, 0);
 }
 
 /**
- * Opens a file from the root directory and a file descriptor entry.
- * The file is created if it doesnot exists.
- * Will fail if the file is already opened (if a file descriptor entry exists)
- * 
- * Basic Algorithm:
- * - if file does NOT exist:
- *    - create file
- * - if file is already opened:
- *    - return -1
- * - find next avail. fd entry
- * - set it in use and initialize rw_ptr at the end of the file
- * - return fd entry
- * @param name Name of the file to open/create from root directory
- * @return A file descriptor entry index
+ * Takes a reference to an inode, for a front end that keeps inode numbers
+ * (the lookup count of FUSE): a file or directory removed meanwhile stays
+ * allocated, so its number is not reused, until the last reference is
+ * dropped (see sfs_iforget)
+ * @return 0, -1 if not an inode in use
  */
-int sfs_fopen(char* name) {
-    if(strlen(name) > SFS_MAX_FILENAME) { return -1; }
+int sfs_ihold_locked(int inode_index) {
+    if(!valid_inode(inode_index)) { return -1; }
     
-    directory_entry* file = get_file(name);
-    if(!file) {
-        file = create_file(name);
-    }
+    itbl->refs[inode_index]++;
+    return 0;
+}
+
+int sfs_ihold(int inode_index) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_IHOLD, inode_index, 0, 0);
+    SFS_TRACE_RETURN(sfs_ihold_locked(inode_index), 0, 0);
+}
+
+/**
+ * Drops references taken by sfs_ihold, frees the inode if it was removed
+ * and they were the last ones
+ * @param count The number of references dropped
+ * @return 0, -1 if not an inode in use
+ */
+int sfs_iforget_locked(int inode_index, int64_t count) {
+    if(!valid_inode(inode_index)) { return -1; }
     
-    if(!file) { return -1; }
-   
-    // check if the file is already opened
-    for(int i = 0; i < fdtbl->size; i++) {
-        if((fdtbl->entries[i]).in_use == 1 && (fdtbl->entries[i]).inode_index == file->inode_index) {
-            return -1;
-        }
-    }
+    put_inode(inode_index, count);
+    return 0;
+}
+
+int sfs_iforget(int inode_index, int64_t count) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_IFORGET, inode_index, 0, count);
+    SFS_TRACE_RETURN(sfs_iforget_locked(inode_index, count), 0, 0);
+}
+
+/**
+ * Gets the entry at a given position of a directory
+ * @param dir_inode The inode of the directory
+ * @param position The position of the entry (0 for the first one)
+ * @param fname Return variable: the name of the entry
+ * @param inode_index Return variable: the inode of the entry
+ * @return 1 if an entry exists at this position, 0 if no more entry, -1 if
+ *         not a directory
+ */
+int sfs_igetdirentry_locked(int dir_inode, int position, char* fname, int* inode_index) {
+    if(!valid_inode(dir_inode) || !S_ISDIR((itbl->inodes[dir_inode]).mode)) { return -1; }
     
-    // create file descriptor entry
-    int fd_index;
-    if(!find_next_avail_fd_entry(&fd_index)) {
-        // TODO : handle error -- no more file descriptor
+    directory* dir = read_dir(dir_inode);
+    int slot = dir_entry_slot(dir, position);
+    if(slot != -1) {
+        strcpy(fname, (dir->entries[slot]).filename);
+        *inode_index = (dir->entries[slot]).inode_index;
     }
-    
-    (fdtbl->entries[fd_index]).in_use = 1;
-    (fdtbl->entries[fd_index]).inode_index = file->inode_index;
-    (fdtbl->entries[fd_index]).rw_ptr = (itbl->inodes[file->inode_index]).size;
-    
-    return fd_index;
+    free_dir(dir);
+    return slot != -1;
+}
+
+int sfs_igetdirentry(int dir_inode, int position, char* fname, int* inode_index) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_IGETDIRENTRY, dir_inode, position, 0);
+    SFS_TRACE_RETURN(sfs_igetdirentry_locked(dir_inode, position, fname, inode_index), 0, 0);
 }
 
 /**
- * Given a file descriptor, closes the opened file.
- * 
- * Basic Algorithm:
- * - if fd does NOT exists:
- *   return -1
- * - close it
- * @param fdId the file descriptor index to close
- * @return 0 if closed, -1 if unable to close
+ * Starts an iteration over a directory (see sfs_readdir_batch)
+ * @param dir_inode The inode of the directory
+ * @param cursor Return variable: a cursor on the first entry
+ * @return 0 if started, -1 if not a directory
  */
-int sfs_fclose(int fdId) {
-    if(fdId >= fdtbl->size) { return -1; }
-    if((fdtbl->entries[fdId]).in_use == 0) { return -1; }
+int sfs_iopendir_locked(int dir_inode, sfs_dir_cursor* cursor) {
+    if(!valid_inode(dir_inode) || !S_ISDIR((itbl->inodes[dir_inode]).mode)) { return -1; }
     
-    (fdtbl->entries[fdId]).in_use = 0;
+    cursor->dir_inode = dir_inode;
+    cursor->position = 0;
     return 0;
 }
 
+int sfs_iopendir(int dir_inode, sfs_dir_cursor* cursor) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_IOPENDIR, dir_inode, 0, 0);
+    SFS_TRACE_RETURN(sfs_iopendir_locked(dir_inode, cursor), 0, 0);
+}
+
 /**
- * Write data to an opened file through a file descriptor index
+ * Maps a range of a file to where its data lives in the disk image, so the
+ * data can be moved without going through a buffer (splice).
  * 
  * Basic algorithm:
- * - If fd does not exists : return -1
- * - If fd is not opened : return -1
- * 
- * - If file is not empty: 
- *   - get data block according to rw_ptr (either direct data block or indirect)
- *   - position start writing from rw_ptr % block size at this block
- *   - write (block_size - rw_ptr % block size) len in order to fill up the first block
- *   - update the write len -= (block-size - rw_ptr % block_size)
- * 
- *  - if new block needed for subsequent block, allocate them and update the 
- *    inode (direct ptrs or indirect pointers)
- *  - copy data from buffer to disk datablock
- *  - update the inode table
- *  - return the total length written to disk (in bytes) 
- * @param fdId File descriptor to write to
- * @param buf The data buffer
- * @param len Length of data to write on disk
- * @return number of bytes written to disk
+ *  - clamp the range to the end of the file
+ *  - for each logical block, find its disk location (the fragment slot for
+ *    a packed tail, -1 for a hole)
+ *  - merge the pieces that follow each other on disk
+ * @param inode_index The inode of the file
+ * @param loc The position of the range
+ * @param len The length of the range
+ * @param extents Return variable: the pieces of the range, in order
+ * @param max_extents The size of extents
+ * @return the number of extents (0 at end of file), -1 if the file is
+ *         inline or the range needs more than max_extents pieces (read it
+ *         with sfs_iread instead)
  */
-int sfs_fwrite(int fdId, char* buf, int len) {
-    if(fdId >= fdtbl->size) { return -1; }
-    if((fdtbl->entries[fdId]).in_use == 0) { return -1; }
+int sfs_imap_locked(int inode_index, int64_t loc, int len, sfs_extent* extents, int max_extents) {
+    if(!valid_inode(inode_index) || S_ISDIR((itbl->inodes[inode_index]).mode) || loc < 0) { return -1; }
     
-    file_descriptor_entry* entry = &(fdtbl->entries[fdId]);
-    indirection_block* indirection_block = 0;
-    int total_written = 0;
+    inode* file_inode = &itbl->inodes[inode_index];
+    if(file_inode->flags & SFS_INODE_INLINE) { return -1; }
+    if(loc >= file_inode->size) { return 0; }
+    if(file_inode->size - loc < len) { len = file_inode->size - loc; }
     
-    if((itbl->inodes[entry->inode_index]).allocated_ptr > 0) {
-        int start_inode_ptr_idx = (int)floor((float)((fdtbl->entries[fdId]).rw_ptr) / (float)SFS_API_BLOCK_SIZE);
-        int last_index = (fdtbl->entries[fdId]).rw_ptr % SFS_API_BLOCK_SIZE;
-        if(start_inode_ptr_idx >= SFS_NUM_DIRECT_PTR) { // ie. has an indirection datablock
-            // load indirection block
-            indirection_block = malloc(SFS_API_BLOCK_SIZE);
-            indirection_block->count = 0;
-            indirection_block->ptrs = (int*)calloc(indirection_datablock_count, sizeof(int));
-            
-            char* indirection_block_buff = malloc(SFS_API_BLOCK_SIZE);
-            read_blocks((itbl->inodes[entry->inode_index]).ind_block_ptr, 1, indirection_block_buff);
-            
-            memcpy(indirection_block, indirection_block_buff, sizeof(int));
-            memcpy(indirection_block->ptrs, indirection_block_buff + sizeof(int), indirection_datablock_count * sizeof(int));
-            
-            free(indirection_block_buff);
+    int count = 0;
+    while(len > 0) {
+        int64_t lblock = loc / block_size;
+        int start_index = loc % block_size;
+        int piece_len = start_index + len > block_size ? block_size - start_index : len;
+        
+        int64_t disk_offset = -1;
+        if((file_inode->flags & SFS_INODE_TAIL) && lblock == file_inode->size / block_size) {
+            wb_write_back_block(file_inode->tail_block);
+            disk_offset = file_inode->tail_block * block_size + file_inode->tail_slot * frag_slot_size + start_index;
+        } else {
+            int64_t pblock = get_data_block(file_inode, lblock);
+            if(pblock != 0) {
+                wb_write_back_block(pblock);
+                disk_offset = pblock * block_size + start_index;
+            }
         }
         
-        if(last_index > 0) {
-            int start_block = 0;
+        sfs_extent* last = count > 0 ? &extents[count - 1] : 0;
+        if(last != 0 && ((disk_offset == -1 && last->disk_offset == -1)
+                || (disk_offset != -1 && last->disk_offset != -1 && last->disk_offset + last->len == disk_offset))) {
+            last->len += piece_len;
+        } else {
+            if(count == max_extents) { return -1; }
+            extents[count].disk_offset = disk_offset;
+            extents[count].len = piece_len;
+            count++;
+        }
         
-            if(start_inode_ptr_idx >= SFS_NUM_DIRECT_PTR) {
-                start_block = indirection_block->ptrs[start_inode_ptr_idx - SFS_NUM_DIRECT_PTR];
-            } else {
-                start_block = (itbl->inodes[entry->inode_index]).ptrs[start_inode_ptr_idx/* - 1*/];
-            }
-            
-            int fill_len = last_index + len > SFS_API_BLOCK_SIZE ? (SFS_API_BLOCK_SIZE - last_index) : len;
-
-            // fill in last block
-            char* block_buff = malloc(SFS_API_BLOCK_SIZE);
-            read_blocks(start_block, 1, block_buff);
-            memcpy(block_buff + last_index, buf, fill_len);
-            // write last block
-            write_blocks(start_block, 1, block_buff);
-            free(block_buff);
+        loc += piece_len;
+        len -= piece_len;
+    }
+    
+    return count;
+}
 
-            buf += fill_len;
-            len -= fill_len;
-            entry->rw_ptr += fill_len;
-            total_written += fill_len;
-        }
+int sfs_imap(int inode_index, int64_t loc, int len, sfs_extent* extents, int max_extents) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_IMAP, inode_index, len, loc);
+    SFS_TRACE_RETURN(sfs_imap_locked(inode_index, loc, len, extents, max_extents), 0, 0);
+}
+
+/**
+ * Makes a file durable: its data and the metadata changes so far survive a
+ * crash once it returns. The metadata changes are committed together (the
+ * changes of the other files with them), then the device is synced once,
+ * so the syncs of concurrent writers share the commits of the journal.
+ * Without it, a write is durable after the next commit and the system
+ * writes it back (within SFS_JOURNAL_COMMIT_MS of the end of the call for
+ * the metadata), with no guarantee on the device.
+ * @return 0 if durable, -1 if the file is not opened or the device failed
+ */
+int sfs_fsync_locked(int fdId) {
+    if(fdId < 0 || fdId >= fdtbl->size) { errno = EBADF; return -1; }
+    if((fdtbl->entries[fdId]).in_use == 0) { errno = EBADF; return -1; }
+    
+    return journal_sync((fdtbl->entries[fdId]).inode_index, 0);
+}
+
+int sfs_fsync(int fdId) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_FSYNC, fdId, 0, 0);
+    SFS_TRACE_RETURN(sfs_fsync_locked(fdId), 0, 0);
+}
+
+/**
+ * Makes the data of a file durable (see sfs_fsync): commits only if its size
+ * or block map changed since the last commit, as an overwrite in place only
+ * needs the device sync
+ * @return 0 if durable, -1 if the file is not opened or the device failed
+ */
+int sfs_fdatasync_locked(int fdId) {
+    if(fdId < 0 || fdId >= fdtbl->size) { errno = EBADF; return -1; }
+    if((fdtbl->entries[fdId]).in_use == 0) { errno = EBADF; return -1; }
+    
+    return journal_sync((fdtbl->entries[fdId]).inode_index, 1);
+}
+
+int sfs_fdatasync(int fdId) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_FDATASYNC, fdId, 0, 0);
+    SFS_TRACE_RETURN(sfs_fdatasync_locked(fdId), 0, 0);
+}
+
+/**
+ * Makes the whole file system durable: commits the metadata changes and
+ * syncs the device (the journal is not written back, see journal_commit)
+ * @return 0 if durable, -1 if no file system is mounted or the device failed
+ */
+int sfs_sync_locked() {
+    if(sblock == 0) { return -1; }
+    
+    return journal_sync(-1, 0);
+}
+
+int sfs_sync() {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_SYNC, 0, 0, 0);
+    SFS_TRACE_RETURN(sfs_sync_locked(), 0, 0);
+}
+
+/**
+ * Makes a file durable (see sfs_fsync and sfs_fdatasync)
+ * @param datasync Only its data and what is needed to read it back
+ * @return 0 if durable, -1 if not an inode in use or the device failed
+ */
+int sfs_isync_locked(int inode_index, int datasync) {
+    if(!valid_inode(inode_index)) { return -1; }
+    
+    return journal_sync(inode_index, datasync);
+}
+
+int sfs_isync(int inode_index, int datasync) {
+    SFS_API_LOCK();
+    SFS_TRACE(SFS_TRACE_ISYNC, inode_index, datasync, 0);
+    SFS_TRACE_RETURN(sfs_isync_locked(inode_index, datasync), 0, 0);
+}
+
+/*
+ * Asynchronous calls
+ *
+ * sfs_submit_* queue a request (FIFO), a pool of SFS_AIO_WORKERS threads,
+ * started by the first submission, runs it as the synchronous call then runs
+ * its callback, or queues it for sfs_reap. So one thread keeps many calls in
+ * flight without waiting for each one. The calls still take the file system
+ * lock one at a time: the requests overlap the work of the application (and
+ * the writers' pauses, see wb_balance), not each other.
+ *
+ * A worker taking an fsync request takes all the queued ones with it: one
+ * commit and one device sync make all of them durable (sfs_fsync commits the
+ * changes of every file anyway), which is what a burst of small files with
+ * an fsync each needs.
+ *
+ * The requests run in any order: a request submitted after another one is
+ * not ordered with it, an fsync only covers the writes completed before its
+ * submission (submit it from the write's callback). sfs_mkfs and sfs_mount
+ * run the queued requests on the file system they were submitted to, then
+ * stop the workers (see aio_release): the next submission starts them again.
+ */
+
+pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t aio_submitted = PTHREAD_COND_INITIALIZER;   // a request was queued for the workers
+pthread_cond_t aio_completed = PTHREAD_COND_INITIALIZER;   // a request was queued for sfs_reap
+
+// the submission queue, and the completion queue of the requests without callback
+sfs_aio_request* aio_queue;
+sfs_aio_request* aio_queue_tail;
+sfs_aio_request* aio_done;
+sfs_aio_request* aio_done_tail;
+
+int aio_reapable;   // requests without callback submitted and not reaped yet
+int aio_callbacks;  // requests with callback whose callback has not returned (it can submit more)
+int aio_workers;
+pthread_t aio_threads[SFS_AIO_WORKERS];
+int aio_stopping;   // the workers exit once the submission queue is empty (see aio_release)
+
+/**
+ * Appends a request to a queue
+ */
+void aio_append(sfs_aio_request** head, sfs_aio_request** tail, sfs_aio_request* req) {
+    req->next = 0;
+    if(*head == 0) {
+        *head = req;
+    } else {
+        (*tail)->next = req;
+    }
+    *tail = req;
+}
+
+/**
+ * Takes the next requests to run off the submission queue: the first one,
+ * or all the fsync requests if it is one
+ * @return The requests, linked by next
+ */
+sfs_aio_request* aio_take() {
+    sfs_aio_request* batch = aio_queue;
+    if(batch->op != SFS_AIO_FSYNC) {
+        aio_queue = batch->next;
+        batch->next = 0;
+        return batch;
     }
     
-    // allocate space for subsequent blocks
-    int block_start, block_len;
-    if(!find_free_space(len, &block_start, &block_len)) {
-        printf("No more space left on device");
-        return -1;
+    sfs_aio_request* fsyncs = 0;
+    sfs_aio_request* fsyncs_tail = 0;
+    sfs_aio_request* rest = 0;
+    sfs_aio_request* rest_tail = 0;
+    for(sfs_aio_request* req = aio_queue; req != 0;) {
+        sfs_aio_request* next = req->next;
+        if(req->op == SFS_AIO_FSYNC) {
+            aio_append(&fsyncs, &fsyncs_tail, req);
+        } else {
+            aio_append(&rest, &rest_tail, req);
+        }
+        req = next;
+    }
+    aio_queue = rest;
+    aio_queue_tail = rest_tail;
+    return fsyncs;
+}
+
+/**
+ * Runs requests taken by aio_take, sets their result
+ */
+void aio_run(sfs_aio_request* batch) {
+    SFS_API_LOCK();
+    int64_t now = clock_ns();
+    for(sfs_aio_request* req = batch; req != 0; req = req->next) {
+        api_stats.aio_requests++;
+        api_stats.aio_queue_ns += now - req->submitted;
     }
     
-    if(len > 0) {
-        char* new_blocks_buff = malloc(block_len * SFS_API_BLOCK_SIZE);
-        memset(new_blocks_buff, 0, block_len * SFS_API_BLOCK_SIZE);
-        memcpy(new_blocks_buff, buf, len);
-        allocate_block(block_start, block_len, new_blocks_buff);
-        free(new_blocks_buff);
+    if(batch->op == SFS_AIO_READ) {
+        batch->result = sfs_pread(batch->fileID, batch->buf, batch->length, batch->loc);
+    } else if(batch->op == SFS_AIO_WRITE) {
+        batch->result = sfs_pwrite(batch->fileID, batch->buf, batch->length, batch->loc);
+    } else {
+        int result = sfs_sync();
+        api_stats.aio_syncs++;
+        for(sfs_aio_request* req = batch; req != 0; req = req->next) {
+            api_stats.aio_fsyncs++;
+            int opened = fdtbl != 0 && req->fileID >= 0 && req->fileID < fdtbl->size && fdtbl->entries[req->fileID].in_use;
+            req->result = opened ? result : -1;
+        }
+    }
+}
+
+/**
+ * A worker of the asynchronous calls
+ *
+ * Basic algorithm:
+ * - Waits for a request, exits if none is left and the workers are stopping
+ * - Runs it (with the queued fsync requests if it is one)
+ * - Runs the callbacks, outside the lock (they can submit), or queues the
+ *   requests for sfs_reap
+ */
+void* aio_worker(void* arg) {
+    pthread_mutex_lock(&aio_lock);
+    while(1) {
+        while(aio_queue == 0 && !aio_stopping) { pthread_cond_wait(&aio_submitted, &aio_lock); }
+        if(aio_queue == 0) { break; }
+        sfs_aio_request* batch = aio_take();
+        pthread_mutex_unlock(&aio_lock);
         
-        // for each subsequent block, assign ptr index in the file inode
-        // (creates the indirection data block if necessary)
-        for(int i = 0; i < block_len; i++) {
-            if((itbl->inodes[entry->inode_index]).allocated_ptr >= SFS_NUM_DIRECT_PTR) {
-                // we now need an indirection block, create one and update inode
-                if(indirection_block == 0) {
-                    int ind_block_start, block_len;
-                    if(!find_free_space(len, &ind_block_start, &block_len)) {
-                        printf("No more space left on device (indirection data block)");
-                        return -1;
-                    }
-
-                    indirection_block = malloc(SFS_API_BLOCK_SIZE);
-                    indirection_block->count = 0;
-                    indirection_block->ptrs = (int*)calloc(indirection_datablock_count, sizeof(int));
-
-                    char* block_buff = malloc(SFS_API_BLOCK_SIZE);
-                    memcpy(block_buff, indirection_block, sizeof(int));
-                    memcpy(block_buff + sizeof(int), indirection_block->ptrs, indirection_datablock_count * sizeof(int));
-                    allocate_block(ind_block_start, block_len, block_buff);
-                    free(block_buff);
-                    
-                    (itbl->inodes[entry->inode_index]).ind_block_ptr = ind_block_start;
-                }
-                
-                if(indirection_block->count >= indirection_datablock_count) {
-                    return -1;
-                }
-                
-                indirection_block->ptrs[indirection_block->count] = block_start + i;
-                indirection_block->count++;
+        aio_run(batch);
+        while(batch != 0) {
+            // the request belongs to the caller again once completed
+            sfs_aio_request* req = batch;
+            batch = req->next;
+            if(req->callback != 0) {
+                req->callback(req);
+                pthread_mutex_lock(&aio_lock);
+                aio_callbacks--;
             } else {
-                (itbl->inodes[entry->inode_index]).ptrs[(itbl->inodes[entry->inode_index]).allocated_ptr] = block_start + i;
-                (itbl->inodes[entry->inode_index]).allocated_ptr++;
+                pthread_mutex_lock(&aio_lock);
+                aio_append(&aio_done, &aio_done_tail, req);
             }
+            pthread_cond_broadcast(&aio_completed);
+            pthread_mutex_unlock(&aio_lock);
         }
-
-        entry->rw_ptr += len;
-        total_written += len;
+        pthread_mutex_lock(&aio_lock);
     }
+    pthread_mutex_unlock(&aio_lock);
+    return 0;
+}
+
+/**
+ * Stops the workers: they run the queued requests, and the ones submitted
+ * by their callbacks meanwhile, then exit. The completed requests without
+ * callback stay queued for sfs_reap. The caller must not hold the file
+ * system lock (the requests take it) nor be a callback.
+ */
+void aio_release() {
+    pthread_mutex_lock(&aio_lock);
+    int workers = aio_workers;
+    aio_stopping = 1;
+    pthread_cond_broadcast(&aio_submitted);
+    pthread_mutex_unlock(&aio_lock);
     
-    if(indirection_block != 0){
-        char* block_buff = malloc(SFS_API_BLOCK_SIZE);
-        memcpy(block_buff, indirection_block, sizeof(int));
-        memcpy(block_buff + sizeof(int), indirection_block->ptrs, indirection_datablock_count * sizeof(int));
-        write_blocks((itbl->inodes[entry->inode_index]).ind_block_ptr, block_len, block_buff);
-        free(block_buff);
-        
-        free(indirection_block->ptrs);
-        free(indirection_block);
+    for(int i = 0; i < workers; i++) {
+        pthread_join(aio_threads[i], 0);
     }
     
-    (itbl->inodes[entry->inode_index]).size += total_written; // update file total file size
-    
-    write_inode_table(); // update the inode table
-    return total_written;
+    pthread_mutex_lock(&aio_lock);
+    aio_workers = 0;
+    aio_stopping = 0;
+    pthread_mutex_unlock(&aio_lock);
 }
 
 /**
- * Given an opened file descriptor, update the rw_ptr to a given position
- * @param fdId The opened file descriptor index
- * @param loc The location to locate the rw_ptr
- * @return -1 fd does not exist/not in use, 0 if ok
+ * Takes the locks of the file system before a fork: the child only gets the
+ * forking thread, a lock held by the flusher or a worker would stay held
  */
-int sfs_fseek(int fdId, int loc) {
-    if(fdId >= fdtbl->size) { return -1; }
-    if((fdtbl->entries[fdId]).in_use == 0) { return -1; }
-    
-    file_descriptor_entry* entry = &(fdtbl->entries[fdId]);
+void fork_prepare() {
+    pthread_mutex_lock(&sfs_lock);
+    pthread_mutex_lock(&wb_io_lock);
+    pthread_mutex_lock(&wb_wake_lock);
+    pthread_mutex_lock(&aio_lock);
+}
+
+/**
+ * Releases the locks taken by fork_prepare in the parent
+ */
+void fork_parent() {
+    pthread_mutex_unlock(&aio_lock);
+    pthread_mutex_unlock(&wb_wake_lock);
+    pthread_mutex_unlock(&wb_io_lock);
+    pthread_mutex_unlock(&sfs_lock);
+}
+
+/**
+ * Resets the locks taken by fork_prepare in the child (its thread is not
+ * their owner anymore) and the conditions the threads of the parent waited
+ * on. The child has neither the flusher (until its next sfs_mkfs or
+ * sfs_mount) nor the workers (the next submission starts them).
+ */
+void fork_child() {
+    pthread_mutex_t recursive = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+    sfs_lock = recursive;
+    pthread_mutex_init(&wb_io_lock, 0);
+    pthread_mutex_init(&wb_wake_lock, 0);
+    pthread_mutex_init(&aio_lock, 0);
+    pthread_cond_init(&wb_wake, 0);
+    pthread_cond_init(&aio_submitted, 0);
+    pthread_cond_init(&aio_completed, 0);
+    aio_workers = 0;
+}
+
+/**
+ * Queues a request for the workers, starting them on the first one
+ * @return 0 if queued, -1 if no worker could be started
+ */
+int aio_submit(sfs_aio_request* req, int op) {
+    pthread_mutex_lock(&aio_lock);
+    while(aio_workers < SFS_AIO_WORKERS) {
+        if(pthread_create(&aio_threads[aio_workers], 0, aio_worker, 0) != 0) { break; }
+        aio_workers++;
+    }
+    if(aio_workers == 0) {
+        pthread_mutex_unlock(&aio_lock);
+        return -1;
+    }
     
-    entry->rw_ptr = loc;
+    req->op = op;
+    req->result = -1;
+    req->submitted = clock_ns();
+    aio_append(&aio_queue, &aio_queue_tail, req);
+    if(req->callback == 0) {
+        aio_reapable++;
+    } else {
+        aio_callbacks++;
+    }
+    pthread_cond_signal(&aio_submitted);
+    pthread_mutex_unlock(&aio_lock);
     return 0;
 }
 
 /**
- * Reads an opened file descriptor and copy the data in the buffer passed in as
- * parameter
- * 
- * Basic Algorithm : 
- * - while there is still something to be read
- *    - find the relative data block index (rw_ptr % block_size)
- *    - if this index resides within an indirection block, use the ind table
- *    - read the data and place it in the buffer
- *    - increase the rw_ptr 
- *    - update the relative data block index 
- * 
- * @param fdId The opened file descriptor to the file
- * @param buf The buffer to return the data
- * @param len The length of data to read from the file
- * @return -1 if error, the length of data readed
+ * Reads a file asynchronously: sfs_pread(req->fileID, req->buf, req->length,
+ * req->loc) runs on a worker thread, then req->callback(req) on that thread,
+ * or, without callback, req is returned by sfs_reap. req->result is the
+ * result of the call. req and the buffer must stay valid until completion.
+ * @param req The request, its arguments, callback and user_data set
+ * @return 0 if submitted, -1 if the workers cannot be started
  */
-int sfs_fread(int fdId, char* buf, int len) {
-    if(fdId >= fdtbl->size) { return -1; }
-    if((fdtbl->entries[fdId]).in_use == 0) { return -1; }
+int sfs_submit_read(sfs_aio_request* req) {
+    return aio_submit(req, SFS_AIO_READ);
+}
+
+/**
+ * Writes a file asynchronously: sfs_pwrite (see sfs_submit_read)
+ * @param req The request, its arguments, callback and user_data set
+ * @return 0 if submitted, -1 if the workers cannot be started
+ */
+int sfs_submit_write(sfs_aio_request* req) {
+    return aio_submit(req, SFS_AIO_WRITE);
+}
+
+/**
+ * Makes a file durable asynchronously: sfs_fsync(req->fileID), the queued
+ * fsync requests share one commit and device sync (see sfs_submit_read)
+ * @param req The request, its fileID, callback and user_data set
+ * @return 0 if submitted, -1 if the workers cannot be started
+ */
+int sfs_submit_fsync(sfs_aio_request* req) {
+    return aio_submit(req, SFS_AIO_FSYNC);
+}
+
+/**
+ * Gets the completed requests submitted without callback, in the order of
+ * completion, waiting until min_nr of them are completed or none can be
+ * anymore (all reaped, and no callback left to run that could submit one)
+ * @param reqs Filled with the completed requests
+ * @param min_nr Requests to wait for, 0 to only get the completed ones
+ * @param nr Size of reqs
+ * @return The number of requests in reqs
+ */
+int sfs_reap(sfs_aio_request** reqs, int min_nr, int nr) {
+    pthread_mutex_lock(&aio_lock);
+    int count = 0;
+    while(count < nr) {
+        if(aio_done != 0) {
+            reqs[count++] = aio_done;
+            aio_done = aio_done->next;
+            aio_reapable--;
+        } else if(count < min_nr && (aio_reapable > 0 || aio_callbacks > 0)) {
+            pthread_cond_wait(&aio_completed, &aio_lock);
+        } else {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&aio_lock);
+    return count;
+}
+
+/**
+ * Starts recording the sfs_* calls (path, file descriptor and inode level) to
+ * a trace file, with their arguments, result, start time and duration, so
+ * the workload can be replayed on a fresh disk (see sfs_replay.c). The data
+ * written is not recorded. Start it right after formatting the disk: a
+ * replay starts from an empty file system.
+ *
+ * The calls cost one test when not tracing, and one buffered write of a
+ * record (40 bytes + names) when tracing.
+ * @param path The trace file to create
+ * @return 0 if started, -1 if no file system is mounted, already tracing or
+ *         the file cannot be created
+ */
+int sfs_trace_start(const char* path) {
+    SFS_API_LOCK();
+    if(sblock == 0 || trace_file != 0) { return -1; }
     
-    file_descriptor_entry* entry = &(fdtbl->entries[fdId]);
+    trace_file = fopen(path, "wb");
+    if(trace_file == 0) { return -1; }
+    setvbuf(trace_file, 0, _IOFBF, 1 << 20);
     
-    int read_len = len > (itbl->inodes[entry->inode_index]).size ? (itbl->inodes[entry->inode_index]).size : len;
-    if(read_len < 0) {
-        printf("filesize limit reached");
-        return;
-    }
+    sfs_trace_header header;
+    memset(&header, 0, sizeof(sfs_trace_header));
+    memcpy(header.magic, SFS_TRACE_MAGIC, sizeof(header.magic));
+    header.block_size = block_size;
+    header.num_inodes = sblock->inode_count;
+    header.num_blocks = sblock->fs_size;
+    fwrite(&header, sizeof(sfs_trace_header), 1, trace_file);
     
-    int before = entry->rw_ptr;
-    int rel_start_block_index = (int)floor((float)entry->rw_ptr / (float)SFS_API_BLOCK_SIZE);
-    int start_index = entry->rw_ptr % SFS_API_BLOCK_SIZE;
-    int read = 0;
+    trace_epoch = clock_ns();
+    return 0;
+}
+
+/**
+ * Stops recording the calls (see sfs_trace_start) and closes the trace file
+ * @return 0 if stopped, -1 if not tracing or the trace could not be written
+ */
+int sfs_trace_stop() {
+    SFS_API_LOCK();
+    if(trace_file == 0) { return -1; }
     
-    indirection_block* ind_block = 0;
-    while(read_len > 0) {
-        int block_read_index = 0;
-        
-        if(rel_start_block_index >= SFS_NUM_DIRECT_PTR) {
-            // rel read index lies within the indirection block
-            if(ind_block == 0) {
-                char* ind_block_buff = malloc(SFS_API_BLOCK_SIZE);
-                read_blocks((itbl->inodes[entry->inode_index]).ind_block_ptr, 1, ind_block_buff);
-                
-                ind_block = malloc(SFS_API_BLOCK_SIZE);
-                memcpy(&(ind_block->count), ind_block_buff, sizeof(int));
-                
-                ind_block->ptrs = calloc(ind_block->count, sizeof(int));
-                memcpy(ind_block->ptrs, ind_block_buff + sizeof(int), ind_block->count * sizeof(int));
-                free(ind_block_buff);
-            }
-            
-            block_read_index = ind_block->ptrs[rel_start_block_index - SFS_NUM_DIRECT_PTR];
-        } else {
-            block_read_index = (itbl->inodes[entry->inode_index]).ptrs[rel_start_block_index];
+    int res = fclose(trace_file);
+    trace_file = 0;
+    return res == 0 ? 0 : -1;
+}
+
+// the names of the traced calls, indexed by SFS_TRACE_*
+const char* op_names[SFS_TRACE_NUM_OPS] = {
+    [SFS_TRACE_MKDIR] = "mkdir", [SFS_TRACE_RMDIR] = "rmdir",
+    [SFS_TRACE_FOPEN] = "fopen", [SFS_TRACE_FOPEN_SHARED] = "fopen_shared",
+    [SFS_TRACE_FCLOSE] = "fclose", [SFS_TRACE_FWRITE] = "fwrite",
+    [SFS_TRACE_FREAD] = "fread", [SFS_TRACE_FSEEK] = "fseek",
+    [SFS_TRACE_FTRUNCATE] = "ftruncate", [SFS_TRACE_PREAD] = "pread",
+    [SFS_TRACE_PWRITE] = "pwrite", [SFS_TRACE_READV] = "readv",
+    [SFS_TRACE_WRITEV] = "writev", [SFS_TRACE_REMOVE] = "remove",
+    [SFS_TRACE_RENAME] = "rename", [SFS_TRACE_STAT] = "stat",
+    [SFS_TRACE_GETFILESIZE] = "getfilesize", [SFS_TRACE_ISDIR] = "isdir",
+    [SFS_TRACE_STATFS] = "statfs", [SFS_TRACE_GETNEXTFILENAME] = "getnextfilename",
+    [SFS_TRACE_GETDIRENTRY] = "getdirentry", [SFS_TRACE_OPENDIR] = "opendir",
+    [SFS_TRACE_READDIR_BATCH] = "readdir_batch", [SFS_TRACE_ILOOKUP] = "ilookup",
+    [SFS_TRACE_IGETATTR] = "igetattr", [SFS_TRACE_ICREATE] = "icreate",
+    [SFS_TRACE_IUNLINK] = "iunlink", [SFS_TRACE_IRENAME] = "irename",
+    [SFS_TRACE_IREAD] = "iread", [SFS_TRACE_IWRITE] = "iwrite",
+    [SFS_TRACE_ITRUNCATE] = "itruncate", [SFS_TRACE_ICLOSE] = "iclose",
+    [SFS_TRACE_IGETDIRENTRY] = "igetdirentry", [SFS_TRACE_IOPENDIR] = "iopendir",
+    [SFS_TRACE_IMAP] = "imap", [SFS_TRACE_FSYNC] = "fsync",
+    [SFS_TRACE_FDATASYNC] = "fdatasync", [SFS_TRACE_SYNC] = "sync",
+    [SFS_TRACE_ISYNC] = "isync", [SFS_TRACE_IHOLD] = "ihold",
+    [SFS_TRACE_IFORGET] = "iforget",
+};
+
+/**
+ * Gets the name of a traced call
+ * @param op The call (SFS_TRACE_*)
+ * @return its name, "?" if unknown
+ */
+const char* sfs_op_name(int op) {
+    if(op <= 0 || op >= SFS_TRACE_NUM_OPS || op_names[op] == 0) { return "?"; }
+    return op_names[op];
+}
+
+/**
+ * Takes a snapshot of the counters: the number of calls and latency
+ * histogram of each sfs_* call, the dentry and indirection cache hits and
+ * the allocator scan lengths. They are updated under the file system lock
+ * (two clock reads per call), from the start of the process or the last
+ * sfs_stats_reset.
+ * @param snapshot Return variable: the counters
+ * @return 0
+ */
+int sfs_stats(sfs_statistics* snapshot) {
+    SFS_API_LOCK();
+    *snapshot = api_stats;
+    return 0;
+}
+
+/**
+ * Clears the counters of sfs_stats
+ */
+void sfs_stats_reset() {
+    SFS_API_LOCK();
+    memset(&api_stats, 0, sizeof(sfs_statistics));
+}
+
+/**
+ * Appends to a buffer like snprintf: len is the length the text would have
+ * without truncation, the buffer holds what fits
+ * @return the new length
+ */
+int format_append(char* buf, int size, int len, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int res = vsnprintf(buf + (len < size ? len : size), len < size ? size - len : 0, format, args);
+    va_end(args);
+    return len + res;
+}
+
+/**
+ * The latency under which a fraction of the calls complete, as the upper
+ * bound of its histogram bucket (at most the longest call, in us)
+ */
+double latency_percentile(sfs_op_stats* op_stats, double fraction) {
+    uint64_t rank = op_stats->calls * fraction;
+    uint64_t seen = 0;
+    for(int i = 0; i < SFS_STATS_BUCKETS; i++) {
+        seen += op_stats->latency[i];
+        if(seen > rank) {
+            uint64_t bound = (uint64_t)2 << i;
+            return (bound < op_stats->max_ns ? bound : op_stats->max_ns) / 1000.0;
         }
-        
-        //int to_read_len = start_index + read_len > SFS_API_BLOCK_SIZE ? SFS_API_BLOCK_SIZE - start_index : read_len;
-        
-        int to_read_len = start_index + read_len > SFS_API_BLOCK_SIZE ? SFS_API_BLOCK_SIZE - start_index : read_len;
-        
-        char* block_buff = malloc(SFS_API_BLOCK_SIZE);
-        read_blocks(block_read_index, 1, block_buff);
-        memcpy(buf + read, block_buff + start_index, to_read_len);
-        free(block_buff);
-        
-        read += to_read_len;
-        entry->rw_ptr += to_read_len;
-        read_len -= to_read_len;
-        start_index = 0;
-        rel_start_block_index = (int)floor((float)entry->rw_ptr / (float)SFS_API_BLOCK_SIZE);
     }
-    
-    if(ind_block != 0) {
-        free(ind_block);
-    }
-    //entry->rw_ptr += before;
-    return read;
+    return op_stats->max_ns / 1000.0;
 }
 
 /**
- * Removes a file from the root directory
- * 
- * - check if the file eixsts
- * - return -1 if file does not exist
- * @param name the file name to be removed
- * @return 1 if file successfully removed, -1 if file not found
+ * Formats the counters of sfs_stats as text: a line per call with its
+ * latency (the percentiles are bucket bounds) and device requests, the
+ * latency histograms, then the cache, allocator and device counters
+ * @param buf Return variable: the text (null terminated, truncated to size)
+ * @param size The size of buf
+ * @return the length of the whole text (larger than size - 1 if truncated)
  */
-int sfs_remove(char* name) {
-    directory_entry* file = get_file(name);
-    if(!file) {
-        printf("File not found.");
-        return -1;
-    }
+int sfs_stats_format(char* buf, int size) {
+    SFS_API_LOCK();
+    int len = 0;
     
-    for(int i = 0; i < (itbl->inodes[file->inode_index]).allocated_ptr; i++) {
-        deallocate_block((itbl->inodes[file->inode_index]).ptrs[i], 1);
+    len = format_append(buf, size, len, "%-16s %10s %10s %10s %10s %10s %10s %10s\n", "call", "calls", "mean_us", "p50_us", "p99_us",
+            "max_us", "dev_rd/op", "dev_wr/op");
+    for(int op = 0; op < SFS_TRACE_NUM_OPS; op++) {
+        sfs_op_stats* op_stats = &api_stats.ops[op];
+        if(op_stats->calls == 0) { continue; }
+        len = format_append(buf, size, len, "%-16s %10llu %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n", sfs_op_name(op),
+                (unsigned long long)op_stats->calls, op_stats->total_ns / 1000.0 / op_stats->calls,
+                latency_percentile(op_stats, 0.5), latency_percentile(op_stats, 0.99), op_stats->max_ns / 1000.0,
+                (double)op_stats->disk_reads / op_stats->calls, (double)op_stats->disk_writes / op_stats->calls);
     }
     
-    for(int i = 0 ; i < root_dir->count - 1; i++) {
-        if(&root_dir->entries[i] >= file) {
-            root_dir->entries[i] = root_dir->entries[i + 1];
+    len = format_append(buf, size, len, "\nlatency histograms (bucket i: calls of 2^i to 2^(i+1) ns)\n");
+    for(int op = 0; op < SFS_TRACE_NUM_OPS; op++) {
+        sfs_op_stats* op_stats = &api_stats.ops[op];
+        if(op_stats->calls == 0) { continue; }
+        len = format_append(buf, size, len, "%-16s", sfs_op_name(op));
+        for(int i = 0; i < SFS_STATS_BUCKETS; i++) {
+            if(op_stats->latency[i] != 0) {
+                len = format_append(buf, size, len, " %d:%llu", i, (unsigned long long)op_stats->latency[i]);
+            }
         }
+        len = format_append(buf, size, len, "\n");
     }
     
-    root_dir->count--;
-    itbl->free_inodes[file->inode_index] = 0;
-    write_inode_table();
-    write_free_block_list();
-    write_root_dir();
-    read_root_dir();
-    return 1;
+    uint64_t lookups = api_stats.dcache_hits + api_stats.ncache_hits + api_stats.dir_scans;
+    uint64_t ind_loads = api_stats.ind_cache_hits + api_stats.ind_cache_misses;
+    len = format_append(buf, size, len, "\ndentry cache: %llu hits, %llu negative hits, %llu directory scans (%.1f%% hit rate)\n",
+            (unsigned long long)api_stats.dcache_hits, (unsigned long long)api_stats.ncache_hits, (unsigned long long)api_stats.dir_scans,
+            lookups ? 100.0 * (lookups - api_stats.dir_scans) / lookups : 0.0);
+    len = format_append(buf, size, len, "indirection cache: %llu hits, %llu misses (%.1f%% hit rate)\n",
+            (unsigned long long)api_stats.ind_cache_hits, (unsigned long long)api_stats.ind_cache_misses,
+            ind_loads ? 100.0 * api_stats.ind_cache_hits / ind_loads : 0.0);
+    len = format_append(buf, size, len, "journal: %llu commits (%.1f records, %.0f bytes per commit), %llu checkpoints\n",
+            (unsigned long long)api_stats.journal_commits,
+            api_stats.journal_commits ? (double)api_stats.journal_records / api_stats.journal_commits : 0.0,
+            api_stats.journal_commits ? (double)api_stats.journal_bytes / api_stats.journal_commits : 0.0,
+            (unsigned long long)api_stats.journal_checkpoints);
+    len = format_append(buf, size, len, "write-back: %lld dirty blocks, %llu flushes (%llu blocks in %llu requests), "
+            "%llu at the limit, %llu writes paused (%.1f ms)\n", (long long)wb_count,
+            (unsigned long long)api_stats.wb_flushes, (unsigned long long)api_stats.wb_blocks,
+            (unsigned long long)api_stats.wb_requests, (unsigned long long)api_stats.wb_limit_flushes,
+            (unsigned long long)api_stats.wb_throttles, api_stats.wb_pause_ns / 1e6);
+    len = format_append(buf, size, len, "async: %llu requests (%.1f us queued on average), %llu fsyncs in %llu syncs\n",
+            (unsigned long long)api_stats.aio_requests,
+            api_stats.aio_requests ? api_stats.aio_queue_ns / 1e3 / api_stats.aio_requests : 0.0,
+            (unsigned long long)api_stats.aio_fsyncs, (unsigned long long)api_stats.aio_syncs);
+    
+    const char* scan_names[] = { "block allocator", "inode allocator", "fragment allocator" };
+    sfs_scan_stats* scans[] = { &api_stats.block_alloc, &api_stats.inode_alloc, &api_stats.frag_alloc };
+    for(int i = 0; i < 3; i++) {
+        len = format_append(buf, size, len, "%s: %llu searches, %.1f entries scanned per search, %llu max\n", scan_names[i],
+                (unsigned long long)scans[i]->searches, scans[i]->searches ? (double)scans[i]->scanned / scans[i]->searches : 0.0,
+                (unsigned long long)scans[i]->max_scanned);
+    }
+    
+    disk_stats io;
+    get_disk_stats(&io);
+    len = format_append(buf, size, len, "device: %lld reads (%lld blocks, %.1f ms), %lld writes (%lld blocks, %.1f ms), "
+            "%lld flushes, %lld syncs (%.1f ms), %lld seeks (%.1f blocks on average)\nrequest sizes (bucket i: 2^i to 2^(i+1) blocks):",
+            (long long)io.read_calls, (long long)io.blocks_read, io.read_ns / 1e6, (long long)io.write_calls,
+            (long long)io.blocks_written, io.write_ns / 1e6, (long long)io.flushes, (long long)io.syncs, io.sync_ns / 1e6, (long long)io.seeks,
+            io.seeks ? (double)io.seek_distance / io.seeks : 0.0);
+    for(int i = 0; i < DISK_STATS_BUCKETS; i++) {
+        if(io.request_blocks[i] != 0) {
+            len = format_append(buf, size, len, " %d:%lld", i, (long long)io.request_blocks[i]);
+        }
+    }
+    len = format_append(buf, size, len, "\n");
+    return len;
 }
 
 /*int main() {
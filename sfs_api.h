@@ -1,51 +1,89 @@
 #ifndef SFS_API_H
 #define SFS_API_H
 
+#include <stdint.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/statvfs.h>
 
 #define SFS_API_FILENAME    "myfs.sfs"
 #define SFS_API_BLOCK_SIZE  1024
 #define SFS_API_NUM_BLOCKS  2048
-#define SFS_MAGIC_NUMBER    0xACBD0005
-#define SFS_INODE_TABLE_SIZE    20
+#define SFS_API_NUM_INODES  256
+#define SFS_MIN_BLOCK_SIZE  512
+#define SFS_MAGIC_NUMBER    0xACBD0009
+#define SFS_INODE_INLINE    0x1     // file data is stored in the inode pointer area
+#define SFS_INODE_TAIL      0x2     // the last partial block is packed in a fragment block
+#define SFS_INODE_ORPHAN    0x4     // removed while opened: freed at the last close (or at mount)
+#define SFS_FRAG_SLOTS      64      // slots per fragment block
 #define SFS_NUM_DIRECT_PTR  12
 #define SFS_MAX_FILENAME    13
 #define SFS_MAX_EXT         3
 #define SFS_MAX_FDENTRIES   1024
+#define SFS_DCACHE_SIZE     4096
+#define SFS_NCACHE_SIZE     1024    // negative dentries (names known not to exist)
+#define SFS_MAX_IO_RUN      64      // max contiguous blocks read with one disk access
+#define SFS_JOURNAL_MIN_BLOCKS  16              // size of the metadata journal: 1/32 of the disk, within these bounds (and see journal_min_len)
+#define SFS_JOURNAL_MAX_BYTES   (4 * 1024 * 1024)
+#define SFS_JOURNAL_COMMIT_MS   5               // max age of the metadata changes not committed yet (see wb_flusher)
+#define SFS_JOURNAL_PIN_BUCKETS 256
+#define SFS_WB_DIRTY_LIMIT      (32 * 1024 * 1024)  // dirty file data kept in memory, a writer writes back itself above it
+#define SFS_WB_BACKGROUND_RATIO 50              // % of the limit from which the flusher writes back and the writers are paused
+#define SFS_WB_EXPIRE_MS        30              // max age of the dirty data
+#define SFS_WB_INTERVAL_MS      SFS_JOURNAL_COMMIT_MS   // period of the flusher
+#define SFS_WB_MAX_PAUSE_MS     20              // pause of a writer at the limit (proportional from the background threshold)
+#define SFS_WB_MAX_RUN_BYTES    (1024 * 1024)   // max adjacent dirty blocks written with one disk access
+#define SFS_WB_BUCKETS          1024
+#define SFS_AIO_WORKERS         4               // threads running the asynchronous requests (see sfs_submit_read)
 
 void mksfs(int fresh);  // creates the file system
 
 typedef struct {
     int magic;
     int block_size;
-    int fs_size;
+    int64_t fs_size;
     int inode_table_len;
+    int inode_count;
     int root_inode_no;
+    int64_t free_block_count;   // maintained on every (de)allocation, for statfs
+    int free_inode_count;
+    int64_t journal_start;      // metadata journal (see journal_commit), after the free block list
+    int64_t journal_len;
 } superblock;
 
 typedef struct {
     mode_t mode;
-    int size;
+    int64_t size;
     int allocated_ptr;
-    int ind_block_ptr;
-    int ptrs[SFS_NUM_DIRECT_PTR];
+    int flags;
+    int64_t ind_block_ptr;
+    int64_t dind_block_ptr;
+    int64_t ptrs[SFS_NUM_DIRECT_PTR];
+    int64_t tail_block;     // fragment block holding the tail (SFS_INODE_TAIL)
+    int tail_slot;          // first slot of the tail in the fragment block
 } inode;
 
+// tiny files are stored inline in place of the direct pointers
+#define SFS_INLINE_SIZE     (SFS_NUM_DIRECT_PTR * sizeof(int64_t))
+
+typedef struct {
+    int64_t block;
+    uint64_t used;  // one bit per slot
+    uint64_t freed; // slots released since the last journal commit (still used until then)
+} fragment_block;
+
 typedef struct {
     int size;
     int allocated_cnt;
     char* free_inodes;
     inode* inodes;
+    int64_t* refs;  // open file descriptors and sfs_ihold references of each inode (not on the disk, see release_inode)
+    int* dir_hints; // no free slot below it in each directory (not on the disk, see dir_insert)
 } inode_table;
 
 typedef struct {
-    int count;
-    int* ptrs;
-} indirection_block;
-
-typedef struct {
-    int inode_index;
-    char filename[SFS_MAX_FILENAME];
+    int inode_index;    // -1 for a free slot (see dir_remove)
+    char filename[16];  // SFS_MAX_FILENAME + null terminator, as stored on disk
     char extension[SFS_MAX_EXT];
 } directory_entry;
 
@@ -54,10 +92,223 @@ typedef struct {
     directory_entry* entries;
 } directory;
 
+typedef struct {
+    int64_t disk_offset;    // byte offset of the data in the disk image, -1 for a hole
+    int len;
+} sfs_extent;
+
+typedef struct {
+    int parent;     // inode of the directory holding the entry, -1 if slot empty
+    int inode_index;
+    char name[SFS_MAX_FILENAME + 1];
+} dcache_entry;
+
+typedef struct {
+    int dir_inode;
+    int position;   // next entry to read, can be set to resume an iteration
+} sfs_dir_cursor;
+
+typedef struct {
+    char name[SFS_MAX_FILENAME + 1];
+    int inode_index;
+    int64_t size;
+    mode_t mode;
+    int next_position;  // cursor position just after this entry
+} sfs_dirent;
+
+// the asynchronous calls
+#define SFS_AIO_READ    0
+#define SFS_AIO_WRITE   1
+#define SFS_AIO_FSYNC   2
+
+// an asynchronous request (see sfs_submit_read), owned by the caller until it
+// completes: the caller sets the arguments, the callback and user_data
+typedef struct sfs_aio_request {
+    int fileID;
+    char* buf;
+    int length;
+    int64_t loc;
+    void (*callback)(struct sfs_aio_request* req);  // run by a worker on completion, 0 to queue the request for sfs_reap
+    void* user_data;
+    int result;         // of the call, set on completion
+    int op;             // SFS_AIO_*, set by the submission
+    int64_t submitted;  // ns
+    struct sfs_aio_request* next;
+} sfs_aio_request;
+
+// a transaction of the metadata journal: this header, then nrecords records
+// (bytes long in all, header included), padded to whole blocks. The first
+// block of the journal holds a header too: seq is the first transaction to
+// replay, the transactions follow from the second block.
+#define SFS_JOURNAL_MAGIC   0x4C4E524A
+
+typedef struct {
+    uint32_t magic;
+    uint32_t checksum;  // of the records (FNV-1a)
+    int64_t seq;
+    int64_t nblocks;
+    int64_t nrecords;
+    int64_t bytes;
+} journal_txn;
+
+// a range of metadata to write at its home location, followed by its len bytes
+typedef struct {
+    int64_t addr;       // byte offset on the disk
+    int32_t len;
+    int32_t pad;
+} journal_record;
+
+// the copy of a metadata block (directory or indirection block) changed
+// since the last checkpoint, read instead of the stale block on the disk
+typedef struct journal_pin {
+    int64_t block;
+    char* data;
+    struct journal_pin* next;
+} journal_pin;
+
+// a data block written by a call, not written back to the disk yet
+typedef struct wb_block {
+    int64_t block;
+    char* data;
+    int64_t seq;        // version of the data (see wb_clean)
+    struct wb_block* next;
+} wb_block;
+
+// a copy of the dirty blocks being written back, sorted by block
+typedef struct {
+    int64_t count;
+    int64_t* blocks;
+    int64_t* seqs;
+    char* data;         // count blocks, in the order of blocks
+    int64_t requests;   // disk requests that wrote them (adjacent blocks coalesced)
+} wb_batch;
+
+// header of a trace file (see sfs_trace_start), the geometry of the traced file system
+#define SFS_TRACE_MAGIC     "SFSTRC01"
+
+typedef struct {
+    char magic[8];
+    int32_t block_size;
+    int32_t num_inodes;
+    int64_t num_blocks;
+} sfs_trace_header;
+
+// one traced call, followed by name_len bytes: the path or name, for two
+// names (rename) the first one is null terminated
+typedef struct {
+    uint64_t time;      // start of the call, in ns since sfs_trace_start
+    int64_t loc;        // file position, or directory position
+    int64_t result;
+    int32_t arg;        // file descriptor or inode
+    int32_t arg2;       // length, mode, count or second inode
+    uint32_t duration;  // in ns (saturated)
+    uint16_t name_len;
+    uint8_t op;         // SFS_TRACE_*
+    uint8_t pad;
+} sfs_trace_record;
+
+// the traced calls
+#define SFS_TRACE_MKDIR             1
+#define SFS_TRACE_RMDIR             2
+#define SFS_TRACE_FOPEN             3
+#define SFS_TRACE_FOPEN_SHARED      4
+#define SFS_TRACE_FCLOSE            5
+#define SFS_TRACE_FWRITE            6
+#define SFS_TRACE_FREAD             7
+#define SFS_TRACE_FSEEK             8
+#define SFS_TRACE_FTRUNCATE         9
+#define SFS_TRACE_PREAD             10
+#define SFS_TRACE_PWRITE            11
+#define SFS_TRACE_READV             12
+#define SFS_TRACE_WRITEV            13
+#define SFS_TRACE_REMOVE            14
+#define SFS_TRACE_RENAME            15
+#define SFS_TRACE_STAT              16
+#define SFS_TRACE_GETFILESIZE       17
+#define SFS_TRACE_ISDIR             18
+#define SFS_TRACE_STATFS            19
+#define SFS_TRACE_GETNEXTFILENAME   20
+#define SFS_TRACE_GETDIRENTRY       21
+#define SFS_TRACE_OPENDIR           22
+#define SFS_TRACE_READDIR_BATCH     23
+#define SFS_TRACE_ILOOKUP           24
+#define SFS_TRACE_IGETATTR          25
+#define SFS_TRACE_ICREATE           26
+#define SFS_TRACE_IUNLINK           27
+#define SFS_TRACE_IRENAME           28
+#define SFS_TRACE_IREAD             29
+#define SFS_TRACE_IWRITE            30
+#define SFS_TRACE_ITRUNCATE         31
+#define SFS_TRACE_ICLOSE            32
+#define SFS_TRACE_IGETDIRENTRY      33
+#define SFS_TRACE_IOPENDIR          34
+#define SFS_TRACE_IMAP              35
+#define SFS_TRACE_FSYNC             36
+#define SFS_TRACE_FDATASYNC         37
+#define SFS_TRACE_SYNC              38
+#define SFS_TRACE_ISYNC             39
+#define SFS_TRACE_IHOLD             40
+#define SFS_TRACE_IFORGET           41
+#define SFS_TRACE_NUM_OPS           42
+
+// latency histogram of a call: bucket i counts the calls of 2^i to
+// 2^(i + 1) - 1 ns, the last bucket all the longer ones
+#define SFS_STATS_BUCKETS   32
+
+typedef struct {
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t latency[SFS_STATS_BUCKETS];
+    uint64_t disk_reads;    // read_blocks requests issued by the calls
+    uint64_t disk_writes;   // write_blocks requests issued by the calls
+} sfs_op_stats;
+
+typedef struct {
+    uint64_t searches;
+    uint64_t scanned;       // entries examined by all the searches
+    uint64_t max_scanned;   // by the longest search
+} sfs_scan_stats;
+
+typedef struct {
+    sfs_op_stats ops[SFS_TRACE_NUM_OPS];    // per sfs_* call (SFS_TRACE_*)
+    uint64_t dcache_hits;       // lookups answered by the dentry cache
+    uint64_t ncache_hits;       // lookups answered by the negative dentry cache
+    uint64_t dir_scans;         // lookups reading the directory
+    uint64_t ind_cache_hits;    // indirection blocks found in the cache
+    uint64_t ind_cache_misses;  // indirection blocks read from the disk
+    sfs_scan_stats block_alloc; // free block list entries examined (find_free_space)
+    sfs_scan_stats inode_alloc; // inode table entries examined
+    sfs_scan_stats frag_alloc;  // fragment blocks examined
+    uint64_t journal_commits;       // transactions written to the journal
+    uint64_t journal_records;
+    uint64_t journal_bytes;
+    uint64_t journal_checkpoints;   // write backs of the metadata to their home location
+    uint64_t wb_flushes;        // write-backs of the dirty data (flusher, commit, sync or writer at the limit)
+    uint64_t wb_blocks;
+    uint64_t wb_requests;       // disk requests of the write-backs (adjacent blocks coalesced)
+    uint64_t wb_limit_flushes;  // write-backs by a writer at the dirty limit
+    uint64_t wb_throttles;      // writes paused over the background threshold
+    uint64_t wb_pause_ns;       // total pause of the writers
+    uint64_t aio_requests;      // asynchronous requests run by the workers
+    uint64_t aio_queue_ns;      // total wait of the requests in the submission queue
+    uint64_t aio_fsyncs;
+    uint64_t aio_syncs;         // device syncs of the fsync requests (the queued ones share one)
+} sfs_statistics;
+
+// the outermost sfs_* call running, timed for sfs_stats (see SFS_OP_TIMER)
+typedef struct {
+    int op;         // -1 for a call made by another sfs_* call
+    int64_t start;
+    int64_t disk_reads;     // device counters at the start
+    int64_t disk_writes;
+} op_timer;
+
 typedef struct {
     int in_use;
+    int refs;       // number of sfs_fopen_shared sharing the descriptor
     int inode_index;
-    int rw_ptr;
+    int64_t rw_ptr;
 } file_descriptor_entry;
 
 typedef struct {
@@ -66,6 +317,69 @@ typedef struct {
 } file_descriptor_table;
 
 
+// every sfs_* call is thread safe: the calls are serialized by a single lock
+// the calls changing the namespace (sfs_mkdir, sfs_rmdir, sfs_remove,
+// sfs_rename and their inode level versions) set errno when they fail
+int sfs_mkfs(char* path, int block_size, int64_t num_blocks, int num_inodes);  // formats a file system with a given geometry
+int sfs_mount(char* path);  // mounts an existing file system
+int sfs_getnextfilename(char* fname);  // get the name of the next file in directory
+int64_t sfs_getfilesize(const char* path);  // get the size of a given file
+int sfs_fopen(char* name);  // opens the given file
+int sfs_fopen_shared(char* name);  // opens the given file, sharing the descriptor if already opened
+int sfs_fclose(int fileID);  // closes the given file
+int sfs_fwrite(int fileID, char* buf, int length);  // write buf characters into disk
+int sfs_fread(int fileID, char* buf, int length);  // read characters from disk into buf
+int sfs_fseek(int fileID, int64_t loc);  // seek to the location from beginning
+int sfs_ftruncate(int fileID, int64_t size);  // changes the size of a file (the end is released or becomes a hole)
+int sfs_pread(int fileID, char* buf, int length, int64_t loc);  // read at a location, the file pointer is not moved
+int sfs_pwrite(int fileID, char* buf, int length, int64_t loc);  // write at a location, the file pointer is not moved
+int sfs_readv(int fileID, const struct iovec* iov, int iovcnt, int64_t loc);  // read at a location into several buffers
+int sfs_writev(int fileID, const struct iovec* iov, int iovcnt, int64_t loc);  // write several buffers at a location
+int sfs_remove(char* file);  // removes a file from the filesystem
+int sfs_rename(const char* from, const char* to);  // renames or moves a file or directory, replacing the target
+int sfs_mkdir(char* path);  // creates a directory
+int sfs_rmdir(char* path);  // removes an empty directory
+int sfs_isdir(const char* path);  // tells if a path is a directory
+int sfs_stat(const char* path, struct stat* st);  // gets the attributes of a path
+int sfs_statfs(struct statvfs* st);  // gets the size and free space of the file system
+int64_t sfs_free_extents(int64_t* histogram, int nbuckets);  // histogram of the free extent sizes (scans the disk map)
+int sfs_getdirentry(const char* path, int position, char* fname);  // get the name of the entry at a position of a directory
+int sfs_opendir(const char* path, sfs_dir_cursor* cursor);  // starts an iteration over a directory
+int sfs_readdir_batch(sfs_dir_cursor* cursor, sfs_dirent* entries, int n);  // reads the next entries of a directory, with their attributes
+int sfs_fsync(int fileID);  // makes a file and the metadata changes so far durable
+int sfs_fdatasync(int fileID);  // makes the data of a file durable (commits only if its size or block map changed)
+int sfs_sync();  // makes the whole file system durable
+
+// inode level API (files and directories addressed by inode number)
+int sfs_root_inode();  // gets the inode of the root directory
+int sfs_ilookup(int dir_inode, const char* name);  // finds an entry of a directory
+int sfs_igetattr(int inode_index, struct stat* st);  // gets the attributes of an inode
+int sfs_icreate(int dir_inode, const char* name, mode_t mode);  // creates a file (or a directory with S_IFDIR)
+int sfs_iunlink(int dir_inode, const char* name);  // removes a file or an empty directory
+int sfs_irename(int dir_inode, const char* name, int new_dir_inode, const char* new_name);  // renames or moves an entry
+int sfs_iread(int inode_index, char* buf, int length, int64_t loc);  // read at a location
+int sfs_iwrite(int inode_index, char* buf, int length, int64_t loc);  // write at a location
+int sfs_itruncate(int inode_index, int64_t size);  // changes the size of a file
+void sfs_iclose(int inode_index);  // done writing a file (packs its tail)
+int sfs_igetdirentry(int dir_inode, int position, char* fname, int* inode_index);  // get the entry at a position of a directory
+int sfs_iopendir(int dir_inode, sfs_dir_cursor* cursor);  // starts an iteration over a directory
+int sfs_imap(int inode_index, int64_t loc, int length, sfs_extent* extents, int max_extents);  // where a range of a file is in the disk image
+int sfs_isync(int inode_index, int datasync);  // makes a file durable (see sfs_fsync and sfs_fdatasync)
+int sfs_ihold(int inode_index);  // keeps an inode allocated while a front end knows its number
+int sfs_iforget(int inode_index, int64_t count);  // drops references taken by sfs_ihold
+
+// asynchronous API: the calls run on a pool of worker threads, in any order
+int sfs_submit_read(sfs_aio_request* req);  // queues sfs_pread(req->fileID, req->buf, req->length, req->loc)
+int sfs_submit_write(sfs_aio_request* req);  // queues sfs_pwrite(req->fileID, req->buf, req->length, req->loc)
+int sfs_submit_fsync(sfs_aio_request* req);  // queues sfs_fsync(req->fileID)
+int sfs_reap(sfs_aio_request** reqs, int min_nr, int nr);  // gets the completed requests without callback
+
+int sfs_trace_start(const char* path);  // records the sfs_* calls to a trace file (see sfs_replay.c)
+int sfs_trace_stop();  // stops recording and closes the trace file
+const char* sfs_op_name(int op);  // the name of a traced call (SFS_TRACE_*)
+int sfs_stats(sfs_statistics* stats);  // snapshot of the call counters, latency histograms and cache/allocator counters
+void sfs_stats_reset();  // clears the counters of sfs_stats
+int sfs_stats_format(char* buf, int size);  // sfs_stats as text (the FUSE /.sfs_stats file)
 
 #endif /* SFS_API_H */
 
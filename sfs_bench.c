@@ -0,0 +1,710 @@
+/* sfs_bench.c
+ *
+ * Benchmark suite of the sfs API. Every workload reports its throughput
+ * (ops/s, MB/s), its latency distribution (p50/p99/p999 per operation) and
+ * the device I/O it caused (disk_emu counters):
+ *
+ *   seq_write, seq_read     sequential I/O on one file, for each I/O size
+ *   rand_write, rand_read   random aligned I/O on the same file
+ *   mixed                   random I/O, 70% reads and 30% writes
+ *   create, stat, list,     metadata rates on a directory of many files
+ *   remove
+ *   ingest, ingest_async    small files written and fsynced one at a time,
+ *                           then BENCH_AIO_DEPTH at a time (sfs_submit_*)
+ *   sweep                   block size sweep (1K to 64K) of sequential
+ *                           write and read, only run when selected with -w
+ *
+ * Usage: sfs_bench [-w workload,...] [-b block size] [-i image size in MB]
+ *                  [-f file size in MB] [-n files] [-s I/O size in KB,...]
+ *                  [-o results.json | -o -]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "disk_emu.h"
+#include "sfs_api.h"
+
+#define BENCH_FILENAME      "bench.sfs"
+#define BENCH_NUM_INODES    1024
+#define BENCH_IO_SIZE       (64 * 1024)     /* size of each sfs_fwrite/sfs_fread call of the sweep */
+#define BENCH_MAX_FILE      (4 * 1024 * 1024)   /* largest file written per sweep point */
+#define BENCH_MAX_RESULTS   64
+#define BENCH_MAX_IO_SIZES  8
+#define BENCH_DIR_BATCH     64              /* entries per sfs_readdir_batch call */
+#define BENCH_LIST_PASSES   10              /* listings of the directory by the list workload */
+#define BENCH_INGEST_SIZE   4096            /* size of the files of the ingest workloads */
+#define BENCH_AIO_DEPTH     64              /* files in flight in the ingest_async workload */
+
+struct bench_result {
+  char name[32];
+  int block_size;
+  int io_size;          /* 0 for the metadata workloads */
+  long ops;
+  long bytes;
+  double seconds;
+  double *lat;          /* latency of each operation (us) */
+  long nlat;
+  long lat_cap;
+  disk_stats io;
+};
+
+/* parameters of the run */
+static int block_size = 4096;
+static long image_size = 256L * 1024 * 1024;
+static long file_size = 32L * 1024 * 1024;
+static int nfiles = 2000;
+static int io_sizes[BENCH_MAX_IO_SIZES] = { 4096, 64 * 1024, 1024 * 1024 };
+static int nio_sizes = 3;
+static const char *selected;    /* comma separated workloads, NULL for all */
+
+static struct bench_result results[BENCH_MAX_RESULTS];
+static int nresults;
+static int error_count;
+static unsigned long long rand_state = 88172645463325252ULL;
+
+/* now() - returns a monotonic timestamp in seconds
+ */
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* next_rand() - xorshift64, so that every run does the same I/O
+ */
+static unsigned long long next_rand()
+{
+  rand_state ^= rand_state << 13;
+  rand_state ^= rand_state >> 7;
+  rand_state ^= rand_state << 17;
+  return rand_state;
+}
+
+/* is_selected() - tells if a workload was asked for on the command line
+ */
+static int is_selected(const char *name)
+{
+  size_t len = strlen(name);
+
+  if (selected == NULL) {
+    return strcmp(name, "sweep") != 0;
+  }
+  for (const char *p = selected; (p = strstr(p, name)) != NULL; p += len) {
+    if ((p == selected || p[-1] == ',') && (p[len] == '\0' || p[len] == ',')) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* format() - formats a fresh image with the benchmark geometry
+ */
+static int format(int inodes)
+{
+  if (sfs_mkfs(BENCH_FILENAME, block_size, image_size / block_size, inodes) == -1) {
+    fprintf(stderr, "ERROR: cannot format a %ld bytes disk of %d bytes blocks\n", image_size, block_size);
+    error_count++;
+    return -1;
+  }
+  return 0;
+}
+
+/* begin() - starts measuring a workload, returns its result record
+ */
+static struct bench_result *begin(const char *name, int io_size)
+{
+  struct bench_result *r = &results[nresults++];
+
+  memset(r, 0, sizeof(struct bench_result));
+  snprintf(r->name, sizeof(r->name), "%s", name);
+  r->block_size = block_size;
+  r->io_size = io_size;
+  reset_disk_stats();
+  r->seconds = now();
+  return r;
+}
+
+/* record() - accounts one operation started at start (a now() timestamp)
+ */
+static void record(struct bench_result *r, double start, long bytes)
+{
+  double lat = (now() - start) * 1e6;
+
+  if (r->nlat == r->lat_cap) {
+    r->lat_cap = r->lat_cap ? r->lat_cap * 2 : 1024;
+    r->lat = realloc(r->lat, r->lat_cap * sizeof(double));
+  }
+  r->lat[r->nlat++] = lat;
+  r->ops++;
+  r->bytes += bytes;
+}
+
+/* end() - stops measuring a workload
+ */
+static void end(struct bench_result *r)
+{
+  r->seconds = now() - r->seconds;
+  get_disk_stats(&r->io);
+}
+
+/* discard() - drops the last result (a setup step that was not selected)
+ */
+static void discard(struct bench_result *r)
+{
+  free(r->lat);
+  nresults--;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* percentile() - latency under which a fraction q of the operations
+ * completed (the latencies must be sorted)
+ */
+static double percentile(struct bench_result *r, double q)
+{
+  long i = (long)(q * r->nlat);
+
+  if (r->nlat == 0) {
+    return 0;
+  }
+  return r->lat[i < r->nlat ? i : r->nlat - 1];
+}
+
+/* fill() - the content of the data file at a given offset
+ */
+static void fill(char *buffer, long offset, int len)
+{
+  for (int i = 0; i < len; i++) {
+    buffer[i] = 'A' + ((offset + i) / 4096) % 26;
+  }
+}
+
+/* run_data() - I/O workloads for one I/O size on a fresh image: the file
+ * written by seq_write is the one read and rewritten by the others
+ */
+static void run_data(int io_size)
+{
+  struct bench_result *r;
+  char *buffer = malloc(io_size);
+  char *check = malloc(io_size);
+  long nios = file_size / io_size;
+  int fd;
+
+  if (format(BENCH_NUM_INODES) == -1) {
+    free(buffer);
+    free(check);
+    return;
+  }
+  fd = sfs_fopen("data");
+
+  r = begin("seq_write", io_size);
+  for (long i = 0; i < nios; i++) {
+    fill(buffer, i * io_size, io_size);
+    double start = now();
+    if (sfs_fwrite(fd, buffer, io_size) != io_size) {
+      fprintf(stderr, "ERROR: short write at %ld\n", i * io_size);
+      error_count++;
+      break;
+    }
+    record(r, start, io_size);
+  }
+  end(r);
+  if (!is_selected("seq_write")) {
+    discard(r);
+  }
+
+  if (is_selected("seq_read")) {
+    r = begin("seq_read", io_size);
+    sfs_fseek(fd, 0);
+    for (long i = 0; i < nios; i++) {
+      double start = now();
+      if (sfs_fread(fd, buffer, io_size) != io_size) {
+        fprintf(stderr, "ERROR: short read at %ld\n", i * io_size);
+        error_count++;
+        break;
+      }
+      record(r, start, io_size);
+      fill(check, i * io_size, io_size);
+      if (memcmp(buffer, check, io_size) != 0) {
+        fprintf(stderr, "ERROR: data error at %ld\n", i * io_size);
+        error_count++;
+        break;
+      }
+    }
+    end(r);
+  }
+
+  if (is_selected("rand_write")) {
+    r = begin("rand_write", io_size);
+    for (long i = 0; i < nios; i++) {
+      long offset = (long)(next_rand() % nios) * io_size;
+      fill(buffer, offset, io_size);
+      double start = now();
+      sfs_pwrite(fd, buffer, io_size, offset);
+      record(r, start, io_size);
+    }
+    end(r);
+  }
+
+  if (is_selected("rand_read")) {
+    r = begin("rand_read", io_size);
+    for (long i = 0; i < nios; i++) {
+      long offset = (long)(next_rand() % nios) * io_size;
+      double start = now();
+      sfs_pread(fd, buffer, io_size, offset);
+      record(r, start, io_size);
+      fill(check, offset, io_size);
+      if (memcmp(buffer, check, io_size) != 0) {
+        fprintf(stderr, "ERROR: data error at %ld\n", offset);
+        error_count++;
+        break;
+      }
+    }
+    end(r);
+  }
+
+  if (is_selected("mixed")) {
+    r = begin("mixed", io_size);
+    for (long i = 0; i < nios; i++) {
+      long offset = (long)(next_rand() % nios) * io_size;
+      int is_read = next_rand() % 10 < 7;
+      if (!is_read) {
+        fill(buffer, offset, io_size);
+      }
+      double start = now();
+      if (is_read) {
+        sfs_pread(fd, buffer, io_size, offset);
+      } else {
+        sfs_pwrite(fd, buffer, io_size, offset);
+      }
+      record(r, start, io_size);
+    }
+    end(r);
+  }
+
+  sfs_fclose(fd);
+  free(buffer);
+  free(check);
+}
+
+/* run_meta() - metadata workloads on a directory of nfiles small files
+ */
+static void run_meta()
+{
+  struct bench_result *r;
+  sfs_dirent entries[BENCH_DIR_BATCH];
+  char name[32];
+  int count;
+
+  if (format(nfiles + 16) == -1) {
+    return;
+  }
+  sfs_mkdir("/bench");
+
+  r = begin("create", 0);
+  for (int i = 0; i < nfiles; i++) {
+    double start = now();
+    sprintf(name, "/bench/f%d", i);
+    int fd = sfs_fopen(name);
+    if (fd == -1) {
+      fprintf(stderr, "ERROR: cannot create %s\n", name);
+      error_count++;
+      break;
+    }
+    sfs_fwrite(fd, name, strlen(name));
+    sfs_fclose(fd);
+    record(r, start, strlen(name));
+  }
+  end(r);
+  if (!is_selected("create")) {
+    discard(r);
+  }
+
+  if (is_selected("stat")) {
+    struct stat st;
+    r = begin("stat", 0);
+    for (int i = 0; i < 2 * nfiles; i++) {
+      /* half of the paths do not exist (build tools probing for files) */
+      double start = now();
+      sprintf(name, i % 2 ? "/bench/f%d" : "/bench/m%d", i / 2);
+      if (sfs_stat(name, &st) != (i % 2 ? 0 : -1)) {
+        fprintf(stderr, "ERROR: wrong stat of %s\n", name);
+        error_count++;
+        break;
+      }
+      record(r, start, 0);
+    }
+    end(r);
+  }
+
+  if (is_selected("list")) {
+    r = begin("list", 0);
+    for (int pass = 0; pass < BENCH_LIST_PASSES; pass++) {
+      sfs_dir_cursor cursor;
+      long listed = 0;
+      sfs_opendir("/bench", &cursor);
+      do {
+        double start = now();
+        count = sfs_readdir_batch(&cursor, entries, BENCH_DIR_BATCH);
+        if (count > 0) {
+          record(r, start, 0);
+          r->ops += count - 1;  /* one op per entry, one latency per batch */
+          listed += count;
+        }
+      } while (count > 0);
+      if (listed != nfiles) {
+        fprintf(stderr, "ERROR: listed %ld of %d files\n", listed, nfiles);
+        error_count++;
+        break;
+      }
+    }
+    end(r);
+  }
+
+  if (is_selected("remove")) {
+    r = begin("remove", 0);
+    for (int i = 0; i < nfiles; i++) {
+      double start = now();
+      sprintf(name, "/bench/f%d", i);
+      if (sfs_remove(name) == -1) {
+        fprintf(stderr, "ERROR: cannot remove %s\n", name);
+        error_count++;
+        break;
+      }
+      record(r, start, 0);
+    }
+    end(r);
+  }
+}
+
+/* a file of the ingest_async workload: its write, then its fsync submitted
+ * by the write's callback
+ */
+struct ingest_file {
+  sfs_aio_request write;
+  sfs_aio_request fsync;
+  double start;
+};
+
+static pthread_mutex_t ingest_lock = PTHREAD_MUTEX_INITIALIZER;
+static int ingest_errors;
+
+/* ingest_written() - callback of the writes (on a worker thread), the file
+ * is reaped once fsynced even if the write failed
+ */
+static void ingest_written(sfs_aio_request *req)
+{
+  struct ingest_file *file = req->user_data;
+
+  if (req->result != req->length) {
+    pthread_mutex_lock(&ingest_lock);
+    ingest_errors++;
+    pthread_mutex_unlock(&ingest_lock);
+  }
+  sfs_submit_fsync(&file->fsync);
+}
+
+/* ingest_reap() - closes the files whose fsync completed, waits for at least
+ * min of them, returns how many
+ */
+static int ingest_reap(struct bench_result *r, int min)
+{
+  sfs_aio_request *done[BENCH_AIO_DEPTH];
+  int count = sfs_reap(done, min, BENCH_AIO_DEPTH);
+
+  for (int i = 0; i < count; i++) {
+    struct ingest_file *file = done[i]->user_data;
+    if (done[i]->result != 0) {
+      fprintf(stderr, "ERROR: cannot fsync file %d\n", done[i]->fileID);
+      error_count++;
+    }
+    sfs_fclose(done[i]->fileID);
+    record(r, file->start, BENCH_INGEST_SIZE);
+  }
+  return count;
+}
+
+/* run_ingest() - nfiles small files created, written, fsynced and closed,
+ * one at a time with the synchronous calls, then with the asynchronous ones
+ * keeping BENCH_AIO_DEPTH files in flight (the queued fsyncs share a device
+ * sync)
+ */
+static void run_ingest()
+{
+  char *buffer = malloc(BENCH_INGEST_SIZE);
+  char name[32];
+  struct bench_result *r;
+
+  if (format(2 * nfiles + 16) == -1) {
+    free(buffer);
+    return;
+  }
+  fill(buffer, 0, BENCH_INGEST_SIZE);
+  sfs_mkdir("/sync");
+  sfs_mkdir("/async");
+
+  if (is_selected("ingest")) {
+    r = begin("ingest", BENCH_INGEST_SIZE);
+    for (int i = 0; i < nfiles; i++) {
+      double start = now();
+      sprintf(name, "/sync/f%d", i);
+      int fd = sfs_fopen(name);
+      if (fd == -1 || sfs_fwrite(fd, buffer, BENCH_INGEST_SIZE) != BENCH_INGEST_SIZE || sfs_fsync(fd) != 0) {
+        fprintf(stderr, "ERROR: cannot ingest %s\n", name);
+        error_count++;
+        break;
+      }
+      sfs_fclose(fd);
+      record(r, start, BENCH_INGEST_SIZE);
+    }
+    end(r);
+  }
+
+  if (is_selected("ingest_async")) {
+    struct ingest_file *files = calloc(nfiles, sizeof(struct ingest_file));
+    int in_flight = 0;
+    r = begin("ingest_async", BENCH_INGEST_SIZE);
+    for (int i = 0; i < nfiles; i++) {
+      if (in_flight == BENCH_AIO_DEPTH) {
+        in_flight -= ingest_reap(r, 1);
+      }
+      files[i].start = now();
+      sprintf(name, "/async/f%d", i);
+      int fd = sfs_fopen(name);
+      if (fd == -1) {
+        fprintf(stderr, "ERROR: cannot create %s\n", name);
+        error_count++;
+        break;
+      }
+      files[i].write = (sfs_aio_request){ .fileID = fd, .buf = buffer, .length = BENCH_INGEST_SIZE,
+                                          .callback = ingest_written, .user_data = &files[i] };
+      files[i].fsync = (sfs_aio_request){ .fileID = fd, .user_data = &files[i] };
+      if (sfs_submit_write(&files[i].write) == -1) {
+        fprintf(stderr, "ERROR: cannot submit the write of %s\n", name);
+        error_count++;
+        sfs_fclose(fd);
+        break;
+      }
+      in_flight++;
+    }
+    while (in_flight > 0) {
+      in_flight -= ingest_reap(r, in_flight);
+    }
+    end(r);
+    error_count += ingest_errors;
+    free(files);
+  }
+  free(buffer);
+}
+
+/* max_file_size() - the largest file a given block size can hold: the direct
+ * pointers, one indirection block and one double indirection block of 64-bit
+ * block pointers.
+ */
+static long max_file_size(int bsize)
+{
+  long nptrs = bsize / sizeof(int64_t);
+  return (SFS_NUM_DIRECT_PTR + nptrs + nptrs * nptrs) * bsize;
+}
+
+/* run_sweep() - for every block size from 1K to 64K, formats a disk then
+ * writes and reads back file_size bytes spread over as many files as needed
+ */
+static void run_sweep()
+{
+  char *buffer = malloc(BENCH_IO_SIZE);
+  char *check = malloc(BENCH_IO_SIZE);
+  int saved_block_size = block_size;
+  char name[32];
+
+  for (block_size = 1024; block_size <= 64 * 1024; block_size *= 2) {
+    long sweep_file = max_file_size(block_size) < BENCH_MAX_FILE ? max_file_size(block_size) : BENCH_MAX_FILE;
+    int sweep_files = (file_size + sweep_file - 1) / sweep_file;
+    struct bench_result *r;
+
+    if (format(BENCH_NUM_INODES) == -1) {
+      continue;
+    }
+
+    r = begin("sweep_write", BENCH_IO_SIZE);
+    for (int i = 0; i < sweep_files; i++) {
+      sprintf(name, "F%d", i);
+      int fd = sfs_fopen(name);
+      for (long done = 0; done < sweep_file; done += BENCH_IO_SIZE) {
+        int len = sweep_file - done > BENCH_IO_SIZE ? BENCH_IO_SIZE : sweep_file - done;
+        memset(buffer, 'A' + (i + done / BENCH_IO_SIZE) % 26, len);
+        double start = now();
+        if (sfs_fwrite(fd, buffer, len) != len) {
+          fprintf(stderr, "ERROR: short write in %s at %ld\n", name, done);
+          error_count++;
+          break;
+        }
+        record(r, start, len);
+      }
+      sfs_fclose(fd);
+    }
+    end(r);
+
+    r = begin("sweep_read", BENCH_IO_SIZE);
+    for (int i = 0; i < sweep_files; i++) {
+      sprintf(name, "F%d", i);
+      int fd = sfs_fopen(name);
+      sfs_fseek(fd, 0);
+      for (long done = 0; done < sweep_file; done += BENCH_IO_SIZE) {
+        int len = sweep_file - done > BENCH_IO_SIZE ? BENCH_IO_SIZE : sweep_file - done;
+        double start = now();
+        if (sfs_fread(fd, buffer, len) != len) {
+          fprintf(stderr, "ERROR: short read in %s at %ld\n", name, done);
+          error_count++;
+          break;
+        }
+        record(r, start, len);
+        memset(check, 'A' + (i + done / BENCH_IO_SIZE) % 26, len);
+        if (memcmp(buffer, check, len) != 0) {
+          fprintf(stderr, "ERROR: data error in %s at %ld\n", name, done);
+          error_count++;
+          break;
+        }
+      }
+      sfs_fclose(fd);
+    }
+    end(r);
+  }
+
+  block_size = saved_block_size;
+  free(buffer);
+  free(check);
+}
+
+/* print_table() - human readable summary of the results
+ */
+static void print_table(FILE *out)
+{
+  fprintf(out, "%-12s %8s %8s %10s %12s %10s %10s %10s %10s %10s %10s\n", "workload", "block", "io_KB",
+          "ops", "ops/s", "MB/s", "p50_us", "p99_us", "p999_us", "dev_rd", "dev_wr");
+  for (int i = 0; i < nresults; i++) {
+    struct bench_result *r = &results[i];
+    fprintf(out, "%-12s %8d %8d %10ld %12.1f %10.2f %10.1f %10.1f %10.1f %10lld %10lld\n", r->name,
+            r->block_size, r->io_size / 1024, r->ops, r->ops / r->seconds, r->bytes / r->seconds / (1024 * 1024),
+            percentile(r, 0.5), percentile(r, 0.99), percentile(r, 0.999),
+            (long long)r->io.read_calls, (long long)r->io.write_calls);
+  }
+}
+
+/* print_json() - the results as one JSON document
+ */
+static void print_json(FILE *out)
+{
+  fprintf(out, "{\n  \"block_size\": %d,\n  \"image_size\": %ld,\n  \"file_size\": %ld,\n"
+          "  \"files\": %d,\n  \"errors\": %d,\n  \"results\": [\n",
+          block_size, image_size, file_size, nfiles, error_count);
+  for (int i = 0; i < nresults; i++) {
+    struct bench_result *r = &results[i];
+    fprintf(out, "    {\"workload\": \"%s\", \"block_size\": %d, \"io_size\": %d, \"ops\": %ld, \"bytes\": %ld, "
+            "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f,\n", r->name, r->block_size, r->io_size,
+            r->ops, r->bytes, r->seconds, r->ops / r->seconds, r->bytes / r->seconds / (1024 * 1024));
+    fprintf(out, "     \"latency_us\": {\"p50\": %.2f, \"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f},\n",
+            percentile(r, 0.5), percentile(r, 0.99), percentile(r, 0.999),
+            r->nlat ? r->lat[r->nlat - 1] : 0.0);
+    fprintf(out, "     \"device\": {\"read_calls\": %lld, \"write_calls\": %lld, "
+            "\"blocks_read\": %lld, \"blocks_written\": %lld, \"seeks\": %lld, \"seek_distance\": %lld, "
+            "\"flushes\": %lld, \"syncs\": %lld, \"read_ms\": %.3f, \"write_ms\": %.3f, \"sync_ms\": %.3f}}%s\n",
+            (long long)r->io.read_calls, (long long)r->io.write_calls,
+            (long long)r->io.blocks_read, (long long)r->io.blocks_written, (long long)r->io.seeks,
+            (long long)r->io.seek_distance, (long long)r->io.flushes, (long long)r->io.syncs, r->io.read_ns / 1e6, r->io.write_ns / 1e6, r->io.sync_ns / 1e6,
+            i + 1 < nresults ? "," : "");
+  }
+  fprintf(out, "  ]\n}\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *json_path = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "w:b:i:f:n:s:o:")) != -1) {
+    switch (opt) {
+    case 'w':
+      selected = optarg;
+      break;
+    case 'b':
+      block_size = atoi(optarg);
+      break;
+    case 'i':
+      image_size = atol(optarg) * 1024 * 1024;
+      break;
+    case 'f':
+      file_size = atol(optarg) * 1024 * 1024;
+      break;
+    case 'n':
+      nfiles = atoi(optarg);
+      break;
+    case 's':
+      nio_sizes = 0;
+      for (char *p = optarg; p != NULL && nio_sizes < BENCH_MAX_IO_SIZES; p = strchr(p, ',')) {
+        p += *p == ',';
+        io_sizes[nio_sizes++] = atoi(p) * 1024;
+      }
+      break;
+    case 'o':
+      json_path = optarg;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-w workload,...] [-b block size] [-i image MB] [-f file MB] "
+              "[-n files] [-s I/O KB,...] [-o results.json | -o -]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  if (is_selected("seq_write") || is_selected("seq_read") || is_selected("rand_write") ||
+      is_selected("rand_read") || is_selected("mixed")) {
+    for (int i = 0; i < nio_sizes; i++) {
+      run_data(io_sizes[i]);
+    }
+  }
+  if (is_selected("create") || is_selected("stat") || is_selected("list") || is_selected("remove")) {
+    run_meta();
+  }
+  if (is_selected("ingest") || is_selected("ingest_async")) {
+    run_ingest();
+  }
+  if (is_selected("sweep")) {
+    run_sweep();
+  }
+
+  for (int i = 0; i < nresults; i++) {
+    qsort(results[i].lat, results[i].nlat, sizeof(double), compare_double);
+  }
+
+  if (json_path != NULL && strcmp(json_path, "-") == 0) {
+    print_json(stdout);
+  } else {
+    print_table(stdout);
+    if (json_path != NULL) {
+      FILE *out = fopen(json_path, "w");
+      if (out == NULL) {
+        fprintf(stderr, "ERROR: cannot write %s\n", json_path);
+        error_count++;
+      } else {
+        print_json(out);
+        fclose(out);
+      }
+    }
+  }
+
+  for (int i = 0; i < nresults; i++) {
+    free(results[i].lat);
+  }
+  fprintf(stderr, "Benchmark exiting with %d errors\n", error_count);
+  return error_count != 0;
+}
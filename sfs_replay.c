@@ -0,0 +1,298 @@
+/* sfs_replay.c
+ *
+ * Replays a trace recorded by sfs_trace_start on a fresh disk image with the
+ * geometry of the traced file system, as fast as possible or at the original
+ * timing (-t), then compares the latency of each kind of call with the trace.
+ *
+ * File descriptors and inodes are translated from the trace to the replay,
+ * so the replay does not depend on the allocation order. The data written is
+ * not in the trace: the writes replay a fixed pattern. A call whose result
+ * differs from the trace (a file not found, a short read...) is counted as
+ * a mismatch: the replay did not do the same work as the traced run.
+ *
+ * Usage: sfs_replay [-t] [-o image] <trace>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+
+#define REPLAY_MAX_MISMATCHES  10     /* printed mismatches */
+
+/* per kind of call */
+struct op_stats {
+  long calls;
+  long mismatches;
+  double traced_ns;
+  double replay_ns;
+};
+
+static struct op_stats stats[SFS_TRACE_NUM_OPS];
+
+/* trace file descriptor / inode -> replay file descriptor / inode */
+static int fd_map[SFS_MAX_FDENTRIES];
+static int *inode_map;
+static int num_inodes;
+
+static char *buffer;    /* data of the reads and writes */
+static int buffer_size;
+
+/* now() - returns a monotonic timestamp in ns
+ */
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int map_fd(int fd)
+{
+  return fd >= 0 && fd < SFS_MAX_FDENTRIES ? fd_map[fd] : fd;
+}
+
+static int map_inode(int inode_index)
+{
+  return inode_index >= 0 && inode_index < num_inodes ? inode_map[inode_index] : inode_index;
+}
+
+/* learn() - the trace result of a call returning a new descriptor or inode
+ * is the replay result from now on
+ */
+static void learn(int *map, int size, int64_t traced, int64_t result)
+{
+  if (traced >= 0 && traced < size && result >= 0) {
+    map[traced] = result;
+  }
+}
+
+/* data() - a buffer of at least len bytes (a non zero pattern, zeros
+ * would be written as holes)
+ */
+static char *data(int len)
+{
+  if (len > buffer_size) {
+    buffer = realloc(buffer, len);
+    for (int i = buffer_size; i < len; i++) {
+      buffer[i] = 'a' + i % 26;
+    }
+    buffer_size = len;
+  }
+  return buffer;
+}
+
+/* replay() - runs one traced call, returns its result
+ */
+static int64_t replay(sfs_trace_record *rec, char *name, char *name2)
+{
+  char fname[SFS_MAX_FILENAME + 1];
+  struct stat st;
+  struct statvfs stfs;
+  sfs_dir_cursor cursor;
+  struct iovec iov;
+  int64_t res = -1;
+  int fd = map_fd(rec->arg);
+  int inode_index = map_inode(rec->arg);
+  int len = rec->arg2 > 0 ? rec->arg2 : 0;
+
+  switch (rec->op) {
+  case SFS_TRACE_MKDIR:           return sfs_mkdir(name);
+  case SFS_TRACE_RMDIR:           return sfs_rmdir(name);
+  case SFS_TRACE_FOPEN:
+    res = sfs_fopen(name);
+    learn(fd_map, SFS_MAX_FDENTRIES, rec->result, res);
+    return res;
+  case SFS_TRACE_FOPEN_SHARED:
+    res = sfs_fopen_shared(name);
+    learn(fd_map, SFS_MAX_FDENTRIES, rec->result, res);
+    return res;
+  case SFS_TRACE_FCLOSE:          return sfs_fclose(fd);
+  case SFS_TRACE_FWRITE:          return sfs_fwrite(fd, data(len), len);
+  case SFS_TRACE_FREAD:           return sfs_fread(fd, data(len), len);
+  case SFS_TRACE_FSEEK:           return sfs_fseek(fd, rec->loc);
+  case SFS_TRACE_FTRUNCATE:       return sfs_ftruncate(fd, rec->loc);
+  case SFS_TRACE_PREAD:           return sfs_pread(fd, data(len), len, rec->loc);
+  case SFS_TRACE_PWRITE:          return sfs_pwrite(fd, data(len), len, rec->loc);
+  case SFS_TRACE_READV:
+  case SFS_TRACE_WRITEV:
+    iov.iov_base = data(len);
+    iov.iov_len = len;
+    return rec->op == SFS_TRACE_READV ? sfs_readv(fd, &iov, 1, rec->loc) : sfs_writev(fd, &iov, 1, rec->loc);
+  case SFS_TRACE_REMOVE:          return sfs_remove(name);
+  case SFS_TRACE_RENAME:          return sfs_rename(name, name2);
+  case SFS_TRACE_STAT:            return sfs_stat(name, &st);
+  case SFS_TRACE_GETFILESIZE:     return sfs_getfilesize(name);
+  case SFS_TRACE_ISDIR:           return sfs_isdir(name);
+  case SFS_TRACE_STATFS:          return sfs_statfs(&stfs);
+  case SFS_TRACE_GETNEXTFILENAME: return sfs_getnextfilename(fname);
+  case SFS_TRACE_GETDIRENTRY:     return sfs_getdirentry(name, rec->arg2, fname);
+  case SFS_TRACE_OPENDIR:         return sfs_opendir(name, &cursor);
+  case SFS_TRACE_READDIR_BATCH: {
+    sfs_dirent *entries = malloc((len + 1) * sizeof(sfs_dirent));
+    cursor.dir_inode = inode_index;
+    cursor.position = rec->loc;
+    res = sfs_readdir_batch(&cursor, entries, len);
+    free(entries);
+    return res;
+  }
+  case SFS_TRACE_ILOOKUP:
+    res = sfs_ilookup(inode_index, name);
+    learn(inode_map, num_inodes, rec->result, res);
+    return res;
+  case SFS_TRACE_IGETATTR:        return sfs_igetattr(inode_index, &st);
+  case SFS_TRACE_ICREATE:
+    res = sfs_icreate(inode_index, name, rec->arg2);
+    learn(inode_map, num_inodes, rec->result, res);
+    return res;
+  case SFS_TRACE_IUNLINK:         return sfs_iunlink(inode_index, name);
+  case SFS_TRACE_IRENAME:         return sfs_irename(inode_index, name, map_inode(rec->arg2), name2);
+  case SFS_TRACE_IREAD:           return sfs_iread(inode_index, data(len), len, rec->loc);
+  case SFS_TRACE_IWRITE:          return sfs_iwrite(inode_index, data(len), len, rec->loc);
+  case SFS_TRACE_ITRUNCATE:       return sfs_itruncate(inode_index, rec->loc);
+  case SFS_TRACE_ICLOSE:
+    sfs_iclose(inode_index);
+    return 0;
+  case SFS_TRACE_IGETDIRENTRY: {
+    int entry_inode;
+    return sfs_igetdirentry(inode_index, rec->arg2, fname, &entry_inode);
+  }
+  case SFS_TRACE_IOPENDIR:        return sfs_iopendir(inode_index, &cursor);
+  case SFS_TRACE_IMAP: {
+    int max_extents = len / SFS_MIN_BLOCK_SIZE + 2;
+    sfs_extent *extents = malloc(max_extents * sizeof(sfs_extent));
+    res = sfs_imap(inode_index, rec->loc, len, extents, max_extents);
+    free(extents);
+    return res;
+  }
+  case SFS_TRACE_FSYNC:           return sfs_fsync(fd);
+  case SFS_TRACE_FDATASYNC:       return sfs_fdatasync(fd);
+  case SFS_TRACE_SYNC:            return sfs_sync();
+  case SFS_TRACE_ISYNC:           return sfs_isync(inode_index, rec->arg2);
+  case SFS_TRACE_IHOLD:           return sfs_ihold(inode_index);
+  case SFS_TRACE_IFORGET:         return sfs_iforget(inode_index, rec->loc);
+  }
+  return res;
+}
+
+/* same_result() - compares a replay result with the trace, the descriptors
+ * and inodes only have to be both valid
+ */
+static int same_result(sfs_trace_record *rec, int64_t res)
+{
+  switch (rec->op) {
+  case SFS_TRACE_FOPEN:
+  case SFS_TRACE_FOPEN_SHARED:
+  case SFS_TRACE_ILOOKUP:
+  case SFS_TRACE_ICREATE:
+    return (rec->result >= 0) == (res >= 0);
+  }
+  return rec->result == res;
+}
+
+int
+main(int argc, char **argv)
+{
+  char *image = "replay.sfs";
+  int timed = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "to:")) != -1) {
+    if (opt == 't') {
+      timed = 1;
+    } else if (opt == 'o') {
+      image = optarg;
+    } else {
+      argc = 0;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: sfs_replay [-t] [-o image] <trace>\n");
+    return 2;
+  }
+
+  FILE *trace = fopen(argv[optind], "rb");
+  sfs_trace_header header;
+  if (trace == NULL || fread(&header, sizeof(header), 1, trace) != 1
+      || memcmp(header.magic, SFS_TRACE_MAGIC, sizeof(header.magic)) != 0) {
+    fprintf(stderr, "ERROR: %s is not a sfs trace\n", argv[optind]);
+    return 1;
+  }
+  if (sfs_mkfs(image, header.block_size, header.num_blocks, header.num_inodes) == -1) {
+    fprintf(stderr, "ERROR: cannot format %s\n", image);
+    return 1;
+  }
+
+  for (int i = 0; i < SFS_MAX_FDENTRIES; i++) {
+    fd_map[i] = i;
+  }
+  num_inodes = header.num_inodes;
+  inode_map = malloc(num_inodes * sizeof(int));
+  for (int i = 0; i < num_inodes; i++) {
+    inode_map[i] = i;
+  }
+
+  sfs_trace_record rec;
+  char *names = NULL;
+  long calls = 0, mismatches = 0;
+  uint64_t traced_end = 0;
+  double start = now();
+
+  while (fread(&rec, sizeof(rec), 1, trace) == 1) {
+    names = realloc(names, rec.name_len + 1);
+    if (rec.op >= SFS_TRACE_NUM_OPS || fread(names, 1, rec.name_len, trace) != rec.name_len) {
+      fprintf(stderr, "ERROR: truncated trace after %ld calls\n", calls);
+      break;
+    }
+    names[rec.name_len] = '\0';
+    char *name2 = names + strlen(names) + 1;
+    if (name2 > names + rec.name_len) {
+      name2 = NULL;
+    }
+
+    if (timed) {
+      double delay = start + rec.time - now();
+      if (delay > 0) {
+        struct timespec ts = { delay / 1e9, (long)delay % 1000000000 };
+        nanosleep(&ts, NULL);
+      }
+    }
+
+    double call_start = now();
+    int64_t res = replay(&rec, names, name2);
+    struct op_stats *op = &stats[rec.op];
+    op->replay_ns += now() - call_start;
+    op->traced_ns += rec.duration;
+    op->calls++;
+    calls++;
+    traced_end = rec.time + rec.duration;
+
+    if (!same_result(&rec, res)) {
+      if (mismatches++ < REPLAY_MAX_MISMATCHES) {
+        fprintf(stderr, "mismatch: call %ld %s(%d, %d, %ld, %s) returned %ld, traced %ld\n", calls,
+                sfs_op_name(rec.op), rec.arg, rec.arg2, (long)rec.loc, names, (long)res, (long)rec.result);
+      }
+      op->mismatches++;
+    }
+  }
+  double elapsed = now() - start;
+
+  printf("%-16s %10s %12s %12s %10s\n", "call", "calls", "traced_us", "replay_us", "mismatches");
+  for (int i = 0; i < SFS_TRACE_NUM_OPS; i++) {
+    if (stats[i].calls > 0) {
+      printf("%-16s %10ld %12.2f %12.2f %10ld\n", sfs_op_name(i), stats[i].calls, stats[i].traced_ns / stats[i].calls / 1000,
+             stats[i].replay_ns / stats[i].calls / 1000, stats[i].mismatches);
+    }
+  }
+  printf("%ld calls replayed in %.3f s (%.1f calls/s), traced run: %.3f s\n", calls, elapsed / 1e9,
+         calls / (elapsed / 1e9), traced_end / 1e9);
+
+  free(names);
+  free(inode_map);
+  free(buffer);
+  fclose(trace);
+  fprintf(stderr, "Replay exiting with %ld errors\n", mismatches);
+  return mismatches != 0;
+}
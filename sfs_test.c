@@ -5,6 +5,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include "sfs_api.h"
 
@@ -59,6 +61,32 @@ char *rand_name()
   return (strdup(fname));
 }
 
+/* Number of asynchronous writes failed in aio_write_next(). */
+static int aio_errors = 0;
+
+/* aio_write_next() - callback writing the rest of a buffer 50 bytes at a
+ * time: each write submits the next one a millisecond later (the file
+ * system is not busy meanwhile), the last one is left for sfs_reap().
+ * user_data counts the writes left.
+ */
+static void aio_write_next(sfs_aio_request *req)
+{
+  int *left = req->user_data;
+
+  if (req->result != req->length) {
+    aio_errors++;
+  }
+  req->buf += req->length;
+  req->loc += req->length;
+  if (--*left == 1) {
+    req->callback = NULL;
+  }
+  usleep(1000);
+  if (sfs_submit_write(req) != 0) {
+    aio_errors++;
+  }
+}
+
 /* The main testing program
  */
 int
@@ -376,6 +404,783 @@ main(int argc, char **argv)
     }
   }
 
+  /* Start over on an empty disk to test the directories: a path is walked
+   * from the root one name at a time, and can't go through a file.
+   */
+  mksfs(1);
+
+  if (sfs_mkdir("/dir") != 0 || sfs_mkdir("/dir/sub") != 0) {
+    fprintf(stderr, "ERROR: creating nested directories\n");
+    error_count++;
+  }
+  if (sfs_mkdir("/dir") == 0 || errno != EEXIST) {
+    fprintf(stderr, "ERROR: creating directory /dir twice\n");
+    error_count++;
+  }
+  if (sfs_mkdir("/nodir/sub") == 0 || errno != ENOENT) {
+    fprintf(stderr, "ERROR: creating directory in a missing directory\n");
+    error_count++;
+  }
+  if (sfs_isdir("/dir/sub") != 1 || sfs_isdir("/dir/nosub") != -1) {
+    fprintf(stderr, "ERROR: looking up directories in /dir\n");
+    error_count++;
+  }
+
+  fds[0] = sfs_fopen("/dir/sub/deep.txt");
+  if (fds[0] < 0) {
+    fprintf(stderr, "ERROR: creating file /dir/sub/deep.txt\n");
+    error_count++;
+  }
+  else {
+    sfs_fwrite(fds[0], test_str, strlen(test_str));
+    sfs_fclose(fds[0]);
+  }
+  if (sfs_getfilesize("/dir/sub/deep.txt") != strlen(test_str)) {
+    fprintf(stderr, "ERROR: size of /dir/sub/deep.txt\n");
+    error_count++;
+  }
+  if (sfs_getfilesize("/dir/deep.txt") != -1 || sfs_getfilesize("/deep.txt") != -1) {
+    fprintf(stderr, "ERROR: deep.txt found outside of /dir/sub\n");
+    error_count++;
+  }
+  if (sfs_fopen("/dir/sub/deep.txt/file") >= 0) {
+    fprintf(stderr, "ERROR: opened a file under a file\n");
+    error_count++;
+  }
+  if (sfs_mkdir("/dir/sub/deep.txt/dir") == 0 || errno != ENOTDIR) {
+    fprintf(stderr, "ERROR: created a directory under a file\n");
+    error_count++;
+  }
+  if (sfs_fopen("/dir/sub") >= 0 || errno != EISDIR) {
+    fprintf(stderr, "ERROR: opened directory /dir/sub as a file\n");
+    error_count++;
+  }
+  fds[0] = sfs_fopen("/dir/sub/deep.txt");
+  if (sfs_fopen("/dir/sub/deep.txt") >= 0 || errno != EBUSY) {
+    fprintf(stderr, "ERROR: opened /dir/sub/deep.txt twice\n");
+    error_count++;
+  }
+  sfs_fclose(fds[0]);
+  if (sfs_pread(fds[0], fixedbuf, 1, 0) != -1 || errno != EBADF ||
+      sfs_pwrite(fds[0], fixedbuf, 1, 0) != -1 || errno != EBADF ||
+      sfs_ftruncate(fds[0], 0) != -1 || errno != EBADF) {
+    fprintf(stderr, "ERROR: used closed descriptor %d\n", fds[0]);
+    error_count++;
+  }
+  if (sfs_getdirentry("/dir", 0, fixedbuf) != 1 || strcmp(fixedbuf, "sub") != 0 ||
+      sfs_getdirentry("/dir", 1, fixedbuf) == 1) {
+    fprintf(stderr, "ERROR: listing of /dir\n");
+    error_count++;
+  }
+  if (sfs_rmdir("/dir/sub") == 0 || errno != ENOTEMPTY) {
+    fprintf(stderr, "ERROR: removed non-empty directory /dir/sub\n");
+    error_count++;
+  }
+
+  /* The names must still be found once the directories are read back from
+   * the disk.
+   */
+  mksfs(0);
+
+  fds[0] = sfs_fopen("/dir/sub/deep.txt");
+  sfs_fseek(fds[0], 0);
+  if (sfs_fread(fds[0], fixedbuf, sizeof(fixedbuf)) != strlen(test_str) ||
+      memcmp(fixedbuf, test_str, strlen(test_str)) != 0) {
+    fprintf(stderr, "ERROR: reading /dir/sub/deep.txt back\n");
+    error_count++;
+  }
+  sfs_fclose(fds[0]);
+
+  /* Truncate a file in place: shrinking it into a tail then inline must
+   * keep the data before the new end and release the blocks past it,
+   * growing it must read back as zeros.
+   */
+  {
+  char data[5000];
+  char zeros[sizeof(fixedbuf)];
+  struct statvfs st;
+  int64_t bfree;
+
+  for (k = 0; k < sizeof(data); k++) {
+    data[k] = (char) (k % 251 + 1);
+  }
+  memset(zeros, 0, sizeof(zeros));
+  fds[0] = sfs_fopen("/dir/trunc.bin");
+  sfs_fwrite(fds[0], data, sizeof(data));
+  sfs_fclose(fds[0]);
+  sfs_statfs(&st);
+  bfree = st.f_bfree;
+
+  fds[0] = sfs_fopen("/dir/trunc.bin");
+  if (sfs_ftruncate(fds[0], 2500) != 0) {
+    fprintf(stderr, "ERROR: shrinking /dir/trunc.bin to 2500 bytes\n");
+    error_count++;
+  }
+  sfs_fclose(fds[0]);             /* The last 452 bytes become a tail. */
+  sfs_statfs(&st);
+  if (st.f_bfree <= bfree) {
+    fprintf(stderr, "ERROR: no block released by shrinking /dir/trunc.bin\n");
+    error_count++;
+  }
+  fds[0] = sfs_fopen("/dir/trunc.bin");
+  if (sfs_getfilesize("/dir/trunc.bin") != 2500 ||
+      sfs_pread(fds[0], fixedbuf, sizeof(fixedbuf), 2000) != 500 ||
+      memcmp(fixedbuf, data + 2000, 500) != 0) {
+    fprintf(stderr, "ERROR: reading /dir/trunc.bin shrunk to 2500 bytes\n");
+    error_count++;
+  }
+
+  if (sfs_ftruncate(fds[0], 50) != 0) {
+    fprintf(stderr, "ERROR: shrinking /dir/trunc.bin to 50 bytes\n");
+    error_count++;
+  }
+  if (sfs_getfilesize("/dir/trunc.bin") != 50 ||
+      sfs_pread(fds[0], fixedbuf, sizeof(fixedbuf), 0) != 50 ||
+      memcmp(fixedbuf, data, 50) != 0) {
+    fprintf(stderr, "ERROR: reading /dir/trunc.bin shrunk to 50 bytes\n");
+    error_count++;
+  }
+
+  /* Grow over a hole, then write past it. */
+  if (sfs_ftruncate(fds[0], 20000) != 0) {
+    fprintf(stderr, "ERROR: growing /dir/trunc.bin to 20000 bytes\n");
+    error_count++;
+  }
+  sfs_pwrite(fds[0], data, 100, 30000);
+  if (sfs_getfilesize("/dir/trunc.bin") != 30100) {
+    fprintf(stderr, "ERROR: size of /dir/trunc.bin after growing\n");
+    error_count++;
+  }
+  for (j = 50; j < 30000; j += readsize) {
+    chunksize = (30000 - j) < sizeof(fixedbuf) ? (30000 - j) : sizeof(fixedbuf);
+    readsize = sfs_pread(fds[0], fixedbuf, chunksize, j);
+    if (readsize <= 0 || memcmp(fixedbuf, zeros, readsize) != 0) {
+      fprintf(stderr, "ERROR: hole of /dir/trunc.bin not read as zeros at %d\n", j);
+      error_count++;
+      break;
+    }
+  }
+  if (sfs_pread(fds[0], fixedbuf, 100, 30000) != 100 || memcmp(fixedbuf, data, 100) != 0) {
+    fprintf(stderr, "ERROR: reading /dir/trunc.bin past the hole\n");
+    error_count++;
+  }
+  sfs_fclose(fds[0]);
+  }
+
+  /* Rename in the same directory, across directories and over an existing
+   * file (which is replaced); a directory can't be moved into itself.
+   */
+  {
+  struct statvfs st;
+  int64_t ffree;
+
+  if (sfs_rename("/dir/sub/deep.txt", "/dir/sub/moved.txt") != 0 ||
+      sfs_getfilesize("/dir/sub/deep.txt") != -1 ||
+      sfs_getfilesize("/dir/sub/moved.txt") != strlen(test_str)) {
+    fprintf(stderr, "ERROR: renaming /dir/sub/deep.txt in its directory\n");
+    error_count++;
+  }
+  if (sfs_rename("/dir/sub/moved.txt", "/top.txt") != 0 ||
+      sfs_getfilesize("/dir/sub/moved.txt") != -1 ||
+      sfs_getfilesize("/top.txt") != strlen(test_str)) {
+    fprintf(stderr, "ERROR: moving /dir/sub/moved.txt to /top.txt\n");
+    error_count++;
+  }
+
+  fds[0] = sfs_fopen("/dir/other.txt");
+  sfs_fwrite(fds[0], "other", 5);
+  sfs_fclose(fds[0]);
+  sfs_statfs(&st);
+  ffree = st.f_ffree;
+  if (sfs_rename("/top.txt", "/dir/other.txt") != 0 ||
+      sfs_getfilesize("/top.txt") != -1) {
+    fprintf(stderr, "ERROR: moving /top.txt over /dir/other.txt\n");
+    error_count++;
+  }
+  fds[0] = sfs_fopen("/dir/other.txt");
+  if (sfs_pread(fds[0], fixedbuf, sizeof(fixedbuf), 0) != strlen(test_str) ||
+      memcmp(fixedbuf, test_str, strlen(test_str)) != 0) {
+    fprintf(stderr, "ERROR: /dir/other.txt was not replaced\n");
+    error_count++;
+  }
+  sfs_fclose(fds[0]);
+  sfs_statfs(&st);
+  if (st.f_ffree != ffree + 1) {
+    fprintf(stderr, "ERROR: inode of the replaced file not released\n");
+    error_count++;
+  }
+
+  /* Replace a file still opened: its descriptor keeps the old file until
+   * it is closed, the name gives the new one.
+   */
+  fds[0] = sfs_fopen("/dir/live.txt");
+  sfs_fwrite(fds[0], "old", 3);
+  fds[1] = sfs_fopen("/dir/live.tmp");
+  sfs_fwrite(fds[1], test_str, strlen(test_str));
+  sfs_fclose(fds[1]);
+  sfs_statfs(&st);
+  ffree = st.f_ffree;
+  if (sfs_rename("/dir/live.tmp", "/dir/live.txt") != 0) {
+    fprintf(stderr, "ERROR: moving /dir/live.tmp over the opened /dir/live.txt\n");
+    error_count++;
+  }
+  if (sfs_pwrite(fds[0], "stale", 5, 3) != 5 ||
+      sfs_pread(fds[0], fixedbuf, sizeof(fixedbuf), 0) != 8 ||
+      memcmp(fixedbuf, "oldstale", 8) != 0) {
+    fprintf(stderr, "ERROR: writing to the replaced /dir/live.txt\n");
+    error_count++;
+  }
+  fds[1] = sfs_fopen("/dir/live.txt");
+  if (sfs_pread(fds[1], fixedbuf, sizeof(fixedbuf), 0) != strlen(test_str) ||
+      memcmp(fixedbuf, test_str, strlen(test_str)) != 0) {
+    fprintf(stderr, "ERROR: /dir/live.txt changed by the descriptor of the old file\n");
+    error_count++;
+  }
+  sfs_fclose(fds[1]);
+  sfs_statfs(&st);
+  if (st.f_ffree != ffree) {
+    fprintf(stderr, "ERROR: inode of the opened file released by the rename\n");
+    error_count++;
+  }
+  sfs_fclose(fds[0]);
+  sfs_statfs(&st);
+  if (st.f_ffree != ffree + 1) {
+    fprintf(stderr, "ERROR: inode of the replaced file not released by its close\n");
+    error_count++;
+  }
+
+  if (sfs_rename("/dir", "/dir/sub/dir") == 0 || errno != EINVAL ||
+      sfs_isdir("/dir/sub") != 1) {
+    fprintf(stderr, "ERROR: moved /dir into its own subdirectory\n");
+    error_count++;
+  }
+  if (sfs_rename("/dir/sub", "/sub") != 0 || sfs_isdir("/sub") != 1 ||
+      sfs_isdir("/dir/sub") != -1) {
+    fprintf(stderr, "ERROR: moving directory /dir/sub to /sub\n");
+    error_count++;
+  }
+  }
+
+  /* A file stays in its inode up to SFS_INLINE_SIZE bytes: one more byte
+   * moves it to a data block, and truncating it back keeps the data.
+   */
+  {
+  char data[SFS_INLINE_SIZE + 1];
+  struct statvfs st;
+  int64_t bfree;
+
+  for (k = 0; k < sizeof(data); k++) {
+    data[k] = (char) (k + 1);
+  }
+  sfs_statfs(&st);
+  bfree = st.f_bfree;
+  fds[0] = sfs_fopen("/dir/inline.bin");
+  if (sfs_fwrite(fds[0], data, SFS_INLINE_SIZE - 1) != SFS_INLINE_SIZE - 1 ||
+      sfs_fwrite(fds[0], data + SFS_INLINE_SIZE - 1, 1) != 1) {
+    fprintf(stderr, "ERROR: writing /dir/inline.bin up to %d bytes\n", (int)SFS_INLINE_SIZE);
+    error_count++;
+  }
+  sfs_statfs(&st);
+  if (st.f_bfree != bfree) {
+    fprintf(stderr, "ERROR: block allocated for the %d bytes of /dir/inline.bin\n",
+            (int)SFS_INLINE_SIZE);
+    error_count++;
+  }
+  if (sfs_pread(fds[0], fixedbuf, sizeof(fixedbuf), 0) != SFS_INLINE_SIZE ||
+      memcmp(fixedbuf, data, SFS_INLINE_SIZE) != 0) {
+    fprintf(stderr, "ERROR: reading /dir/inline.bin inline\n");
+    error_count++;
+  }
+
+  if (sfs_fwrite(fds[0], data + SFS_INLINE_SIZE, 1) != 1) {
+    fprintf(stderr, "ERROR: writing /dir/inline.bin past the inode\n");
+    error_count++;
+  }
+  sfs_statfs(&st);
+  if (st.f_bfree != bfree - 1) {
+    fprintf(stderr, "ERROR: no block allocated for the %d bytes of /dir/inline.bin\n",
+            (int)sizeof(data));
+    error_count++;
+  }
+  if (sfs_getfilesize("/dir/inline.bin") != sizeof(data) ||
+      sfs_pread(fds[0], fixedbuf, sizeof(fixedbuf), 0) != sizeof(data) ||
+      memcmp(fixedbuf, data, sizeof(data)) != 0) {
+    fprintf(stderr, "ERROR: reading /dir/inline.bin out of the inode\n");
+    error_count++;
+  }
+
+  for (k = SFS_INLINE_SIZE; k >= SFS_INLINE_SIZE - 1; k--) {
+    if (sfs_ftruncate(fds[0], k) != 0 ||
+        sfs_getfilesize("/dir/inline.bin") != k ||
+        sfs_pread(fds[0], fixedbuf, sizeof(fixedbuf), 0) != k ||
+        memcmp(fixedbuf, data, k) != 0) {
+      fprintf(stderr, "ERROR: /dir/inline.bin truncated to %d bytes\n", k);
+      error_count++;
+    }
+  }
+  sfs_fclose(fds[0]);
+  mksfs(0);
+  fds[0] = sfs_fopen("/dir/inline.bin");
+  if (sfs_pread(fds[0], fixedbuf, sizeof(fixedbuf), 0) != SFS_INLINE_SIZE - 1 ||
+      memcmp(fixedbuf, data, SFS_INLINE_SIZE - 1) != 0) {
+    fprintf(stderr, "ERROR: reading /dir/inline.bin back\n");
+    error_count++;
+  }
+  sfs_fclose(fds[0]);
+  sfs_remove("/dir/inline.bin");
+  }
+
+  /* The tails of small files are packed in the same fragment block:
+   * removing one of them, then appending to and truncating the others must
+   * leave the bytes of the rest alone (the append reuses the removed slots,
+   * in front of the other tails).
+   */
+  {
+  char tails[4][SFS_API_BLOCK_SIZE + 100];
+  char path[32];
+  int tailsize[4];
+  int64_t frag_block = -1;
+  struct stat st;
+  sfs_extent ext;
+
+  sfs_sync();                   /* Slots freed so far can be reused. */
+  for (i = 0; i < 4; i++) {
+    for (k = 0; k < sizeof(tails[i]); k++) {
+      tails[i][k] = (char) (k % 251 + 64 * i);
+    }
+    tailsize[i] = SFS_API_BLOCK_SIZE + 68 - 16 * i;
+    sprintf(path, "/dir/tail%d.txt", i);
+    fds[i] = sfs_fopen(path);
+    sfs_fwrite(fds[i], tails[i], tailsize[i]);
+    sfs_fclose(fds[i]);
+    if (sfs_stat(path, &st) != 0 ||
+        sfs_imap(st.st_ino, tailsize[i] - 1, 1, &ext, 1) != 1 ||
+        (frag_block != -1 && ext.disk_offset / SFS_API_BLOCK_SIZE != frag_block)) {
+      fprintf(stderr, "ERROR: tail of %s not packed with the others\n", path);
+      error_count++;
+    }
+    frag_block = ext.disk_offset / SFS_API_BLOCK_SIZE;
+  }
+
+  if (sfs_remove("/dir/tail0.txt") != 1) {
+    fprintf(stderr, "ERROR: removing /dir/tail0.txt\n");
+    error_count++;
+  }
+  sfs_sync();
+  fds[3] = sfs_fopen("/dir/tail3.txt");
+  if (sfs_pwrite(fds[3], tails[3] + tailsize[3], 30, tailsize[3]) != 30) {
+    fprintf(stderr, "ERROR: appending to /dir/tail3.txt\n");
+    error_count++;
+  }
+  tailsize[3] += 30;
+  sfs_fclose(fds[3]);
+  fds[2] = sfs_fopen("/dir/tail2.txt");
+  if (sfs_ftruncate(fds[2], SFS_API_BLOCK_SIZE + 10) != 0) {
+    fprintf(stderr, "ERROR: truncating /dir/tail2.txt\n");
+    error_count++;
+  }
+  tailsize[2] = SFS_API_BLOCK_SIZE + 10;
+  sfs_fclose(fds[2]);
+
+  for (j = 0; j < 2; j++) {
+    for (i = 1; i < 4; i++) {
+      sprintf(path, "/dir/tail%d.txt", i);
+      fds[i] = sfs_fopen(path);
+      if (sfs_pread(fds[i], tails[0], sizeof(tails[0]), 0) != tailsize[i] ||
+          memcmp(tails[0], tails[i], tailsize[i]) != 0) {
+        fprintf(stderr, "ERROR: reading %s%s\n", path, j ? " back" : "");
+        error_count++;
+      }
+      sfs_fclose(fds[i]);
+    }
+    if (j == 0) {
+      mksfs(0);
+    }
+  }
+  for (i = 1; i < 4; i++) {
+    sprintf(path, "/dir/tail%d.txt", i);
+    sfs_remove(path);
+  }
+  }
+
+  /* Writing past the end of a file leaves a hole: it reads back as zeros,
+   * and only the blocks written to (and the indirect block mapping the
+   * last one) are allocated.
+   */
+  {
+  char data[100];
+  char zeros[SFS_API_BLOCK_SIZE];
+  struct statvfs st;
+  int64_t bfree;
+
+  for (k = 0; k < sizeof(data); k++) {
+    data[k] = (char) (k + 1);
+  }
+  memset(zeros, 0, sizeof(zeros));
+  sfs_statfs(&st);
+  bfree = st.f_bfree;
+  fds[0] = sfs_fopen("/dir/sparse.bin");
+  sfs_fseek(fds[0], 10 * SFS_API_BLOCK_SIZE);
+  if (sfs_fwrite(fds[0], data, sizeof(data)) != sizeof(data)) {
+    fprintf(stderr, "ERROR: writing past the end of /dir/sparse.bin\n");
+    error_count++;
+  }
+  sfs_statfs(&st);
+  if (st.f_bfree != bfree - 1) {
+    fprintf(stderr, "ERROR: %lld blocks allocated for one block of /dir/sparse.bin\n",
+            (long long)(bfree - st.f_bfree));
+    error_count++;
+  }
+  if (sfs_pwrite(fds[0], data, sizeof(data), 100 * SFS_API_BLOCK_SIZE) != sizeof(data)) {
+    fprintf(stderr, "ERROR: writing far past the end of /dir/sparse.bin\n");
+    error_count++;
+  }
+  sfs_statfs(&st);
+  if (st.f_bfree != bfree - 3) {
+    fprintf(stderr, "ERROR: %lld blocks allocated for two blocks of /dir/sparse.bin\n",
+            (long long)(bfree - st.f_bfree));
+    error_count++;
+  }
+  if (sfs_getfilesize("/dir/sparse.bin") != 100 * SFS_API_BLOCK_SIZE + sizeof(data)) {
+    fprintf(stderr, "ERROR: size of /dir/sparse.bin\n");
+    error_count++;
+  }
+
+  for (j = 0; j <= 100; j++) {
+    readsize = sfs_pread(fds[0], fixedbuf, SFS_API_BLOCK_SIZE, (int64_t)j * SFS_API_BLOCK_SIZE);
+    if (j == 10 || j == 100) {
+      tmp = readsize != (j == 100 ? sizeof(data) : SFS_API_BLOCK_SIZE) ||
+            memcmp(fixedbuf, data, sizeof(data)) != 0 ||
+            memcmp(fixedbuf + sizeof(data), zeros, readsize - sizeof(data)) != 0;
+    }
+    else {
+      tmp = readsize != SFS_API_BLOCK_SIZE || memcmp(fixedbuf, zeros, readsize) != 0;
+    }
+    if (tmp) {
+      fprintf(stderr, "ERROR: block %d of /dir/sparse.bin\n", j);
+      error_count++;
+      break;
+    }
+  }
+  sfs_fclose(fds[0]);
+  sfs_remove("/dir/sparse.bin");
+  }
+
+  /* Positioned and vectored I/O: sfs_pread, sfs_pwrite, sfs_readv and
+   * sfs_writev use their own offset and leave the file position alone, a
+   * read past the end is short, and the buffers of one call are split
+   * across block boundaries in order.
+   */
+  {
+  char data[3000];
+  char vdata[1800];
+  char rbuf[3000];
+  struct iovec iov[3];
+
+  for (k = 0; k < sizeof(data); k++) {
+    data[k] = (char) (k % 251 + 1);
+  }
+  for (k = 0; k < sizeof(vdata); k++) {
+    vdata[k] = (char) (k % 13 + 'a');
+  }
+  fds[0] = sfs_fopen("/dir/vec.bin");
+  sfs_fwrite(fds[0], data, 100);
+  if (sfs_pwrite(fds[0], data + 200, 2800, 200) != 2800 ||
+      sfs_pwrite(fds[0], data + 100, 100, 100) != 100) {
+    fprintf(stderr, "ERROR: sfs_pwrite to /dir/vec.bin\n");
+    error_count++;
+  }
+  if (sfs_fread(fds[0], rbuf, 50) != 50 || memcmp(rbuf, data + 100, 50) != 0) {
+    fprintf(stderr, "ERROR: file position moved by sfs_pwrite\n");
+    error_count++;
+  }
+  if (sfs_pread(fds[0], rbuf, 1000, 900) != 1000 || memcmp(rbuf, data + 900, 1000) != 0) {
+    fprintf(stderr, "ERROR: sfs_pread across a block boundary\n");
+    error_count++;
+  }
+  if (sfs_fread(fds[0], rbuf, 50) != 50 || memcmp(rbuf, data + 150, 50) != 0) {
+    fprintf(stderr, "ERROR: file position moved by sfs_pread\n");
+    error_count++;
+  }
+
+  if (sfs_pread(fds[0], rbuf, 1000, 2500) != 500 || memcmp(rbuf, data + 2500, 500) != 0 ||
+      sfs_pread(fds[0], rbuf, 1000, 3000) != 0 ||
+      sfs_pread(fds[0], rbuf, 1000, 5000) != 0) {
+    fprintf(stderr, "ERROR: sfs_pread at the end of /dir/vec.bin\n");
+    error_count++;
+  }
+  iov[0].iov_base = rbuf;
+  iov[0].iov_len = 8;
+  iov[1].iov_base = rbuf + 8;
+  iov[1].iov_len = 8;
+  if (sfs_readv(fds[0], iov, 2, 2990) != 10 || memcmp(rbuf, data + 2990, 10) != 0) {
+    fprintf(stderr, "ERROR: sfs_readv at the end of /dir/vec.bin\n");
+    error_count++;
+  }
+
+  /* 900..1000, 1000..2500 and 2500..2700 cross two block boundaries. */
+  iov[0].iov_base = vdata;
+  iov[0].iov_len = 100;
+  iov[1].iov_base = vdata + 100;
+  iov[1].iov_len = 1500;
+  iov[2].iov_base = vdata + 1600;
+  iov[2].iov_len = 200;
+  if (sfs_writev(fds[0], iov, 3, 900) != sizeof(vdata)) {
+    fprintf(stderr, "ERROR: sfs_writev to /dir/vec.bin\n");
+    error_count++;
+  }
+  memset(rbuf, 0, sizeof(rbuf));
+  iov[0].iov_base = rbuf;
+  iov[0].iov_len = 700;
+  iov[1].iov_base = rbuf + 700;
+  iov[1].iov_len = 50;
+  iov[2].iov_base = rbuf + 750;
+  iov[2].iov_len = 1250;
+  if (sfs_readv(fds[0], iov, 3, 899) != 2000 || rbuf[0] != data[899] ||
+      memcmp(rbuf + 1, vdata, sizeof(vdata)) != 0 ||
+      memcmp(rbuf + 1 + sizeof(vdata), data + 900 + sizeof(vdata), 199) != 0) {
+    fprintf(stderr, "ERROR: sfs_readv of the buffers written by sfs_writev\n");
+    error_count++;
+  }
+  if (sfs_fread(fds[0], rbuf, 50) != 50 || memcmp(rbuf, data + 200, 50) != 0) {
+    fprintf(stderr, "ERROR: file position moved by sfs_readv or sfs_writev\n");
+    error_count++;
+  }
+
+  iov[0].iov_base = vdata;
+  iov[0].iov_len = 10;
+  iov[1].iov_base = vdata + 10;
+  iov[1].iov_len = 20;
+  if (sfs_writev(fds[0], iov, 2, 3000) != 30 ||
+      sfs_getfilesize("/dir/vec.bin") != 3030 ||
+      sfs_pread(fds[0], rbuf, sizeof(rbuf), 2990) != 40 ||
+      memcmp(rbuf, data + 2990, 10) != 0 || memcmp(rbuf + 10, vdata, 30) != 0) {
+    fprintf(stderr, "ERROR: sfs_writev past the end of /dir/vec.bin\n");
+    error_count++;
+  }
+  sfs_fclose(fds[0]);
+  sfs_remove("/dir/vec.bin");
+  }
+
+  /* A directory listed in batches while entries are added and removed
+   * between them: the entries there from start to end are returned exactly
+   * once, an entry removed before being reached is not returned, and an
+   * added one at most once.
+   */
+  {
+  sfs_dir_cursor cursor;
+  sfs_dirent entries[5];
+  char path[32];
+  char name[SFS_MAX_FILENAME + 1];
+  int seen[20];
+  int gone[20];
+  int seen_added[6];
+  int batches = 0;
+
+  sfs_mkdir("/list");
+  for (i = 0; i < 20; i++) {
+    sprintf(path, "/list/f%02d.txt", i);
+    fds[0] = sfs_fopen(path);
+    sfs_fclose(fds[0]);
+    seen[i] = 0;
+    gone[i] = 0;
+  }
+  memset(seen_added, 0, sizeof(seen_added));
+  sfs_opendir("/list", &cursor);
+  while ((k = sfs_readdir_batch(&cursor, entries, 5)) > 0) {
+    for (j = 0; j < k; j++) {
+      if (sscanf(entries[j].name, "f%d.txt", &i) == 1 && i >= 0 && i < 20) {
+        seen[i]++;
+      }
+      else if (sscanf(entries[j].name, "n%d.txt", &i) == 1 && i >= 0 && i < 6) {
+        seen_added[i]++;
+      }
+    }
+    if (batches < 3) {
+      /* One entry just returned and one not reached yet go, two come. */
+      sprintf(path, "/list/%s", entries[0].name);
+      sfs_remove(path);
+      sprintf(path, "/list/f%02d.txt", 15 + batches);
+      sfs_remove(path);
+      gone[15 + batches] = 1;
+      for (i = 2 * batches; i < 2 * batches + 2; i++) {
+        sprintf(path, "/list/n%d.txt", i);
+        fds[0] = sfs_fopen(path);
+        sfs_fclose(fds[0]);
+      }
+    }
+    batches++;
+  }
+  for (i = 0; i < 20; i++) {
+    if (seen[i] != (gone[i] ? 0 : 1)) {
+      fprintf(stderr, "ERROR: /list/f%02d.txt listed %d times\n", i, seen[i]);
+      error_count++;
+    }
+  }
+  for (i = 0; i < 6; i++) {
+    if (seen_added[i] > 1) {
+      fprintf(stderr, "ERROR: /list/n%d.txt listed %d times\n", i, seen_added[i]);
+      error_count++;
+    }
+  }
+
+  while (sfs_getdirentry("/list", 0, name) == 1) {
+    sprintf(path, "/list/%s", name);
+    sfs_remove(path);
+  }
+  if (sfs_rmdir("/list") != 0) {
+    fprintf(stderr, "ERROR: removing /list once emptied\n");
+    error_count++;
+  }
+  }
+
+  /* A missing name is remembered by the negative dentry cache: creating,
+   * renaming or removing an entry must update both caches, so the next
+   * lookup sees the change.
+   */
+  {
+  struct stat st;
+  sfs_statistics before, after;
+
+  if (sfs_stat("/dir/neg.txt", &st) == 0 || errno != ENOENT) {
+    fprintf(stderr, "ERROR: found the missing /dir/neg.txt\n");
+    error_count++;
+  }
+  sfs_stats(&before);
+  sfs_stat("/dir/neg.txt", &st);
+  sfs_stats(&after);
+  if (after.ncache_hits != before.ncache_hits + 1) {
+    fprintf(stderr, "ERROR: missing /dir/neg.txt not in the negative dentry cache\n");
+    error_count++;
+  }
+
+  fds[0] = sfs_fopen("/dir/neg.txt");
+  sfs_fwrite(fds[0], test_str, strlen(test_str));
+  sfs_fclose(fds[0]);
+  if (sfs_stat("/dir/neg.txt", &st) != 0 || st.st_size != strlen(test_str)) {
+    fprintf(stderr, "ERROR: /dir/neg.txt not found once created\n");
+    error_count++;
+  }
+
+  sfs_stat("/dir/neg2.txt", &st);
+  if (sfs_rename("/dir/neg.txt", "/dir/neg2.txt") != 0 ||
+      sfs_stat("/dir/neg.txt", &st) == 0 || errno != ENOENT ||
+      sfs_stat("/dir/neg2.txt", &st) != 0 || st.st_size != strlen(test_str)) {
+    fprintf(stderr, "ERROR: lookups after renaming /dir/neg.txt to /dir/neg2.txt\n");
+    error_count++;
+  }
+
+  if (sfs_remove("/dir/neg2.txt") != 1 ||
+      sfs_stat("/dir/neg2.txt", &st) == 0 || errno != ENOENT) {
+    fprintf(stderr, "ERROR: /dir/neg2.txt found once removed\n");
+    error_count++;
+  }
+  fds[0] = sfs_fopen("/dir/neg2.txt");
+  sfs_fclose(fds[0]);
+  if (sfs_getfilesize("/dir/neg2.txt") != 0) {
+    fprintf(stderr, "ERROR: /dir/neg2.txt created again is not empty\n");
+    error_count++;
+  }
+  sfs_remove("/dir/neg2.txt");
+  }
+
+  /* Asynchronous reads and writes: every request completes with the result
+   * of its call. The requests still queued when the file system is mounted
+   * again are run first.
+   */
+  {
+  sfs_aio_request reqs[MAX_FD];
+  sfs_aio_request *done[MAX_FD];
+  int left[MAX_FD];
+  char wbuf[MAX_FD][3000];
+  char rbuf[MAX_FD][3000];
+
+  for (i = 0; i < MAX_FD; i++) {
+    names[i] = rand_name();
+    fds[i] = sfs_fopen(names[i]);
+    for (j = 0; j < sizeof(wbuf[i]); j++) {
+      wbuf[i][j] = 'A' + (i + j) % 26;
+    }
+    memset(&reqs[i], 0, sizeof(sfs_aio_request));
+    reqs[i].fileID = fds[i];
+    reqs[i].buf = wbuf[i];
+    reqs[i].length = 1500 + i;
+    if (sfs_submit_write(&reqs[i]) != 0) {
+      fprintf(stderr, "ERROR: submitting a write to %s\n", names[i]);
+      error_count++;
+    }
+  }
+  k = sfs_reap(done, MAX_FD, MAX_FD);
+  if (k != MAX_FD) {
+    fprintf(stderr, "ERROR: %d of %d writes completed\n", k, MAX_FD);
+    error_count++;
+  }
+  for (i = 0; i < k; i++) {
+    if (done[i]->result != done[i]->length) {
+      fprintf(stderr, "ERROR: write of %d bytes returned %d\n", done[i]->length, done[i]->result);
+      error_count++;
+    }
+  }
+
+  for (i = 0; i < MAX_FD; i++) {
+    reqs[i].buf = rbuf[i];
+    reqs[i].length = sizeof(rbuf[i]);
+    if (sfs_submit_read(&reqs[i]) != 0) {
+      fprintf(stderr, "ERROR: submitting a read of %s\n", names[i]);
+      error_count++;
+    }
+  }
+  k = sfs_reap(done, MAX_FD, MAX_FD);
+  if (k != MAX_FD) {
+    fprintf(stderr, "ERROR: %d of %d reads completed\n", k, MAX_FD);
+    error_count++;
+  }
+  for (i = 0; i < k; i++) {
+    j = done[i] - reqs;
+    if (done[i]->result != 1500 + j || memcmp(rbuf[j], wbuf[j], 1500 + j) != 0) {
+      fprintf(stderr, "ERROR: asynchronous read of %s\n", names[j]);
+      error_count++;
+    }
+  }
+
+  /* Append past the first writes, 50 bytes per request, and remount
+   * while they are still running.
+   */
+  for (i = 0; i < MAX_FD; i++) {
+    left[i] = 20;
+    reqs[i].buf = wbuf[i] + 1500 + i;
+    reqs[i].length = 50;
+    reqs[i].loc = 1500 + i;
+    reqs[i].callback = aio_write_next;
+    reqs[i].user_data = &left[i];
+    sfs_submit_write(&reqs[i]);
+  }
+  mksfs(0);
+  k = sfs_reap(done, 0, MAX_FD);
+  if (k != MAX_FD || aio_errors != 0) {
+    fprintf(stderr, "ERROR: %d of %d appends completed before the mount, %d failed\n",
+            k, MAX_FD, aio_errors);
+    error_count++;
+  }
+  for (i = 0; i < k; i++) {
+    if (done[i]->result != 50) {
+      fprintf(stderr, "ERROR: write of 50 bytes returned %d\n", done[i]->result);
+      error_count++;
+    }
+  }
+  for (i = 0; i < MAX_FD; i++) {
+    fds[i] = sfs_fopen(names[i]);
+    if (sfs_pread(fds[i], rbuf[i], sizeof(rbuf[i]), 0) != 2500 + i ||
+        memcmp(rbuf[i], wbuf[i], 2500 + i) != 0) {
+      fprintf(stderr, "ERROR: %s after the queued writes\n", names[i]);
+      error_count++;
+    }
+    sfs_fclose(fds[i]);
+    sfs_remove(names[i]);
+    free(names[i]);
+  }
+  }
+
   fprintf(stderr, "Test program exiting with %d errors\n", error_count);
   return (error_count);
 }
@@ -5,6 +5,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include "sfs_api.h"
 
@@ -27,6 +29,10 @@
 #define MAX_BYTES 30000 /* Maximum file size I'll try to create */
 #define MIN_BYTES 10000         /* Minimum file size */
 
+/* The disk image of the journal crash tests.
+ */
+#define JOURNAL_TEST_FILENAME "journal_test.sfs"
+
 /* Just a random test string.
  */
 static char test_str[] = "The quick brown fox jumps over the lazy dog.\n";
@@ -59,6 +65,71 @@ char *rand_name()
   return (strdup(fname));
 }
 
+/* journal_last_txn() - find the last transaction of the journal of a disk
+ * image, the way the mount replays it: from the second block of the
+ * journal, while the sequence numbers follow.
+ *
+ * The return value is the position of its first block in the image file,
+ * or -1 if the journal is empty; its length in bytes is put in *bytes.
+ */
+long journal_last_txn(FILE *fp, int64_t *bytes)
+{
+  superblock sb;
+  journal_txn txn;
+  int64_t head = 0, seq;
+  long last = -1;
+
+  fseek(fp, 0, SEEK_SET);
+  fread(&sb, sizeof(sb), 1, fp);
+  fseek(fp, sb.journal_start * sb.block_size, SEEK_SET);
+  fread(&txn, sizeof(txn), 1, fp);
+  seq = txn.seq;
+  while (txn.magic == SFS_JOURNAL_MAGIC && 1 + head < sb.journal_len) {
+    fseek(fp, (sb.journal_start + 1 + head) * sb.block_size, SEEK_SET);
+    fread(&txn, sizeof(txn), 1, fp);
+    if (txn.magic != SFS_JOURNAL_MAGIC || txn.seq != seq || txn.nblocks <= 0) {
+      break;
+    }
+    last = (sb.journal_start + 1 + head) * sb.block_size;
+    *bytes = txn.bytes;
+    head += txn.nblocks;
+    seq++;
+  }
+  return (last);
+}
+
+/* journal_check_files() - check the files written by the journal tests.
+ *
+ * Each file /jd/fN holds N * 1000 + 7 bytes of (char)(offset + N). The
+ * return value is the number of errors found.
+ */
+int journal_check_files(int nfiles)
+{
+  char fname[32];
+  char buf[MAX_BYTES];
+  int i, k, fd, n;
+  int errors = 0;
+
+  for (i = 0; i < nfiles; i++) {
+    sprintf(fname, "/jd/f%d", i);
+    fd = sfs_fopen(fname);
+    n = sfs_pread(fd, buf, sizeof(buf), 0);
+    if (fd < 0 || n != i * 1000 + 7 || sfs_getfilesize(fname) != n) {
+      fprintf(stderr, "ERROR: %s has %d bytes after the crash\n", fname, n);
+      errors++;
+    }
+    for (k = 0; k < n; k++) {
+      if (buf[k] != (char)(k + i)) {
+        fprintf(stderr, "ERROR: data error at offset %d in %s after the crash\n", k, fname);
+        errors++;
+        break;
+      }
+    }
+    sfs_fclose(fd);
+  }
+  return (errors);
+}
+
 /* The main testing program
  */
 int
@@ -425,6 +496,145 @@ main(int argc, char **argv)
 	  error_count++;
   }
  
+  /* Crash tests of the metadata journal. A child process writes files,
+   * makes them durable and exits without releasing the file system: the
+   * changes are only in the journal, the mount must replay them.
+   */
+  {
+  int pipefd[2];
+  int64_t bfree, bytes;
+  long txn_pos;
+  char *journal;
+  size_t journal_size;
+  superblock sb;
+  struct statvfs st;
+  FILE *fp;
+
+  pipe(pipefd);
+  if (fork() == 0) {
+    sfs_mkfs(JOURNAL_TEST_FILENAME, 1024, 4096, 64);
+    sfs_mkdir("/jd");
+    for (i = 0; i < 8; i++) {
+      if ((buffer = malloc(i * 1000 + 7)) == NULL) {
+        fprintf(stderr, "ABORT: Out of memory!\n");
+        _exit(-1);
+      }
+      for (k = 0; k < i * 1000 + 7; k++) {
+        buffer[k] = (char)(k + i);
+      }
+      sprintf(fixedbuf, "/jd/f%d", i);
+      fds[0] = sfs_fopen(fixedbuf);
+      sfs_fwrite(fds[0], buffer, i * 1000 + 7);
+      sfs_fclose(fds[0]);
+      free(buffer);
+    }
+    sfs_remove("/jd/f7");
+    sfs_sync();
+    sfs_statfs(&st);
+    bfree = st.f_bfree;
+    write(pipefd[1], &bfree, sizeof(bfree));
+    _exit(0);
+  }
+  read(pipefd[0], &bfree, sizeof(bfree));
+  wait(NULL);
+
+  fp = fopen(JOURNAL_TEST_FILENAME, "r+b");
+  if (journal_last_txn(fp, &bytes) == -1) {
+    fprintf(stderr, "ERROR: nothing to replay in the journal after the crash\n");
+    error_count++;
+  }
+  fseek(fp, 0, SEEK_SET);
+  fread(&sb, sizeof(sb), 1, fp);
+  journal_size = sb.journal_len * sb.block_size;
+  journal = malloc(journal_size);
+  fseek(fp, sb.journal_start * sb.block_size, SEEK_SET);
+  fread(journal, journal_size, 1, fp);
+  fclose(fp);
+
+  /* Replay after the interrupted process, then replay the same journal
+   * over the disk it was already applied to.
+   */
+  for (j = 0; j < 2; j++) {
+    if (sfs_mount(JOURNAL_TEST_FILENAME) != 0) {
+      fprintf(stderr, "ERROR: mounting %s after the crash\n", JOURNAL_TEST_FILENAME);
+      error_count++;
+      break;
+    }
+    if (sfs_getfilesize("/jd/f7") != -1) {
+      fprintf(stderr, "ERROR: removed file /jd/f7 is back after the crash\n");
+      error_count++;
+    }
+    error_count += journal_check_files(7);
+    sfs_statfs(&st);
+    if (st.f_bfree != bfree) {
+      fprintf(stderr, "ERROR: %ld free blocks after the crash instead of %ld\n",
+              (long)st.f_bfree, (long)bfree);
+      error_count++;
+    }
+    mksfs(0);                   /* Releases the journal test disk. */
+
+    if (j == 0) {
+      fp = fopen(JOURNAL_TEST_FILENAME, "r+b");
+      fseek(fp, sb.journal_start * sb.block_size, SEEK_SET);
+      fwrite(journal, journal_size, 1, fp);
+      fclose(fp);
+    }
+  }
+  free(journal);
+
+  /* A transaction whose checksum does not match (torn by the crash) is
+   * discarded with the ones after it, the previous ones are replayed.
+   */
+  if (fork() == 0) {
+    sfs_mount(JOURNAL_TEST_FILENAME);
+    sfs_sync();
+    sfs_statfs(&st);
+    bfree = st.f_bfree;
+    write(pipefd[1], &bfree, sizeof(bfree));
+    sfs_mkdir("/late");
+    sfs_sync();
+    _exit(0);
+  }
+  read(pipefd[0], &bfree, sizeof(bfree));
+  wait(NULL);
+
+  fp = fopen(JOURNAL_TEST_FILENAME, "r+b");
+  txn_pos = journal_last_txn(fp, &bytes);
+  if (txn_pos == -1) {
+    fprintf(stderr, "ERROR: no transaction of /late in the journal\n");
+    error_count++;
+  }
+  else {
+    fseek(fp, txn_pos + bytes - 1, SEEK_SET);
+    tmp = fgetc(fp);
+    fseek(fp, txn_pos + bytes - 1, SEEK_SET);
+    fputc(tmp ^ 0xff, fp);
+  }
+  fclose(fp);
+
+  if (sfs_mount(JOURNAL_TEST_FILENAME) != 0) {
+    fprintf(stderr, "ERROR: mounting %s with a bad checksum\n", JOURNAL_TEST_FILENAME);
+    error_count++;
+  }
+  else {
+    if (sfs_isdir("/late") != -1) {
+      fprintf(stderr, "ERROR: transaction with a bad checksum replayed\n");
+      error_count++;
+    }
+    error_count += journal_check_files(7);
+    sfs_statfs(&st);
+    if (st.f_bfree != bfree) {
+      fprintf(stderr, "ERROR: %ld free blocks after the bad checksum instead of %ld\n",
+              (long)st.f_bfree, (long)bfree);
+      error_count++;
+    }
+  }
+  close(pipefd[0]);
+  close(pipefd[1]);
+  mksfs(0);                     /* Releases the journal test disk. */
+  remove(JOURNAL_TEST_FILENAME);
+  }
+
   fprintf(stderr, "Test program exiting with %d errors\n", error_count);
   return (error_count);
 }
\ No newline at end of file